@@ -0,0 +1,268 @@
+//////////////////////////////////////////////////////////////////////
+// -*- encoding: utf-8 -*-
+//
+//
+//////////////////////////////////////////////////////////////////////
+
+// C++
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// PGSQLCatalog class definition
+#include "PGSQLCatalog.h"
+
+//////////////////////////////////////////////////////////////////////
+//
+// Snapshot file is a text file, one record per line and fields separated by tab:
+//   C <channel_id> <name>
+//   M <channel_id> <low_disp_rng> <high_disp_rng> <low_warn_lmt> <high_warn_lmt> <low_alarm_lmt> <high_alarm_lmt> <prec> <unit>
+//   E <channel_id> <enum_nbr> <enum_val>
+// Tab, newline and backslash in strings are escaped with backslash.
+//
+static const char *kSnapshotHeader = "# pgsql2pb channel catalog 1";
+
+static void putstr(FILE *fp, const std::string &str)
+{
+   for (size_t i=0; i<str.size(); i++) {
+      switch (str[i]) {
+      case '\t': fputs("\\t",  fp); break;
+      case '\n': fputs("\\n",  fp); break;
+      case '\\': fputs("\\\\", fp); break;
+      default:   fputc(str[i], fp); break;
+      }
+   }
+}
+
+static std::string getstr(const std::string &str)
+{
+   std::string out;
+   out.reserve(str.size());
+   for (size_t i=0; i<str.size(); i++) {
+      if (str[i]=='\\' && i+1<str.size()) {
+         switch (str[++i]) {
+         case 't': out.push_back('\t'); break;
+         case 'n': out.push_back('\n'); break;
+         default:  out.push_back(str[i]); break;
+         }
+      } else {
+         out.push_back(str[i]);
+      }
+   }
+   return out;
+}
+
+static std::vector<std::string> split(const std::string &line)
+{
+   std::vector<std::string> fields;
+   size_t p = 0, q;
+   while ((q=line.find('\t', p))!=std::string::npos) {
+      fields.push_back(line.substr(p, q-p));
+      p = q+1;
+   }
+   fields.push_back(line.substr(p));
+   return fields;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Ctor
+//
+PGSQLCatalog::PGSQLCatalog()
+:fChannel()
+,fByName()
+,fById()
+{
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Add a channel, of which metadata is filled by the caller.
+// The reference is valid until the next add().
+//
+PGSQLCatalog::channel_t &PGSQLCatalog::add(const std::string &name, int channel_id)
+{
+   channel_t ch;
+   ch.name        = name;
+   ch.channel_id  = channel_id;
+   ch.hasMetadata = 0;
+   ch.displayHigh = 0;
+   ch.displayLow  = 0;
+   ch.highAlarm   = 0;
+   ch.lowAlarm    = 0;
+   ch.highWarning = 0;
+   ch.lowWarning  = 0;
+   ch.precision   = 0;
+
+   fByName[name] = fChannel.size();
+   fById[channel_id] = fChannel.size();
+   fChannel.push_back(ch);
+   return fChannel.back();
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Lookup by PV name or by channel_id, NULL if not found
+//
+const PGSQLCatalog::channel_t *PGSQLCatalog::find(const std::string &name) const
+{
+   std::unordered_map<std::string, size_t>::const_iterator itr = fByName.find(name);
+   if (itr==fByName.end()) {
+      return 0;
+   }
+   return &fChannel[itr->second];
+}
+
+const PGSQLCatalog::channel_t *PGSQLCatalog::findById(int channel_id) const
+{
+   std::unordered_map<int, size_t>::const_iterator itr = fById.find(channel_id);
+   if (itr==fById.end()) {
+      return 0;
+   }
+   return &fChannel[itr->second];
+}
+
+PGSQLCatalog::channel_t *PGSQLCatalog::findById(int channel_id)
+{
+   std::unordered_map<int, size_t>::const_iterator itr = fById.find(channel_id);
+   if (itr==fById.end()) {
+      return 0;
+   }
+   return &fChannel[itr->second];
+}
+
+void PGSQLCatalog::clear()
+{
+   fChannel.clear();
+   fByName.clear();
+   fById.clear();
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Read snapshot file, returns number of channels or 0 on failure
+//
+int PGSQLCatalog::read(const std::string &file)
+{
+   FILE *fp = fopen(file.c_str(), "r");
+   if (!fp) {
+      return 0;
+   }
+
+   clear();
+
+   std::string line;
+   int lineno = 0;
+   int ok = 1;
+   for (;;) {
+      int c;
+      line.clear();
+      while ((c=fgetc(fp))!=EOF && c!='\n') {
+         line.push_back(c);
+      }
+      if (c==EOF && line.empty()) {
+         break;
+      }
+      lineno++;
+
+      if (lineno==1) {
+         if (line!=kSnapshotHeader) {
+            printf("ERROR: %s: not a catalog snapshot\n", file.c_str());
+            ok = 0;
+            break;
+         }
+         continue;
+      }
+
+      std::vector<std::string> f = split(line);
+      const int id = f.size()>1 ? atoi(f[1].c_str()) : 0;
+      channel_t *ch = 0;
+      if (f[0]=="C" && f.size()==3) {
+         add(getstr(f[2]), id);
+      } else if (f[0]=="M" && f.size()==10 && (ch=findById(id))) {
+         ch->hasMetadata = 1;
+         ch->displayLow  = strtod(f[2].c_str(), 0);
+         ch->displayHigh = strtod(f[3].c_str(), 0);
+         ch->lowWarning  = strtod(f[4].c_str(), 0);
+         ch->highWarning = strtod(f[5].c_str(), 0);
+         ch->lowAlarm    = strtod(f[6].c_str(), 0);
+         ch->highAlarm   = strtod(f[7].c_str(), 0);
+         ch->precision   = atoi(f[8].c_str());
+         ch->units       = getstr(f[9]);
+      } else if (f[0]=="E" && f.size()==4 && (ch=findById(id))) {
+         const size_t nbr = atoi(f[2].c_str());
+         if (nbr>=ch->states.size()) {
+            ch->states.resize(nbr+1);
+         }
+         ch->states[nbr] = getstr(f[3]);
+      } else {
+         printf("ERROR: %s:%d: broken catalog snapshot\n", file.c_str(), lineno);
+         ok = 0;
+         break;
+      }
+   }
+
+   fclose(fp);
+   if (!ok) {
+      clear();
+      return 0;
+   }
+   return fChannel.size();
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Write snapshot file, returns number of channels or 0 on failure
+//
+int PGSQLCatalog::write(const std::string &file) const
+{
+   // write to a temporary file first, so that a reader never sees a partial snapshot
+   const std::string tmp = file + ".tmp";
+   FILE *fp = fopen(tmp.c_str(), "w");
+   if (!fp) {
+      printf("ERROR: cannot write catalog snapshot: %s\n", tmp.c_str());
+      return 0;
+   }
+
+   fprintf(fp, "%s\n", kSnapshotHeader);
+   for (size_t i=0; i<fChannel.size(); i++) {
+      const channel_t &ch = fChannel[i];
+      fprintf(fp, "C\t%d\t", ch.channel_id);
+      putstr(fp, ch.name);
+      fputc('\n', fp);
+   }
+   for (size_t i=0; i<fChannel.size(); i++) {
+      const channel_t &ch = fChannel[i];
+      if (ch.hasMetadata) {
+         fprintf(fp, "M\t%d\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\t%d\t"
+                 , ch.channel_id
+                 , ch.displayLow
+                 , ch.displayHigh
+                 , ch.lowWarning
+                 , ch.highWarning
+                 , ch.lowAlarm
+                 , ch.highAlarm
+                 , ch.precision
+                 );
+         putstr(fp, ch.units);
+         fputc('\n', fp);
+      }
+      for (size_t j=0; j<ch.states.size(); j++) {
+         fprintf(fp, "E\t%d\t%zd\t", ch.channel_id, j);
+         putstr(fp, ch.states[j]);
+         fputc('\n', fp);
+      }
+   }
+
+   const int err = ferror(fp);
+   if (fclose(fp)!=0 || err || rename(tmp.c_str(), file.c_str())!=0) {
+      printf("ERROR: cannot write catalog snapshot: %s\n", file.c_str());
+      remove(tmp.c_str());
+      return 0;
+   }
+   return fChannel.size();
+}
+
+//////////////////////////////////////////////////////////////////////
+// end
+//////////////////////////////////////////////////////////////////////
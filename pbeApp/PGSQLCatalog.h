@@ -0,0 +1,57 @@
+//////////////////////////////////////////////////////////////////////
+// -*- encoding: utf-8 -*-
+//
+// In-memory copy of the channel, num_metadata and enum_metadata tables,
+// so that the per PV lookups do not need round trips to the RDB.
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef PGSQL_CATALOG_H
+#define PGSQL_CATALOG_H
+
+// C++
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+//////////////////////////////////////////////////////////////////////
+class PGSQLCatalog {
+public:
+   PGSQLCatalog();
+
+   //
+   typedef struct {
+      std::string               name;
+      int                       channel_id;
+      int                       hasMetadata;
+      double                    displayHigh;
+      double                    displayLow;
+      double                    highAlarm;
+      double                    lowAlarm;
+      double                    highWarning;
+      double                    lowWarning;
+      int                       precision;
+      std::string               units;
+      std::vector<std::string>  states;
+   } channel_t;
+
+   // filled by PGSQLReader::readCatalog()
+   channel_t                &add(const std::string &name, int channel_id);
+   channel_t                *findById(int channel_id);
+
+   const channel_t          *find(const std::string &name) const;
+   const channel_t          *findById(int channel_id) const;
+   size_t                    size() const                { return fChannel.size(); }
+   void                      clear();
+
+   // snapshot file
+   int                       read(const std::string &file);
+   int                       write(const std::string &file) const;
+
+protected:
+   std::vector<channel_t>                  fChannel;
+   std::unordered_map<std::string, size_t> fByName;
+   std::unordered_map<int, size_t>         fById;
+};
+
+#endif
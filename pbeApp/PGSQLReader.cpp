@@ -9,6 +9,13 @@
 #include <iostream>
 #include <sstream>
 #include <cstring>
+#include <cmath>
+#include <climits>
+
+// POSIX
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 // EPICS base
 #include <alarm.h>
@@ -17,6 +24,7 @@
 
 // PGSQLReader class definition
 #include "PGSQLReader.h"
+#include "pbeutil.h"
 
 //////////////////////////////////////////////////////////////////////
 //
@@ -24,48 +32,285 @@
 //
 static const char *timefmt0 = "%Y-%m-%dT%H:%M:%S";
 static const char *timefmt1 = "%Y-%m-%d %H:%M:%S";
+
+// Local time in timefmt0. localtime_r() is called once in 15 minutes of sec,
+// as the UTC offset changes only at a quarter of an hour.
 char *PGSQLReader::time2str(const time_t sec)
 {
-   struct  tm     *tm = localtime(&sec);
-   const   size_t  len = 128;
-   static  char    buf[len];
-   strftime(buf, len, timefmt0, tm);
-   //printf("%s\n", buf);
+   static  thread_local char      buf[32]; // valid until the next call in the same thread
+   static  thread_local long long lastQuarter = LLONG_MIN;
+   static  thread_local long      lastOffset = 0;
+
+   long long quarter = sec / 900;
+   if (sec % 900 < 0) {
+      quarter -= 1;
+   }
+   if (quarter != lastQuarter) {
+      struct tm tm;
+      localtime_r(&sec, &tm);
+      lastOffset = tm.tm_gmtoff;
+      lastQuarter = quarter;
+   }
+
+   formatIsoTime((long long)sec + lastOffset, buf);
    return buf;
 }
 
+// Local time, unless the string has a UTC offset. The common formats are
+// parsed by parseIsoTime(), the others by strptime().
 time_t PGSQLReader::str2time(const char *str)
 {
+   long long wall;
+   int hasoffset;
+   long offset;
+   if (parseIsoTime(str, &wall, &hasoffset, &offset)) {
+      if (hasoffset) {
+         return wall - offset;
+      }
+      return localwall2time(wall);
+   }
+
+   // other formats accepted by strptime
    struct tm tm;
    char  *p;
 
+   memset(&tm, 0, sizeof(tm));
    p = strptime(str, timefmt0, &tm);
-   //printf("[%ld]\n", p);
    if (!p) {
       p = strptime(str, timefmt1, &tm);
-      //printf("[%ld]\n", p);
    }
 
    if (!p) {
-      printf("ERROR parsing time: %s\n", str);
+      pvlog_printf("ERROR parsing time: %s\n", str);
       exit(-1);
    }
 
+   tm.tm_isdst = -1;
    return timelocal(&tm);
 }
 
+//////////////////////////////////////////////////////////////////////
+//
+// Chunk size control of FETCH_CHUNK
+//
+static const int    kChunkMin        = 100;
+static const int    kChunkMax        = 1000000;
+static const double kChunkMaxLatency = 0.5; // [sec] per round trip
+static const double kRoundTripRatio  = 0.1; // round trip relative to decode time
+
+static double monotonic()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Decoding of the binary format, which is in network byte order
+//
+
+// Type OIDs from catalog/pg_type.h, which is not a part of the libpq headers
+#define INT8OID        20
+#define INT2OID        21
+#define INT4OID        23
+#define FLOAT4OID      700
+#define FLOAT8OID      701
+#define TIMESTAMPOID   1114
+#define TIMESTAMPTZOID 1184
+#define NUMERICOID     1700
+
+#define POSIX_TIME_AT_POSTGRES_EPOCH 946684800 // 2000-01-01T00:00:00Z
+
+// Signature of COPY in binary format
+static const char kCopySignature[] = "PGCOPY\n\377\r\n";
+static const int  kCopySignatureLen = 11; // including the trailing '\0'
+
+static inline uint16_t pgbin16(const char *p)
+{
+   uint16_t v;
+   memcpy(&v, p, sizeof(v));
+   return ntohs(v);
+}
+
+static inline uint32_t pgbin32(const char *p)
+{
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return ntohl(v);
+}
+
+static inline uint64_t pgbin64(const char *p)
+{
+   return (uint64_t(pgbin32(p)) << 32) | pgbin32(p+4);
+}
+
+// NUMERIC is a sequence of base-10000 digits
+static bool pgnumeric2double(const char *p, int len, double *v)
+{
+   if (len<8) {
+      return false;
+   }
+   const int ndigits = int16_t(pgbin16(p));
+   const int weight  = int16_t(pgbin16(p+2));
+   const int sign    = pgbin16(p+4);
+   if (ndigits<0 || len<8+2*ndigits) {
+      return false;
+   }
+   if (sign==0xC000) {
+      *v = NAN;
+      return true;
+   }
+
+   double val = 0;
+   for (int i=0; i<ndigits; i++) {
+      val = val*10000 + pgbin16(p+8+2*i);
+   }
+   if (ndigits>0) {
+      val *= pow(10000., weight-(ndigits-1));
+   }
+   *v = (sign==0x4000) ? -val : val;
+   return true;
+}
+
+static bool pgbin2double(const char *p, int len, Oid type, double *v)
+{
+   switch(type) {
+   case INT2OID:
+      if (len!=2) return false;
+      *v = int16_t(pgbin16(p));
+      return true;
+   case INT4OID:
+      if (len!=4) return false;
+      *v = int32_t(pgbin32(p));
+      return true;
+   case INT8OID:
+      if (len!=8) return false;
+      *v = int64_t(pgbin64(p));
+      return true;
+   case FLOAT4OID: {
+      if (len!=4) return false;
+      const uint32_t u = pgbin32(p);
+      float f;
+      memcpy(&f, &u, sizeof(f));
+      *v = f;
+      return true;
+   }
+   case FLOAT8OID: {
+      if (len!=8) return false;
+      const uint64_t u = pgbin64(p);
+      memcpy(v, &u, sizeof(*v));
+      return true;
+   }
+   case NUMERICOID:
+      return pgnumeric2double(p, len, v);
+   default:
+      return false;
+   }
+}
+
+static bool pgbin2int(const char *p, int len, Oid type, long long *v)
+{
+   switch(type) {
+   case INT2OID:
+      if (len!=2) return false;
+      *v = int16_t(pgbin16(p));
+      return true;
+   case INT4OID:
+      if (len!=4) return false;
+      *v = int32_t(pgbin32(p));
+      return true;
+   case INT8OID:
+      if (len!=8) return false;
+      *v = int64_t(pgbin64(p));
+      return true;
+   default: {
+      // same as sscanf(" %d "), i.e. fractional part is dropped
+      double d;
+      if (!pgbin2double(p, len, type, &d)) return false;
+      *v = (long long)d;
+      return true;
+   }
+   }
+}
+
+// Seconds since 1970-01-01T00:00:00 in the wall clock of the column,
+// fractional part will be lost.
+static bool pgbin2wall(const char *p, int len, int integer_datetimes, long long *sec)
+{
+   if (len!=8) {
+      return false;
+   }
+   if (integer_datetimes) {
+      const int64_t usec = int64_t(pgbin64(p));
+      *sec = usec / 1000000;
+      if (usec % 1000000 < 0) {
+         *sec -= 1;
+      }
+   } else {
+      const uint64_t u = pgbin64(p);
+      double d;
+      memcpy(&d, &u, sizeof(d));
+      *sec = floor(d);
+   }
+   *sec += POSIX_TIME_AT_POSTGRES_EPOCH;
+   return true;
+}
+
 //////////////////////////////////////////////////////////////////////
 //
 // Ctor
 //
 PGSQLReader::PGSQLReader(const char *server, const char *dbname, const char *user, const char *passwd, const char *port, const int verbose)
-:fVerbose(verbose)
+:PGSQLReader()
+{
+   fVerbose = verbose;
+   fConn = PQsetdbLogin(server, port, NULL, NULL, dbname, user, passwd);
+   if (PQstatus(fConn) == CONNECTION_BAD) {
+      pvlog_printf("ERROR: %s\n", PQerrorMessage(fConn));
+      exit(-1); // we'd beeter throw exception
+   }
+   tzset();
+
+   // timestamps are sent as 8-byte integers unless the server was built with float datetimes
+   const char *idt = PQparameterStatus(fConn, "integer_datetimes");
+   fIntegerDatetimes = !idt || strcmp(idt, "on")==0;
+
+   readSeverity();
+   readStatus();
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Ctor without a connection, for the tests
+//
+PGSQLReader::PGSQLReader()
+:fVerbose(0)
+,fCatalog(0)
+,fFetchMode(FETCH_TEXT)
+,fIntegerDatetimes(1)
+,fColumnTypeValid(0)
+,fCopyHeader(0)
+,fChunkSize(1000)
+,fInCursor(0)
+,fGroup()
+,fGroupActive(0)
+,fGroupPending(0)
+,fGroupPendingId(0)
+,fMCVRows()
+,fOtherRows(0)
+,fConn(0)
 ,fSample()
+,fCurrent(&fSample)
+,fBatch()
+,fBatchPos(0)
 ,fPVname("")
 ,fChannelId(0)
 ,fDBRtype(-1)
 ,fSeverity(ALARM_NSEV)
 ,fStatus(ALARM_NSTATUS)
+,fSeverityIndex()
+,fStatusIndex()
 ,fDisplayHigh(0)
 ,fDisplayLow(0)
 ,fHighAlarm(0)
@@ -76,16 +321,9 @@ PGSQLReader::PGSQLReader(const char *server, const char *dbname, const char *use
 ,fUnits("")
 ,fNumStates(0)
 ,fState(0)
+,fStartTime(0)
+,fEndTime(0)
 {
-   fConn = PQsetdbLogin(server, port, NULL, NULL, dbname, user, passwd);
-   if (PQstatus(fConn) == CONNECTION_BAD) {
-      printf("ERROR: %s\n", PQerrorMessage(fConn));
-      exit(-1); // we'd beeter throw exception
-   }
-   tzset();
-
-   readSeverity();
-   readStatus();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -108,70 +346,207 @@ PGSQLReader::data_t *PGSQLReader::find(const std::string &pvname, const int dbr,
    fPVname = pvname;
    fDBRtype = dbr;
 
-   if (readChannelId()<=0) {
-      printf("ERROR: PV not found: %s\n", fPVname.c_str());
-      return 0;
+   if (fCatalog) {
+      if (readCatalogEntry()<=0) {
+         pvlog_printf("ERROR: PV not found: %s\n", fPVname.c_str());
+         return 0;
+      }
+   } else {
+      if (readChannelId()<=0) {
+         pvlog_printf("ERROR: PV not found: %s\n", fPVname.c_str());
+         return 0;
+      }
+
+      readMetadata();
+      readEnum();
    }
 
-   readMetadata();
-   readEnum();
+   fBatch.clear();
+   fBatchPos = 0;
+
+   if (fGroupActive) {
+      if (std::binary_search(fGroup.begin(), fGroup.end(), fChannelId)) {
+         // continue the stream of the group query
+         if (readSample()) {
+            if (start.empty()) {
+               start = time2str(fCurrent->stamp.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH);
+            }
+            return fCurrent;
+         }
+         pvlog_printf("Warning: no data in the query window: %s [%s %s]\n", fPVname.c_str(), start.c_str(), end.c_str());
+         return 0;
+      }
+      endGroup();
+   }
 
-   setStartTime(start);
-   setEndTime(end);
+   if (start.empty() && end.empty()) {
+      readTimeRange(start, end);
+   } else {
+      setStartTime(start);
+      setEndTime(end);
+   }
 
-   setSingleRowModeQuery();
+   setSampleQuery();
 
-   if (fVerbose>0) printf("#####\n#%s\n", __func__);
+   if (fVerbose>0) pvlog_printf("#####\n#%s\n", __func__);
 
    if (readSample()) {
-      return &fSample;
+      return fCurrent;
    }
 
-   printf("Warning: no data in the query window: %s [%s %s]\n", fPVname.c_str(), start.c_str(), end.c_str());
+   pvlog_printf("Warning: no data in the query window: %s [%s %s]\n", fPVname.c_str(), start.c_str(), end.c_str());
    return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
 //
-// Read the next sample
+// Skip samples up to the given time, by issuing the query again from that
+// second instead of reading through the rows before it.
+// get() returns the first sample after the time, or NULL if there is none.
+// Returns 0, when the query cannot be restarted, i.e. in the group query.
+//
+int PGSQLReader::seek(const epicsTimeStamp &stamp)
+{
+   if (fGroupActive) {
+      return 0;
+   }
+
+   cancelQuery();
+
+   fBatch.clear();
+   fBatchPos = 0;
+   fCurrent = 0;
+
+   // The window begins at the second, the samples before the nanoseconds are dropped below
+   fStartTime = stamp.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH;
+   if (fStartTime > fEndTime) {
+      return 1;
+   }
+   if (fVerbose>0) pvlog_printf("#####\n#%s %s\n", __func__, time2str(fStartTime));
+
+   setSampleQuery();
+
+   for (data_t *samp = readSample() ? fCurrent : 0; samp; samp = next()) {
+      if (samp->stamp.secPastEpoch > stamp.secPastEpoch ||
+          (samp->stamp.secPastEpoch == stamp.secPastEpoch && samp->stamp.nsec > stamp.nsec)) {
+         return 1;
+      }
+   }
+
+   fCurrent = 0;
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Append samples to the columns of the batch, from the current one on.
+// get() is then the first sample left, or NULL at the end of the query.
+//
+template<int dbr>
+static size_t moveSamples(PGSQLReader &reader, SampleBatch &batch, size_t max)
+{
+   typedef typename batchcolumn<dbr>::type value_t;
+   std::vector<value_t> &values = batchcolumn<dbr>::of(batch);
+   size_t n = 0;
+   for (const PGSQLReader::data_t *s = reader.get(); s && n<max; s = reader.next()) {
+      batch.pushStamp(s->stamp, s->severity, s->status);
+      values.push_back(reinterpret_cast<const typename batchcolumn<dbr>::dbrtype*>(s)->value);
+      n++;
+   }
+   return n;
+}
+
+size_t PGSQLReader::readBatch(SampleBatch &batch, size_t max)
+{
+   if (batch.empty()) {
+      batch.clear(fDBRtype);
+   }
+
+   size_t n = 0;
+   switch(fDBRtype) {
+   case DBR_TIME_ENUM:
+      n = moveSamples<DBR_TIME_ENUM>(*this, batch, max);
+      break;
+   case DBR_TIME_LONG:
+      n = moveSamples<DBR_TIME_LONG>(*this, batch, max);
+      break;
+   case DBR_TIME_DOUBLE:
+      n = moveSamples<DBR_TIME_DOUBLE>(*this, batch, max);
+      break;
+   default:
+      pvlog_printf("ERROR: Unsupported DBRTYPE: %d\n", fDBRtype);
+      exit(-1);
+   }
+   return n;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Read the next sample, when the current chunk is exhausted.
+// At the end of the query get() is NULL as well, in every fetch mode.
 //
-PGSQLReader::data_t *PGSQLReader::next()
+PGSQLReader::data_t *PGSQLReader::readNext()
 {
    if (readSample()) {
-      return &fSample;
+      return fCurrent;
    }
 
-   return 0;
+   return fCurrent = 0;
 }
 
 //////////////////////////////////////////////////////////////////////
 //
-// map severity_id in the RDB to severity in EPICS base
+// Index severity_id/status_id in the RDB for getSeverity()/getStatus().
+// The ids are small and dense in practice, so they index an array.
+// The first entry of an id wins, and an unknown id maps to -(n+1),
+// as with the linear search this replaces.
 //
-int PGSQLReader::getSeverity(int rdbid)
+void PGSQLReader::buildAlarmIndex(const std::vector<alarm_t> &alarms, alarmindex_t &index)
 {
-   const int n = fSeverity.size();
+   const int n = alarms.size();
+   index.miss = -(n+1);
+   index.sparse.clear();
+
+   int ndense = 0;
    for(int i=0; i<n; i++) {
-      if (fSeverity[i].rdbid == rdbid) {
-         return fSeverity[i].epicsid;
+      const int rdbid = alarms[i].rdbid;
+      if (rdbid >= ndense && rdbid < kDenseAlarmIds) {
+         ndense = rdbid+1;
+      }
+   }
+   index.dense.assign(ndense, index.miss);
+
+   for(int i=n-1; i>=0; i--) {
+      const int rdbid = alarms[i].rdbid;
+      if (rdbid >= 0 && rdbid < ndense) {
+         index.dense[rdbid] = alarms[i].epicsid;
+      } else {
+         index.sparse[rdbid] = alarms[i].epicsid;
       }
    }
-   return -(n+1);
 }
 
 //////////////////////////////////////////////////////////////////////
 //
-// map status_id in the RDB to alarm condition in EPICS base
+// statusClass() of the statuses below kStatusClasses
 //
-int PGSQLReader::getStatus(int rdbid)
+const PGSQLReader::statusclasstable_t PGSQLReader::fStatusClass;
+
+PGSQLReader::statusclasstable_t::statusclasstable_t()
 {
-   const int n = fStatus.size();
-   for(int i=0; i<n; i++) {
-      if (fStatus[i].rdbid == rdbid) {
-         return fStatus[i].epicsid;
-      }
+   for(int i=0; i<kStatusClasses; i++) {
+      cls[i] = i >= 3000 ? STAT_SPECIAL : STAT_ALARM;
    }
-   return -(n+1);
+   // sevr                     ArchiveDataClient.pl
+   // stat                     RDB archiver
+   // 3904 : Disconnected      "ARCH_DISCONNECT"
+   // 3872 : Archive Off       "ARCH_STOPPED"
+   // 3848 : Archive Disabled  "ARCH_DISABLED"
+   // 3976 : Write_Error       CSS Archive specific
+   cls[3904] = STAT_DISCONNECT;
+   cls[3872] = STAT_STOPPED;
+   cls[3848] = STAT_STOPPED;
+   cls[3976] = STAT_STOPPED;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -186,7 +561,7 @@ int PGSQLReader::readChannelId()
 
    // Error check
    if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
-      printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
       exit(-1);
    }
 
@@ -198,18 +573,18 @@ int PGSQLReader::readChannelId()
    if (nrow == 1) {
       char *str = PQgetvalue(resp, 0, 0);
       if (sscanf(str, " %d ", &fChannelId) == 1) {
-         if (fVerbose>0) printf("#####\n# %s %d\n", fPVname.c_str(), fChannelId);
+         if (fVerbose>0) pvlog_printf("#####\n# %s %d\n", fPVname.c_str(), fChannelId);
       } else {
          // this may not happen.
-         printf("ERROR: PV found but no channel_id: %s\n", fPVname.c_str());
+         pvlog_printf("ERROR: PV found but no channel_id: %s\n", fPVname.c_str());
          exit(-1);
       }
    } else if (nrow==0) {
       // Return 0 silently when specified PV not found.
-      // printf("ERROR: PV not found: %s\n", fPVname.c_str());
+      // pvlog_printf("ERROR: PV not found: %s\n", fPVname.c_str());
    } else if (nrow>1) {
       // this may not happen
-      printf("ERROR: found multiple ID for PV: %s\n", fPVname.c_str());
+      pvlog_printf("ERROR: found multiple ID for PV: %s\n", fPVname.c_str());
       exit(-1);
    }
 
@@ -230,7 +605,7 @@ int PGSQLReader::readSeverity()
 
    // Error check
    if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
-      printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
       exit(-1);
    }
 
@@ -240,7 +615,7 @@ int PGSQLReader::readSeverity()
       fSeverity.resize(nrow); //
    }
 
-   if (fVerbose>0) printf("#####\n# severity\n");
+   if (fVerbose>0) pvlog_printf("#####\n# severity\n");
    for(unsigned i=0; i<nrow; i++) {
       int         &epicsid = fSeverity[i].epicsid;
       int         &rdbid   = fSeverity[i].rdbid;
@@ -263,8 +638,9 @@ int PGSQLReader::readSeverity()
          }
       }
 
-      if (fVerbose>0) printf("# rdb:%4d epics:%4d %s\n" , fSeverity[i].rdbid, fSeverity[i].epicsid, fSeverity[i].rdbstr.c_str());
+      if (fVerbose>0) pvlog_printf("# rdb:%4d epics:%4d %s\n" , fSeverity[i].rdbid, fSeverity[i].epicsid, fSeverity[i].rdbstr.c_str());
    }
+   buildAlarmIndex(fSeverity, fSeverityIndex);
 
    // Clean-up
    PQclear(resp);
@@ -283,7 +659,7 @@ int PGSQLReader::readStatus()
 
    // Error check
    if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
-      printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
       exit(-1);
    }
 
@@ -293,7 +669,7 @@ int PGSQLReader::readStatus()
       fStatus.resize(nrow); //
    }
 
-   if (fVerbose>0) printf("#####\n# status\n");
+   if (fVerbose>0) pvlog_printf("#####\n# status\n");
    for(unsigned i=0; i<nrow; i++) {
       int         &epicsid = fStatus[i].epicsid;
       int         &rdbid   = fStatus[i].rdbid;
@@ -331,8 +707,9 @@ int PGSQLReader::readStatus()
          }
       }
 
-      if (fVerbose>0) printf("# rdb:%4d epics:%4d %s\n" , fStatus[i].rdbid, fStatus[i].epicsid, fStatus[i].rdbstr.c_str());
+      if (fVerbose>0) pvlog_printf("# rdb:%4d epics:%4d %s\n" , fStatus[i].rdbid, fStatus[i].epicsid, fStatus[i].rdbstr.c_str());
    }
+   buildAlarmIndex(fStatus, fStatusIndex);
 
    // Clean-up
    PQclear(resp);
@@ -355,7 +732,7 @@ int PGSQLReader::readMetadata()
 
    // Error check
    if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
-      printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
       exit(-1);
    }
 
@@ -376,8 +753,8 @@ int PGSQLReader::readMetadata()
       fUnits = PQgetvalue(resp, 0, 8);
 
       if (fVerbose>0) {
-         printf("#####\n# metadata\n#");
-         printf(" [%+11.3le:%+11.3le] [%+11.3le:%+11.3le] [%+11.3le:%+11.3le] %3d [%s]\n"
+         pvlog_printf("#####\n# metadata\n#");
+         pvlog_printf(" [%+11.3le:%+11.3le] [%+11.3le:%+11.3le] [%+11.3le:%+11.3le] %3d [%s]\n"
                 , fDisplayLow
                 , fDisplayHigh
                 , fLowWarning
@@ -389,12 +766,20 @@ int PGSQLReader::readMetadata()
                 );
       }
    } else if (nrow==0) {
-      // no metadata
+      // no metadata, do not inherit those of the previous PV
       retval = 1;
+      fDisplayLow  = 0;
+      fDisplayHigh = 0;
+      fLowWarning  = 0;
+      fHighWarning = 0;
+      fLowAlarm    = 0;
+      fHighAlarm   = 0;
+      fPrecision   = 0;
+      fUnits       = "";
       //printf("#####\n# metadata not found\n");
    } else {
       // this shall not happen
-      printf("ERROR: found multiple metadata for ID: %d\n", fChannelId);
+      pvlog_printf("ERROR: found multiple metadata for ID: %d\n", fChannelId);
       exit(-1);
    }
 
@@ -419,7 +804,7 @@ int PGSQLReader::readEnum()
 
    // Error check
    if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
-      printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
       exit(-1);
    }
 
@@ -428,27 +813,27 @@ int PGSQLReader::readEnum()
    // Query results
    const int nrow = PQntuples(resp);
    if (nrow==0) {
-      // printf("#####\n# enum states not found\n");
+      // pvlog_printf("#####\n# enum states not found\n");
    } else {
       // get maximum
       sscanf(PQgetvalue(resp, nrow-1, 1), " %d ", &fNumStates);
       fNumStates ++;
-      fState.resize(fNumStates);
+      fState.assign(fNumStates, "");
 
-      if (fVerbose>0) printf("#####\n# enum\n#");
+      if (fVerbose>0) pvlog_printf("#####\n# enum\n#");
       for (int i=0; i<nrow; i++) {
          size_t      nbr = 0;
          sscanf(PQgetvalue(resp, i, 1), " %zd ", &nbr);
          std::string str = PQgetvalue(resp, i, 2);
          fState[nbr] = str;
          if (fVerbose>0) {
-            printf(" %2zd: [%s]"
+            pvlog_printf(" %2zd: [%s]"
                    , nbr
                    , str.c_str()
                    );
          }
       }
-      if (fVerbose>0) printf("\n");
+      if (fVerbose>0) pvlog_printf("\n");
    }
 
    // Clean-up
@@ -456,6 +841,167 @@ int PGSQLReader::readEnum()
    return fNumStates;
 }
 
+//////////////////////////////////////////////////////////////////////
+//
+// Bulk load channel, num_metadata and enum_metadata into the catalog
+//
+int PGSQLReader::readCatalog(PGSQLCatalog &catalog)
+{
+   catalog.clear();
+
+   // channel
+   PGresult *resp = PQexec(fConn, "SELECT channel_id, name FROM channel");
+   if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   int nrow = PQntuples(resp);
+   for (int i=0; i<nrow; i++) {
+      int id = 0;
+      sscanf(PQgetvalue(resp, i, 0), " %d ", &id);
+      catalog.add(PQgetvalue(resp, i, 1), id);
+   }
+   PQclear(resp);
+
+   // num_metadata
+   resp = PQexec(fConn,
+                 " SELECT channel_id, low_disp_rng, high_disp_rng, low_warn_lmt, high_warn_lmt, low_alarm_lmt, high_alarm_lmt, prec, unit"
+                 " FROM num_metadata");
+   if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   nrow = PQntuples(resp);
+   for (int i=0; i<nrow; i++) {
+      int id = 0;
+      sscanf(PQgetvalue(resp, i, 0), " %d ", &id);
+      PGSQLCatalog::channel_t *ch = catalog.findById(id);
+      if (!ch) {
+         continue;
+      }
+      ch->hasMetadata = 1;
+      sscanf(PQgetvalue(resp, i, 1), " %lf ", &ch->displayLow);
+      sscanf(PQgetvalue(resp, i, 2), " %lf ", &ch->displayHigh);
+      sscanf(PQgetvalue(resp, i, 3), " %lf ", &ch->lowWarning);
+      sscanf(PQgetvalue(resp, i, 4), " %lf ", &ch->highWarning);
+      sscanf(PQgetvalue(resp, i, 5), " %lf ", &ch->lowAlarm);
+      sscanf(PQgetvalue(resp, i, 6), " %lf ", &ch->highAlarm);
+      sscanf(PQgetvalue(resp, i, 7), " %d ",  &ch->precision);
+      ch->units = PQgetvalue(resp, i, 8);
+   }
+   PQclear(resp);
+
+   // enum_metadata
+   resp = PQexec(fConn, "SELECT channel_id, enum_nbr, enum_val FROM enum_metadata");
+   if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   nrow = PQntuples(resp);
+   for (int i=0; i<nrow; i++) {
+      int    id  = 0;
+      size_t nbr = 0;
+      sscanf(PQgetvalue(resp, i, 0), " %d ", &id);
+      sscanf(PQgetvalue(resp, i, 1), " %zd ", &nbr);
+      PGSQLCatalog::channel_t *ch = catalog.findById(id);
+      if (!ch) {
+         continue;
+      }
+      if (nbr>=ch->states.size()) {
+         ch->states.resize(nbr+1);
+      }
+      ch->states[nbr] = PQgetvalue(resp, i, 2);
+   }
+   PQclear(resp);
+
+   if (fVerbose>0) pvlog_printf("#####\n# catalog: %zd channels\n", catalog.size());
+   return catalog.size();
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Take channel_id, metadata and ENUM labels of the PV from the catalog
+//
+int PGSQLReader::readCatalogEntry()
+{
+   const PGSQLCatalog::channel_t *ch = fCatalog->find(fPVname);
+   if (!ch) {
+      fChannelId = 0;
+      return 0;
+   }
+
+   fChannelId   = ch->channel_id;
+   fDisplayLow  = ch->displayLow;
+   fDisplayHigh = ch->displayHigh;
+   fLowWarning  = ch->lowWarning;
+   fHighWarning = ch->highWarning;
+   fLowAlarm    = ch->lowAlarm;
+   fHighAlarm   = ch->highAlarm;
+   fPrecision   = ch->precision;
+   fUnits       = ch->units;
+   fNumStates   = ch->states.size();
+   fState       = ch->states;
+
+   if (fVerbose>0) pvlog_printf("#####\n# %s %d (catalog)\n", fPVname.c_str(), fChannelId);
+   return fChannelId;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// set both start and end time of the query from the first and last sample,
+// in a single round trip
+//
+int PGSQLReader::readTimeRange(std::string &start, std::string &end)
+{
+   fStartTime = -1;
+   fEndTime = -1;
+
+   const int nrow = readTimeRange(fChannelId, fStartTime, fEndTime);
+   if (nrow>0) {
+      start = time2str(fStartTime);
+      fEndTime += 1 ; // add extra 1 second for end of the time window
+      end = time2str(fEndTime);
+      if (fVerbose>0) pvlog_printf("#####\n#start %s\n#####\n#end %s\n", start.c_str(), end.c_str());
+   }
+   return nrow;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// UNIX time of the first and last sample of a channel, without starting the sample query.
+// Returns 0 when there is no sample.
+//
+int PGSQLReader::readTimeRange(int channel_id, double &first, double &last)
+{
+   std::ostringstream query;
+   query
+         << " SELECT min(smpl_time), max(smpl_time)"
+         << " FROM sample"
+         << " WHERE channel_id=" << channel_id
+         ;
+
+   PGresult *resp = PQexec(fConn, query.str().c_str());
+
+   // Error check
+   if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+
+   // Query result, NULL when there is no sample
+   int nrow = PQntuples(resp);
+   if (nrow==1 && !PQgetisnull(resp, 0, 0) && !PQgetisnull(resp, 0, 1)) {
+      first = str2time(PQgetvalue(resp, 0, 0));
+      last  = str2time(PQgetvalue(resp, 0, 1));
+   } else {
+      nrow = 0;
+   }
+
+   // Clean-up
+   PQclear(resp);
+   return nrow;
+}
+
 //////////////////////////////////////////////////////////////////////
 //
 // set start time of the query, otherwise read timestamp (in localtime) of the first sample
@@ -466,7 +1012,7 @@ int PGSQLReader::setStartTime(std::string &timestr)
       // Normalize given time
       fStartTime = str2time(timestr.c_str());
       timestr = time2str(fStartTime);
-      if (fVerbose>0) printf("#####\n#start %s\n", timestr.c_str());
+      if (fVerbose>0) pvlog_printf("#####\n#start %s\n", timestr.c_str());
       return 1;
    }
 
@@ -482,7 +1028,7 @@ int PGSQLReader::setStartTime(std::string &timestr)
 
    // Error check
    if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
-      printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
       exit(-1);
    }
 
@@ -495,7 +1041,7 @@ int PGSQLReader::setStartTime(std::string &timestr)
       char *s = PQgetvalue(resp, 0, 0);
       fStartTime = str2time(s);
       timestr = time2str(fStartTime);
-      if (fVerbose>0) printf("#####\n#start %s\n", timestr.c_str());
+      if (fVerbose>0) pvlog_printf("#####\n#start %s\n", timestr.c_str());
    }
 
    // Clean-up
@@ -514,7 +1060,7 @@ int PGSQLReader::setEndTime(std::string &timestr)
       fEndTime = str2time(timestr.c_str());
       fEndTime += 1 ; // add extra 1 second for end of the time window
       timestr = time2str(fEndTime);
-      if (fVerbose>0) printf("#####\n#end %s\n", timestr.c_str());
+      if (fVerbose>0) pvlog_printf("#####\n#end %s\n", timestr.c_str());
       return 1;
    }
 
@@ -530,7 +1076,7 @@ int PGSQLReader::setEndTime(std::string &timestr)
 
    // Error check
    if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
-      printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
       exit(-1);
    }
 
@@ -544,7 +1090,7 @@ int PGSQLReader::setEndTime(std::string &timestr)
       fEndTime = str2time(s);
       fEndTime += 1 ; // add extra 1 second for end of the time window
       timestr = time2str(fEndTime);
-      if (fVerbose>0) printf("#####\n#end %s\n", timestr.c_str());
+      if (fVerbose>0) pvlog_printf("#####\n#end %s\n", timestr.c_str());
    }
 
    // Clean-up
@@ -552,6 +1098,62 @@ int PGSQLReader::setEndTime(std::string &timestr)
    return nrow;
 }
 
+//////////////////////////////////////////////////////////////////////
+//
+// Query samples in the window in the fetch mode
+//
+int PGSQLReader::setSampleQuery()
+{
+   switch (fFetchMode) {
+   case FETCH_COPY:
+      return setCopyQuery();
+   case FETCH_CHUNK:
+      return setCursorQuery();
+   default:
+      return setSingleRowModeQuery();
+   }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Stop the sample query in progress, and discard the rows already sent
+//
+int PGSQLReader::cancelQuery()
+{
+   if (fFetchMode==FETCH_CHUNK) {
+      // nothing is in progress between FETCHes
+      return closeCursor();
+   }
+
+   if (PQtransactionStatus(fConn) != PQTRANS_ACTIVE) {
+      // all results were read
+      return 0;
+   }
+
+   PGcancel *cancel = PQgetCancel(fConn);
+   if (cancel) {
+      char errbuf[256];
+      if (!PQcancel(cancel, errbuf, sizeof(errbuf))) {
+         pvlog_printf("%s: %d: WARNING: %s\n", __func__, __LINE__, errbuf);
+      }
+      PQfreeCancel(cancel);
+   }
+
+   // The query ends with an error result of the cancel, unless it was finished already
+   if (fFetchMode==FETCH_COPY) {
+      char *buf = 0;
+      while (PQgetCopyData(fConn, &buf, 0) > 0) {
+         PQfreemem(buf);
+      }
+   }
+   PGresult *resp;
+   while ((resp = PQgetResult(fConn))) {
+      PQclear(resp);
+   }
+
+   return 1;
+}
+
 //////////////////////////////////////////////////////////////////////
 //
 // Query samples in row-by-row mode
@@ -560,18 +1162,36 @@ int PGSQLReader::setSingleRowModeQuery()
 {
    std::string start = time2str(fStartTime);
    std::string end   = time2str(fEndTime);
-   std::ostringstream query;
-   query
-         << " SELECT smpl_time, nanosecs, severity_id, status_id, num_val, float_val, str_val, datatype, array_val"
-         << " FROM sample"
-         << " WHERE channel_id=" << fChannelId
-         << " AND smpl_time >= '" << start << "' AND smpl_time <= '" << end << "'"
-         << " ORDER BY smpl_time"
+   int ret = 0;
+
+   if (fFetchMode==FETCH_BINARY) {
+      // Only the columns which are actually decoded; the window is passed as parameters.
+      std::ostringstream channel;
+      channel << fChannelId;
+      const std::string id = channel.str();
+      const char *query
+         = " SELECT smpl_time, nanosecs, severity_id, status_id, num_val, float_val"
+           " FROM sample"
+           " WHERE channel_id=$1"
+           " AND smpl_time >= $2 AND smpl_time <= $3"
+           " ORDER BY smpl_time"
          ;
+      const char *params[3] = { id.c_str(), start.c_str(), end.c_str() };
+      ret = PQsendQueryParams(fConn, query, 3, NULL, params, NULL, NULL, 1);
+   } else {
+      std::ostringstream query;
+      query
+            << " SELECT smpl_time, nanosecs, severity_id, status_id, num_val, float_val, str_val, datatype, array_val"
+            << " FROM sample"
+            << " WHERE channel_id=" << fChannelId
+            << " AND smpl_time >= '" << start << "' AND smpl_time <= '" << end << "'"
+            << " ORDER BY smpl_time"
+            ;
+      ret = PQsendQuery(fConn, query.str().c_str());
+   }
 
-   const int ret = PQsendQuery(fConn, query.str().c_str());
    if (ret==0) {
-      printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
       exit(-1);
    }
    PQsetSingleRowMode(fConn);
@@ -581,106 +1201,316 @@ int PGSQLReader::setSingleRowModeQuery()
 
 //////////////////////////////////////////////////////////////////////
 //
-// Read single sample from RDB and fill into dbr_time_xxx
+// Types of the columns of the sample query, which are needed for COPY
 //
-int PGSQLReader::readSample()
+int PGSQLReader::readColumnTypes()
 {
-   PGresult *resp = PQgetResult(fConn);
-   if (resp == NULL) {
-      // Query in row-by-row mode was successfully finished
-      // Just for sure - we may not reach here.
-      return 0;
+   if (fColumnTypeValid) {
+      return 1;
    }
 
-   // Query result
-   if (PQresultStatus(resp) == PGRES_SINGLE_TUPLE) {
-      // fill data into dbr_time_xxx object
-      char *s = PQgetvalue(resp, 0, 0);
-      double timestamp = str2time(s);         // fractional part will be lost
-      timestamp -= POSIX_TIME_AT_EPICS_EPOCH; // conversion from GMT to epics time
-      int nanosecs = 0;
-      sscanf(PQgetvalue(resp, 0, 1), " %d ", &nanosecs);
-      timestamp += nanosecs * 1e-9;           // compensate for the fractional part
-
-      int severity_id = 0;
-      sscanf(PQgetvalue(resp, 0, 2), " %d ", &severity_id);
-      int status_id = 0;
-      sscanf(PQgetvalue(resp, 0, 3), " %d ", &status_id);
-
-      memset(&fSample, 0, sizeof(fSample));
-      fSample.stamp.secPastEpoch = timestamp;
-      fSample.stamp.nsec = nanosecs;
-      fSample.status = getStatus(status_id);
-      fSample.severity = getSeverity(severity_id);
-
-      if (fVerbose>1) printf("%s (%09d) %4d[%4d] %4d[%4d] num_val[%d \"%s\"] float_val[%d \"%s\"]"
-                             , PQgetvalue(resp, 0, 0), nanosecs
-                             , fSample.severity, severity_id
-                             , fSample.status, status_id
-                             , !PQgetisnull(resp, 0, 4)
-                             , PQgetvalue(resp, 0, 4)
-                             , !PQgetisnull(resp, 0, 5)
-                             , PQgetvalue(resp, 0, 5)
-             );
-
-      if (fSample.severity==INVALID_ALARM && fSample.status>=3000) {
-         // special treatment for Archiver specific status
-         if (fVerbose>1) printf(" <dummy data>");
-      } else if (!PQgetisnull(resp, 0, 4) && PQgetisnull(resp, 0, 5)) {
-         // num_val is not empty, float_val is empty
-         int num_val = 0;
-         if (sscanf(PQgetvalue(resp, 0, 4), " %d ", &num_val) == 1) {
-            if (fVerbose>1) printf(" %10d", num_val);
-            switch(fDBRtype) {
-            case DBR_TIME_ENUM:
-               reinterpret_cast<dbr_time_enum*>(&fSample)->value = num_val;
-               break;
-            case DBR_TIME_LONG:
-               reinterpret_cast<dbr_time_long*>(&fSample)->value = num_val;
-               break;
-            case DBR_TIME_DOUBLE:
-               fSample.value = num_val;
-               break;
-            default:
-               printf("ERROR: Unsupported DBRTYPE: %d\n", fDBRtype);
+   const char *query
+      = " SELECT smpl_time, nanosecs, severity_id, status_id, num_val, float_val"
+        " FROM sample LIMIT 0"
+      ;
+   PGresult *resp = PQexec(fConn, query);
+
+   // Error check
+   if (PQresultStatus(resp) != PGRES_TUPLES_OK || PQnfields(resp) != NUM_SAMPLE_COLS) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+
+   for (int i=0; i<NUM_SAMPLE_COLS; i++) {
+      fColumnType[i] = PQftype(resp, i);
+   }
+   fColumnTypeValid = 1;
+
+   // Clean-up
+   PQclear(resp);
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Query samples as a stream of COPY in binary format.
+// Each row arrives in a CopyData message without building PGresult.
+//
+int PGSQLReader::setCopyQuery()
+{
+   readColumnTypes();
+
+   std::string start = time2str(fStartTime);
+   std::string end   = time2str(fEndTime);
+   std::ostringstream query;
+   query
+         << " COPY ("
+         << " SELECT smpl_time, nanosecs, severity_id, status_id, num_val, float_val"
+         << " FROM sample"
+         << " WHERE channel_id=" << fChannelId
+         << " AND smpl_time >= '" << start << "' AND smpl_time <= '" << end << "'"
+         << " ORDER BY smpl_time"
+         << " ) TO STDOUT (FORMAT binary)"
+         ;
+
+   PGresult *resp = PQexec(fConn, query.str().c_str());
+   if (PQresultStatus(resp) != PGRES_COPY_OUT) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   PQclear(resp);
+
+   fCopyHeader = 1;
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Read single sample from COPY stream and fill into dbr_time_xxx
+//
+int PGSQLReader::readCopySample()
+{
+   for (;;) {
+      char *buf = 0;
+      const int n = PQgetCopyData(fConn, &buf, 0);
+
+      if (n == -1) {
+         // COPY was finished, collect the final result
+         PGresult *resp;
+         while ((resp = PQgetResult(fConn))) {
+            if (PQresultStatus(resp) != PGRES_COMMAND_OK) {
+               pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
                exit(-1);
             }
-         } else {
-            // this may not happen.
-            printf("ERROR: PQgetvalue(resp, 0, 4) = \"%s\"\n", PQgetvalue(resp, 0, 4));
+            PQclear(resp);
+         }
+         return 0;
+      } else if (n < 0) {
+         pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+         exit(-1);
+      }
+
+      // Header goes together with the first row
+      const char *p = buf;
+      const char *e = buf + n;
+      if (fCopyHeader) {
+         if (e-p < kCopySignatureLen+8 || memcmp(p, kCopySignature, kCopySignatureLen)) {
+            pvlog_printf("%s: %d: ERROR: unexpected COPY header\n", __func__, __LINE__);
             exit(-1);
          }
-      } else if (PQgetisnull(resp, 0, 4) && !PQgetisnull(resp, 0, 5)) {
-         // num_val is empty, float_val is not empty
-         double float_val = 0;
-         if (sscanf(PQgetvalue(resp, 0, 5), " %lf ", &float_val) == 1) {
-            if (fVerbose>1) printf(" %.10lf", float_val);
-            switch(fDBRtype) {
-#if 0
-            case DBR_TIME_ENUM:
-               (*dbr_time_enum)(&fSample)->value = float_val;
-               break;
-#endif
-            case DBR_TIME_LONG:
-               reinterpret_cast<dbr_time_long*>(&fSample)->value = float_val;
-               break;
-            case DBR_TIME_DOUBLE:
-               fSample.value = float_val;
-               break;
-            default:
-               printf("ERROR: Unsupported DBRTYPE: %d\n", fDBRtype);
-               exit(-1);
-            }
+         p += kCopySignatureLen + 4; // signature and flags
+         p += 4 + pgbin32(p);        // header extension
+         fCopyHeader = 0;
+      }
+
+      if (e-p < 2) {
+         // nothing but header
+         PQfreemem(buf);
+         continue;
+      }
+
+      const int nfield = int16_t(pgbin16(p));
+      p += 2;
+      if (nfield == -1) {
+         // trailer, PQgetCopyData() returns -1 next
+         PQfreemem(buf);
+         continue;
+      } else if (nfield != NUM_SAMPLE_COLS) {
+         pvlog_printf("%s: %d: ERROR: unexpected number of fields %d\n", __func__, __LINE__, nfield);
+         exit(-1);
+      }
+
+      // decode fields in place
+      const char *val[NUM_SAMPLE_COLS];
+      int         len[NUM_SAMPLE_COLS];
+      for (int i=0; i<NUM_SAMPLE_COLS; i++) {
+         if (e-p < 4) {
+            pvlog_printf("%s: %d: ERROR: truncated COPY row\n", __func__, __LINE__);
+            exit(-1);
+         }
+         len[i] = int32_t(pgbin32(p));
+         p += 4;
+         if (len[i] < 0) {
+            val[i] = 0; // NULL
+            len[i] = 0;
+         } else if (e-p < len[i]) {
+            pvlog_printf("%s: %d: ERROR: truncated COPY row\n", __func__, __LINE__);
+            exit(-1);
          } else {
-            // this may not happen.
-            printf("ERROR: PQgetvalue(resp, 0, 5) = \"%s\"\n", PQgetvalue(resp, 0, 5));
+            val[i] = p;
+            p += len[i];
          }
+      }
+
+      decodeBinaryColumns(val, len, fColumnType);
+      fCurrent = &fSample;
+
+      PQfreemem(buf);
+      return 1;
+   }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Query samples through a server-side cursor, which is read in chunks
+//
+int PGSQLReader::setCursorQuery()
+{
+   closeCursor();
+
+   PGresult *resp = PQexec(fConn, "BEGIN");
+   if (PQresultStatus(resp) != PGRES_COMMAND_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   PQclear(resp);
+   fInCursor = 1;
+
+   std::string start = time2str(fStartTime);
+   std::string end   = time2str(fEndTime);
+   std::ostringstream query;
+   query
+         << " DECLARE pbe_sample NO SCROLL CURSOR FOR"
+         << " SELECT smpl_time, nanosecs, severity_id, status_id, num_val, float_val"
+         << " FROM sample"
+         << " WHERE channel_id=" << fChannelId
+         << " AND smpl_time >= '" << start << "' AND smpl_time <= '" << end << "'"
+         << " ORDER BY smpl_time"
+         ;
+
+   resp = PQexec(fConn, query.str().c_str());
+   if (PQresultStatus(resp) != PGRES_COMMAND_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   PQclear(resp);
+
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Close the cursor and the transaction holding it, if any
+//
+int PGSQLReader::closeCursor()
+{
+   if (!fInCursor) {
+      return 0;
+   }
+
+   // COMMIT closes the cursor as well
+   PGresult *resp = PQexec(fConn, "COMMIT");
+   if (PQresultStatus(resp) != PGRES_COMMAND_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   PQclear(resp);
+   fInCursor = 0;
+
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// FETCH the next chunk of rows in binary format and decode them at once
+//
+int PGSQLReader::readChunk()
+{
+   if (!fInCursor) {
+      return 0;
+   }
+
+   std::ostringstream query;
+   query << "FETCH " << fChunkSize << " FROM pbe_sample";
+
+   // Binary format is chosen by the FETCH, not by the cursor
+   const double t0 = monotonic();
+   PGresult *resp = PQexecParams(fConn, query.str().c_str(), 0, NULL, NULL, NULL, NULL, 1);
+   if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   const double t1 = monotonic();
+
+   const int nrow = PQntuples(resp);
+   if (nrow == 0) {
+      // all rows were consumed
+      PQclear(resp);
+      closeCursor();
+      fBatch.clear();
+      fBatchPos = 0;
+      return 0;
+   }
+
+   fBatch.resize(nrow);
+   for (int i=0; i<nrow; i++) {
+      decodeBinarySample(resp, i);
+      fBatch[i] = fSample;
+   }
+   PQclear(resp);
+   const double t2 = monotonic();
+
+   adaptChunkSize(t1-t0, t2-t1, nrow);
+
+   fBatchPos = 1;
+   fCurrent = &fBatch[0];
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Grow the chunk while round trips are not small relative to decode time,
+// and shrink it when a single round trip takes too long.
+//
+void PGSQLReader::adaptChunkSize(double tfetch, double tdecode, size_t nrow)
+{
+   if (nrow < size_t(fChunkSize)) {
+      // the last chunk tells nothing
+      return;
+   }
+
+   const int prev = fChunkSize;
+   if (tfetch > kChunkMaxLatency && fChunkSize > kChunkMin) {
+      fChunkSize = std::max(fChunkSize/2, kChunkMin);
+   } else if (tfetch > tdecode*kRoundTripRatio && tfetch*2 <= kChunkMaxLatency && fChunkSize < kChunkMax) {
+      fChunkSize = std::min(fChunkSize*2, kChunkMax);
+   }
+
+   if (fVerbose>0 && fChunkSize != prev) {
+      pvlog_printf("# chunk %d -> %d rows (fetch %.3f ms, decode %.3f ms)\n", prev, fChunkSize, tfetch*1e3, tdecode*1e3);
+   }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Read single sample from RDB and fill into dbr_time_xxx
+//
+int PGSQLReader::readSample()
+{
+   if (fGroupActive) {
+      return readGroupSample();
+   } else if (fFetchMode==FETCH_COPY) {
+      return readCopySample();
+   } else if (fFetchMode==FETCH_CHUNK) {
+      return readChunk();
+   }
+
+   PGresult *resp = PQgetResult(fConn);
+   if (resp == NULL) {
+      // Query in row-by-row mode was successfully finished
+      // Just for sure - we may not reach here.
+      return 0;
+   }
+
+   // Query result
+   if (PQresultStatus(resp) == PGRES_SINGLE_TUPLE) {
+      // fill data into dbr_time_xxx object
+      if (fFetchMode==FETCH_BINARY) {
+         decodeBinarySample(resp, 0);
       } else {
-         // this may not happen - something is wrong.
-         printf("<N/A>\n");
-         exit(-1);
+         decodeTextSample(resp, 0);
       }
-      if (fVerbose>1) printf("\n");
+      fCurrent = &fSample;
 
       // Clean-up
       PQclear(resp);
@@ -689,7 +1519,7 @@ int PGSQLReader::readSample()
    } else {
       // Error check
       if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
-         printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+         pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
          exit(-1);
       }
 
@@ -709,6 +1539,470 @@ int PGSQLReader::readSample()
    return 0;
 }
 
+//////////////////////////////////////////////////////////////////////
+//
+// Estimate number of rows of each channel from the planner statistics,
+// in the same way as the planner does.
+//
+int PGSQLReader::readRowEstimates()
+{
+   const char *query
+      = " SELECT c.reltuples, s.n_distinct, s.most_common_vals::text, s.most_common_freqs::text"
+        " FROM pg_class c LEFT JOIN pg_stats s"
+        " ON s.tablename = c.relname AND s.attname = 'channel_id'"
+        " WHERE c.relname = 'sample' AND c.relkind IN ('r', 'p')"
+      ;
+   PGresult *resp = PQexec(fConn, query);
+
+   // Error check
+   if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+
+   fMCVRows.clear();
+   fOtherRows = 0;
+
+   const int nrow = PQntuples(resp);
+   if (nrow>0) {
+      double reltuples = 0;
+      double ndistinct = 0;
+      sscanf(PQgetvalue(resp, 0, 0), " %lf ", &reltuples);
+      sscanf(PQgetvalue(resp, 0, 1), " %lf ", &ndistinct);
+      if (ndistinct<0) {
+         // negative value is a fraction of rows
+         ndistinct = -ndistinct * reltuples;
+      }
+
+      // arrays in text format, e.g. {12,345}
+      std::vector<int>    vals;
+      std::vector<double> freqs;
+      {
+         const char *p = PQgetvalue(resp, 0, 2);
+         int v, n;
+         if (*p=='{') p++;
+         while (sscanf(p, "%d%n", &v, &n)==1) {
+            vals.push_back(v);
+            p += n;
+            if (*p==',') p++;
+         }
+      }
+      {
+         const char *p = PQgetvalue(resp, 0, 3);
+         double f;
+         int n;
+         if (*p=='{') p++;
+         while (sscanf(p, "%lf%n", &f, &n)==1) {
+            freqs.push_back(f);
+            p += n;
+            if (*p==',') p++;
+         }
+      }
+
+      double sumfreq = 0;
+      for (size_t i=0; i<vals.size() && i<freqs.size(); i++) {
+         fMCVRows[vals[i]] = freqs[i] * reltuples;
+         sumfreq += freqs[i];
+      }
+
+      // the rest is distributed evenly
+      const double nother = ndistinct - fMCVRows.size();
+      fOtherRows = (1 - sumfreq) * reltuples / (nother>1 ? nother : 1);
+
+      if (fVerbose>0) pvlog_printf("#####\n# rows %.0f, channels %.0f, most common %zd, others %.0f rows each\n", reltuples, ndistinct, fMCVRows.size(), fOtherRows);
+   }
+
+   // Clean-up
+   PQclear(resp);
+   return nrow;
+}
+
+double PGSQLReader::estimateRows(int channel_id) const
+{
+   std::unordered_map<int, double>::const_iterator itr = fMCVRows.find(channel_id);
+   if (itr!=fMCVRows.end()) {
+      return itr->second;
+   }
+   return fOtherRows;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Query samples of several channels at once, ordered by channel_id.
+// Subsequent find() of those channels, in ascending order of channel_id,
+// continue reading the same stream instead of issuing a query.
+//
+int PGSQLReader::setGroupQuery(const std::vector<int> &channel_ids, const std::string &start, const std::string &end)
+{
+   endGroup();
+
+   fGroup = channel_ids;
+   std::sort(fGroup.begin(), fGroup.end());
+
+   std::ostringstream ids;
+   ids << "{";
+   for (size_t i=0; i<fGroup.size(); i++) {
+      ids << (i ? "," : "") << fGroup[i];
+   }
+   ids << "}";
+   const std::string idstr = ids.str();
+
+   // Same window as setStartTime()/setEndTime() with given time
+   std::string startstr, endstr;
+   if (start.size()>0) {
+      startstr = time2str(str2time(start.c_str()));
+   }
+   if (end.size()>0) {
+      endstr = time2str(str2time(end.c_str()) + 1);
+   }
+
+   std::ostringstream query;
+   std::vector<const char *> params;
+   params.push_back(idstr.c_str());
+   query
+         << " SELECT smpl_time, nanosecs, severity_id, status_id, num_val, float_val, channel_id"
+         << " FROM sample"
+         << " WHERE channel_id = ANY($1::int[])"
+         ;
+   if (startstr.size()>0) {
+      params.push_back(startstr.c_str());
+      query << " AND smpl_time >= $" << params.size();
+   }
+   if (endstr.size()>0) {
+      params.push_back(endstr.c_str());
+      query << " AND smpl_time <= $" << params.size();
+   }
+   query << " ORDER BY channel_id, smpl_time";
+
+   const int ret = PQsendQueryParams(fConn, query.str().c_str(), params.size(), NULL, &params[0], NULL, NULL, 1);
+   if (ret==0) {
+      pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+      exit(-1);
+   }
+   PQsetSingleRowMode(fConn);
+
+   if (fVerbose>0) pvlog_printf("#####\n# group of %zd channels %s\n", fGroup.size(), idstr.c_str());
+
+   fGroupActive = 1;
+   fGroupPending = 0;
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Discard the rest of the group query, if any
+//
+int PGSQLReader::endGroup()
+{
+   if (!fGroupActive) {
+      return 0;
+   }
+
+   PGresult *resp;
+   while ((resp = PQgetResult(fConn))) {
+      PQclear(resp);
+   }
+
+   fGroup.clear();
+   fGroupActive = 0;
+   fGroupPending = 0;
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Read single sample of the current channel from the group query.
+// Returns 0 at the first row of another channel, which is held for the next find().
+//
+int PGSQLReader::readGroupSample()
+{
+   if (fGroupPending) {
+      if (fGroupPendingId == fChannelId) {
+         // read ahead by the previous channel
+         fGroupPending = 0;
+         fCurrent = &fSample;
+         return 1;
+      } else if (fGroupPendingId > fChannelId) {
+         // no more rows of this channel
+         return 0;
+      }
+      // rows of a channel which was not visited
+      fGroupPending = 0;
+   }
+
+   for (;;) {
+      PGresult *resp = PQgetResult(fConn);
+      if (resp == NULL) {
+         // Query in row-by-row mode was successfully finished
+         return 0;
+      }
+
+      if (PQresultStatus(resp) != PGRES_SINGLE_TUPLE) {
+         if (PQresultStatus(resp) != PGRES_TUPLES_OK) {
+            pvlog_printf("%s: %d: ERROR: %s\n", __func__, __LINE__, PQerrorMessage(fConn));
+            exit(-1);
+         }
+         // end of rows, PQgetResult() will return NULL
+         PQclear(resp);
+         continue;
+      }
+
+      long long id = 0;
+      pgbin2int(PQgetvalue(resp, 0, NUM_SAMPLE_COLS), PQgetlength(resp, 0, NUM_SAMPLE_COLS), PQftype(resp, NUM_SAMPLE_COLS), &id);
+      if (id < fChannelId) {
+         // skip rows of a channel which was not visited
+         PQclear(resp);
+         continue;
+      }
+
+      decodeBinarySample(resp, 0);
+      PQclear(resp);
+      fCurrent = &fSample;
+
+      if (id > fChannelId) {
+         // hold it for the next channel
+         fGroupPending = 1;
+         fGroupPendingId = id;
+         return 0;
+      }
+      return 1;
+   }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Fill time stamp and alarms into dbr_time_xxx, and clear the value
+//
+void PGSQLReader::setTimeStamp(time_t sec, int nanosecs, int severity_id, int status_id)
+{
+   memset(&fSample, 0, sizeof(fSample));
+   fSample.stamp.secPastEpoch = sec - POSIX_TIME_AT_EPICS_EPOCH; // conversion from GMT to epics time
+   fSample.stamp.nsec = nanosecs;
+   fSample.status = getStatus(status_id);
+   fSample.severity = getSeverity(severity_id);
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Archiver specific status carries neither num_val nor float_val
+//
+int PGSQLReader::isDummySample() const
+{
+   return fSample.severity==INVALID_ALARM && fSample.status>=3000;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Fill num_val into dbr_time_xxx
+//
+void PGSQLReader::setNumVal(int num_val)
+{
+   switch(fDBRtype) {
+   case DBR_TIME_ENUM:
+      reinterpret_cast<dbr_time_enum*>(&fSample)->value = num_val;
+      break;
+   case DBR_TIME_LONG:
+      reinterpret_cast<dbr_time_long*>(&fSample)->value = num_val;
+      break;
+   case DBR_TIME_DOUBLE:
+      fSample.value = num_val;
+      break;
+   default:
+      pvlog_printf("ERROR: Unsupported DBRTYPE: %d\n", fDBRtype);
+      exit(-1);
+   }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Fill float_val into dbr_time_xxx
+//
+void PGSQLReader::setFloatVal(double float_val)
+{
+   switch(fDBRtype) {
+#if 0
+   case DBR_TIME_ENUM:
+      (*dbr_time_enum)(&fSample)->value = float_val;
+      break;
+#endif
+   case DBR_TIME_LONG:
+      reinterpret_cast<dbr_time_long*>(&fSample)->value = float_val;
+      break;
+   case DBR_TIME_DOUBLE:
+      fSample.value = float_val;
+      break;
+   default:
+      pvlog_printf("ERROR: Unsupported DBRTYPE: %d\n", fDBRtype);
+      exit(-1);
+   }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Decode a row of the sample query in text format
+//
+void PGSQLReader::decodeTextSample(PGresult *resp, int row)
+{
+   char *s = PQgetvalue(resp, row, 0);
+   time_t timestamp = str2time(s);         // fractional part will be lost
+   int nanosecs = 0;
+   sscanf(PQgetvalue(resp, row, 1), " %d ", &nanosecs);
+
+   int severity_id = 0;
+   sscanf(PQgetvalue(resp, row, 2), " %d ", &severity_id);
+   int status_id = 0;
+   sscanf(PQgetvalue(resp, row, 3), " %d ", &status_id);
+
+   setTimeStamp(timestamp, nanosecs, severity_id, status_id);
+
+   if (fVerbose>1) pvlog_printf("%s (%09d) %4d[%4d] %4d[%4d] num_val[%d \"%s\"] float_val[%d \"%s\"]"
+                          , PQgetvalue(resp, row, 0), nanosecs
+                          , fSample.severity, severity_id
+                          , fSample.status, status_id
+                          , !PQgetisnull(resp, row, 4)
+                          , PQgetvalue(resp, row, 4)
+                          , !PQgetisnull(resp, row, 5)
+                          , PQgetvalue(resp, row, 5)
+          );
+
+   if (isDummySample()) {
+      // special treatment for Archiver specific status
+      if (fVerbose>1) pvlog_printf(" <dummy data>");
+   } else if (!PQgetisnull(resp, row, 4) && PQgetisnull(resp, row, 5)) {
+      // num_val is not empty, float_val is empty
+      int num_val = 0;
+      if (sscanf(PQgetvalue(resp, row, 4), " %d ", &num_val) == 1) {
+         if (fVerbose>1) pvlog_printf(" %10d", num_val);
+         setNumVal(num_val);
+      } else {
+         // this may not happen.
+         pvlog_printf("ERROR: PQgetvalue(resp, %d, 4) = \"%s\"\n", row, PQgetvalue(resp, row, 4));
+         exit(-1);
+      }
+   } else if (PQgetisnull(resp, row, 4) && !PQgetisnull(resp, row, 5)) {
+      // num_val is empty, float_val is not empty
+      double float_val = 0;
+      if (sscanf(PQgetvalue(resp, row, 5), " %lf ", &float_val) == 1) {
+         if (fVerbose>1) pvlog_printf(" %.10lf", float_val);
+         setFloatVal(float_val);
+      } else {
+         // this may not happen.
+         pvlog_printf("ERROR: PQgetvalue(resp, %d, 5) = \"%s\"\n", row, PQgetvalue(resp, row, 5));
+      }
+   } else {
+      // this may not happen - something is wrong.
+      pvlog_printf("<N/A>\n");
+      exit(-1);
+   }
+   if (fVerbose>1) pvlog_printf("\n");
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Decode a row of the sample query in binary format
+//
+void PGSQLReader::decodeBinarySample(PGresult *resp, int row)
+{
+   const char *val[NUM_SAMPLE_COLS];
+   int         len[NUM_SAMPLE_COLS];
+   Oid         type[NUM_SAMPLE_COLS];
+
+   for (int i=0; i<NUM_SAMPLE_COLS; i++) {
+      val[i]  = PQgetisnull(resp, row, i) ? 0 : PQgetvalue(resp, row, i);
+      len[i]  = PQgetlength(resp, row, i);
+      type[i] = PQftype(resp, i);
+   }
+
+   decodeBinaryColumns(val, len, type);
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Fill columns in binary format into dbr_time_xxx. NULL is given as val[i]==0.
+//
+void PGSQLReader::decodeBinaryColumns(const char **val, const int *len, const Oid *type)
+{
+   long long wall = 0;
+   if (!val[COL_SMPL_TIME] || !pgbin2wall(val[COL_SMPL_TIME], len[COL_SMPL_TIME], fIntegerDatetimes, &wall)) {
+      pvlog_printf("%s: %d: ERROR: cannot decode smpl_time (type %u)\n", __func__, __LINE__, type[COL_SMPL_TIME]);
+      exit(-1);
+   }
+   // timestamp without time zone is recorded in localtime
+   const time_t timestamp = (type[COL_SMPL_TIME]==TIMESTAMPTZOID) ? wall : localwall2time(wall);
+
+   long long nanosecs = 0;
+   long long severity_id = 0;
+   long long status_id = 0;
+   if (val[COL_NANOSECS])    pgbin2int(val[COL_NANOSECS],    len[COL_NANOSECS],    type[COL_NANOSECS],    &nanosecs);
+   if (val[COL_SEVERITY_ID]) pgbin2int(val[COL_SEVERITY_ID], len[COL_SEVERITY_ID], type[COL_SEVERITY_ID], &severity_id);
+   if (val[COL_STATUS_ID])   pgbin2int(val[COL_STATUS_ID],   len[COL_STATUS_ID],   type[COL_STATUS_ID],   &status_id);
+
+   setTimeStamp(timestamp, nanosecs, severity_id, status_id);
+
+   if (fVerbose>1) pvlog_printf("%s (%09lld) %4d[%4lld] %4d[%4lld] num_val[%d] float_val[%d]"
+                          , time2str(timestamp), nanosecs
+                          , fSample.severity, severity_id
+                          , fSample.status, status_id
+                          , val[COL_NUM_VAL]!=0
+                          , val[COL_FLOAT_VAL]!=0
+          );
+
+   if (isDummySample()) {
+      // special treatment for Archiver specific status
+      if (fVerbose>1) pvlog_printf(" <dummy data>");
+   } else if (val[COL_NUM_VAL] && !val[COL_FLOAT_VAL]) {
+      // num_val is not empty, float_val is empty
+      long long num_val = 0;
+      if (!pgbin2int(val[COL_NUM_VAL], len[COL_NUM_VAL], type[COL_NUM_VAL], &num_val)) {
+         pvlog_printf("%s: %d: ERROR: cannot decode num_val (type %u)\n", __func__, __LINE__, type[COL_NUM_VAL]);
+         exit(-1);
+      }
+      if (fVerbose>1) pvlog_printf(" %10lld", num_val);
+      setNumVal(num_val);
+   } else if (!val[COL_NUM_VAL] && val[COL_FLOAT_VAL]) {
+      // num_val is empty, float_val is not empty
+      double float_val = 0;
+      if (!pgbin2double(val[COL_FLOAT_VAL], len[COL_FLOAT_VAL], type[COL_FLOAT_VAL], &float_val)) {
+         pvlog_printf("%s: %d: ERROR: cannot decode float_val (type %u)\n", __func__, __LINE__, type[COL_FLOAT_VAL]);
+         exit(-1);
+      }
+      if (fVerbose>1) pvlog_printf(" %.10lf", float_val);
+      setFloatVal(float_val);
+   } else {
+      // this may not happen - something is wrong.
+      pvlog_printf("<N/A>\n");
+      exit(-1);
+   }
+   if (fVerbose>1) pvlog_printf("\n");
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Convert wall clock in localtime to UNIX time, like timelocal() does.
+// timelocal() is costly, the UTC offset is cached for each hour of wall clock.
+//
+time_t PGSQLReader::localwall2time(long long wall)
+{
+   static thread_local long long lastHour = LLONG_MIN;
+   static thread_local time_t    lastOffset = 0;
+
+   long long hour = wall / 3600;
+   if (wall % 3600 < 0) {
+      hour -= 1;
+   }
+
+   if (hour != lastHour) {
+      time_t t = hour * 3600;
+      struct tm tm;
+      gmtime_r(&t, &tm);
+      tm.tm_isdst = -1;
+      lastOffset = t - timelocal(&tm);
+      lastHour = hour;
+   }
+
+   return wall - lastOffset;
+}
+
 //////////////////////////////////////////////////////////////////////
 // end
 //////////////////////////////////////////////////////////////////////
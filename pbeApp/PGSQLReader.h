@@ -10,6 +10,7 @@
 // C++
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 // PostgreSQL
 #include <libpq-fe.h>
@@ -21,12 +22,33 @@
 // EPICS base
 #include <db_access.h>
 
+//
+#include "PGSQLCatalog.h"
+#include "pbbatch.h"
+
 // EPICS Channel Archiver
 #define DISCONNECTED     3904  // 0x0f40
 #define ARCHIVE_OFF      3872  // 0x0f20
 #define ARCHIVE_DISABLED 3834  // 0x0f08
 #define WRITE_ERROR      3976  // 0x0f88, chosen arbitrary
 
+// Classes of the alarm status of a sample, see PGSQLReader::statusClass()
+enum statusclass_t {
+   STAT_ALARM      = 0,     // alarm condition of EPICS base
+   STAT_UNKNOWN    = 1,     // status_id missing in the status table
+   STAT_SPECIAL    = 2,     // archiver specific, as Repeat
+   STAT_DISCONNECT = 2|4,   // no value: disconnected, archive off, ...
+   STAT_STOPPED    = 2|4|8, // disconnect by the archiver itself
+};
+
+// How samples are transferred from the RDB
+enum fetch_t {
+   FETCH_TEXT,   // single-row mode, text format
+   FETCH_BINARY, // single-row mode, binary format
+   FETCH_COPY,   // COPY TO STDOUT in binary format
+   FETCH_CHUNK,  // server-side cursor, FETCH in chunks of binary rows
+};
+
 //////////////////////////////////////////////////////////////////////
 class PGSQLReader {
 public:
@@ -41,12 +63,41 @@ public:
       int         rdbid;
       std::string rdbstr;
    } alarm_t;
+   // rdbid -> epicsid, built from fSeverity/fStatus by buildAlarmIndex()
+   typedef struct {
+      std::vector<int>             dense;  // by rdbid, for rdbid < kDenseAlarmIds
+      std::unordered_map<int, int> sparse; // any other rdbid
+      int                          miss;   // epicsid of an unknown rdbid
+   } alarmindex_t;
 
    //
    void                      setVerbose(int v)        { fVerbose = v; }
+   void                      setFetchMode(int m)      { fFetchMode = m; }
+   int                       getFetchMode()     const { return fFetchMode; }
+   void                      setChunkSize(int n)      { fChunkSize = n; }
+   int                       getChunkSize()     const { return fChunkSize; }
+   void                      setCatalog(const PGSQLCatalog *c) { fCatalog = c; }
+   int                       readCatalog(PGSQLCatalog &catalog);
+
+   // samples of several small PVs in a single query, see setGroupQuery()
+   int                       readRowEstimates();
+   double                    estimateRows(int channel_id) const;
+   int                       setGroupQuery(const std::vector<int> &channel_ids, const std::string &start, const std::string &end);
+   int                       endGroup();
+   int                       readTimeRange(int channel_id, double &first, double &last);
    data_t                   *find(const std::string &pvname, const int dbr, std::string &start, std::string &end);
-   data_t                   *get()                    { return &fSample;}
-   data_t                   *next();
+   int                       seek(const epicsTimeStamp &stamp);
+   data_t                   *get()                    { return fCurrent; }
+   data_t                   *next()
+   {
+      // walk through the chunk already decoded, if any
+      if (fBatchPos < fBatch.size()) {
+         return fCurrent = &fBatch[fBatchPos++];
+      }
+      return readNext();
+   }
+   // move up to max samples from get() on to the batch
+   size_t                    readBatch(SampleBatch &batch, size_t max);
 
    const std::string        &getPVname()        const { return fPVname; }
    int                       getType()          const { return fDBRtype; }
@@ -66,32 +117,108 @@ public:
    // helper methods
    static char              *time2str(const time_t sec);
    static time_t             str2time(const char *str);
+   // statusclass_t of the status of a sample
+   static int                statusClass(int status)
+   {
+      if (status < 0) return STAT_UNKNOWN;
+      if (status >= kStatusClasses) return STAT_SPECIAL;
+      return fStatusClass.cls[status];
+   }
 
 protected:
+   // without a connection, for the tests
+   PGSQLReader();
+
    // internal helper methods
    int                       readSeverity();
    int                       readStatus();
    int                       readChannelId();
    int                       readMetadata();
    int                       readEnum();
-   int                       getSeverity(const int rdbid);
-   int                       getStatus(const int rdbid);
+   int                       readCatalogEntry();
+   int                       readTimeRange(std::string &start, std::string &end);
+   int                       getSeverity(const int rdbid) const { return lookupAlarm(fSeverityIndex, rdbid); }
+   int                       getStatus(const int rdbid) const { return lookupAlarm(fStatusIndex, rdbid); }
+   static void               buildAlarmIndex(const std::vector<alarm_t> &alarms, alarmindex_t &index);
+   static int                lookupAlarm(const alarmindex_t &index, const int rdbid)
+   {
+      if ((unsigned)rdbid < index.dense.size()) return index.dense[rdbid];
+      if (index.sparse.empty()) return index.miss;
+      std::unordered_map<int, int>::const_iterator it = index.sparse.find(rdbid);
+      return it == index.sparse.end() ? index.miss : it->second;
+   }
    int                       setStartTime(std::string &timestr);
    int                       setEndTime(std::string &timestr);
+   int                       setSampleQuery();
+   int                       cancelQuery();
    int                       setSingleRowModeQuery();
+   int                       setCopyQuery();
+   int                       readColumnTypes();
+   int                       setCursorQuery();
+   int                       closeCursor();
+   data_t                   *readNext();
    int                       readSample();
+   int                       readCopySample();
+   int                       readChunk();
+   int                       readGroupSample();
+   void                      adaptChunkSize(double tfetch, double tdecode, size_t nrow);
+   void                      decodeTextSample(PGresult *resp, int row);
+   void                      decodeBinarySample(PGresult *resp, int row);
+   void                      decodeBinaryColumns(const char **val, const int *len, const Oid *type);
+   void                      setTimeStamp(time_t sec, int nanosecs, int severity_id, int status_id);
+   int                       isDummySample() const;
+   void                      setNumVal(int num_val);
+   void                      setFloatVal(double float_val);
+   static time_t             localwall2time(long long wall);
 
 protected:
+   // columns of the sample query in the binary modes
+   enum {
+      COL_SMPL_TIME,
+      COL_NANOSECS,
+      COL_SEVERITY_ID,
+      COL_STATUS_ID,
+      COL_NUM_VAL,
+      COL_FLOAT_VAL,
+      NUM_SAMPLE_COLS
+   };
+
    int                       fVerbose;
+   const PGSQLCatalog       *fCatalog;
+   int                       fFetchMode;
+   int                       fIntegerDatetimes;
+   Oid                       fColumnType[NUM_SAMPLE_COLS]; // COPY does not tell types
+   int                       fColumnTypeValid;
+   int                       fCopyHeader;  // COPY header is expected
+   int                       fChunkSize;   // rows per FETCH, adapted at run time
+   int                       fInCursor;    // transaction holding the cursor is open
+
+   std::vector<int>          fGroup;        // channel_ids in the group query, sorted
+   int                       fGroupActive;  // group query is in progress
+   int                       fGroupPending; // row of fGroupPendingId is held in fSample
+   int                       fGroupPendingId;
+   std::unordered_map<int, double> fMCVRows; // estimated rows of the most common channels
+   double                    fOtherRows;    // estimated rows of any other channel
 
    PGconn                   *fConn;
-   data_t                    fSample;
+   data_t                    fSample;  // the sample decoded last
+   data_t                   *fCurrent; // returned by get()
+   std::vector<data_t>       fBatch;   // chunk of samples decoded at once
+   size_t                    fBatchPos;
    std::string               fPVname;
    int                       fChannelId;
    int                       fDBRtype;
 
    std::vector<alarm_t>      fSeverity;
    std::vector<alarm_t>      fStatus;
+   alarmindex_t              fSeverityIndex;
+   alarmindex_t              fStatusIndex;
+   static const int          kDenseAlarmIds = 4096; // larger ids go to the hash
+   static const int          kStatusClasses = 4096; // statuses >= are STAT_SPECIAL
+   static const struct statusclasstable_t {
+      statusclasstable_t();
+      unsigned char cls[kStatusClasses];
+   }                         fStatusClass;
 
    double                    fDisplayHigh;
    double                    fDisplayLow;
@@ -0,0 +1,135 @@
+// Benchmark of the pbfile modes, with workers writing many partition files
+// at once, as pgsql2pb -j does.
+
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <thread>
+#include <iostream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "pbfile.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// A PV directory of each worker holds the monthly partitions of a year
+static std::string pvDir(const std::string& dir, const char* name, int worker, int i)
+{
+    std::ostringstream pvdir;
+    pvdir << dir << "/" << name << "/w" << worker << "/PV" << i/12;
+    return pvdir.str();
+}
+
+static std::string fileName(const std::string& dir, const char* name, int worker, int i)
+{
+    std::ostringstream fname;
+    fname << pvDir(dir, name, worker, i) << "/VAL:2020_" << i%12+1 << ".pb";
+    return fname.str();
+}
+
+static void worker(int mode, const char* name, const std::string& dir, int id, int nfiles, size_t size, int *failed)
+{
+    std::string line(63, 'x');
+    line += '\n';
+    pbfile out(mode);
+    for (int i=0; i<nfiles; i++) {
+        out.open(fileName(dir, name, id, i), 1);
+        for (size_t n=0; n<size; n+=line.size())
+            out.write(line.data(), line.size());
+        out.close();
+        if (!out.good())
+            *failed = 1;
+    }
+}
+
+static void cleanup(const std::string& dir, const char* name, int nworkers, int nfiles)
+{
+    for (int w=0; w<nworkers; w++) {
+        for (int i=0; i<nfiles; i++) {
+            unlink(fileName(dir, name, w, i).c_str());
+            if (i%12==11 || i==nfiles-1)
+                rmdir(pvDir(dir, name, w, i).c_str());
+        }
+        std::ostringstream wdir;
+        wdir << dir << "/" << name << "/w" << w;
+        rmdir(wdir.str().c_str());
+    }
+    rmdir((dir + "/" + name).c_str());
+}
+
+static void run(const char* name, int mode, const std::string& dir, int nworkers, int nfiles, size_t size)
+{
+    std::vector<std::thread> workers;
+    std::vector<int> failed(nworkers, 0);
+
+    const double t0 = now();
+    for (int w=0; w<nworkers; w++)
+        workers.push_back(std::thread(worker, mode, name, dir, w, nfiles, size, &failed[w]));
+    for (int w=0; w<nworkers; w++)
+        workers[w].join();
+    const double t = now()-t0;
+
+    int nfailed = 0;
+    for (int w=0; w<nworkers; w++)
+        nfailed += failed[w];
+    printf("%-9s %10.0f files/s %10.1f MB/s%s\n", name,
+           nworkers*nfiles/t, nworkers*nfiles*(double)size/t/1e6,
+           nfailed ? " (write errors)" : "");
+    cleanup(dir, name, nworkers, nfiles);
+}
+
+void usage(const char *argv0)
+{
+    std::cout << "Usage: " << argv0 << " [-h] [-d DIR] [-j WORKERS] [-n FILES] [-s KB]" << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << " -h           : Print this message." << std::endl
+              << " -d DIR       : Directory of the files (default = $TMPDIR/benchFile)." << std::endl
+              << " -j WORKERS   : Number of writing threads (default = 8)." << std::endl
+              << " -n FILES     : Files written by each thread (default = 500)." << std::endl
+              << " -s KB        : Size of each file (default = 64)." << std::endl
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char* tmp = getenv("TMPDIR");
+    std::string dir = std::string(tmp ? tmp : "/tmp") + "/benchFile";
+    int nworkers = 8;
+    int nfiles = 500;
+    int kb = 64;
+
+    int ch;
+    while ((ch=getopt(argc, argv, "hd:j:n:s:")) != EOF) {
+        switch(ch) {
+        case 'd': dir      = optarg; break;
+        case 'j': nworkers = atoi(optarg); break;
+        case 'n': nfiles   = atoi(optarg); break;
+        case 's': kb       = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (nworkers<=0 || nfiles<=0 || kb<=0)
+        usage(argv[0]);
+
+    run("blocking", PBFILE_BLOCKING, dir, nworkers, nfiles, kb*1024);
+    run("thread", PBFILE_THREAD, dir, nworkers, nfiles, kb*1024);
+    if (pbfile(PBFILE_URING).mode()==PBFILE_URING)
+        run("io_uring", PBFILE_URING, dir, nworkers, nfiles, kb*1024);
+    else
+        printf("io_uring  not available\n");
+
+    return EXIT_SUCCESS;
+}
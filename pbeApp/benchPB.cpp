@@ -0,0 +1,137 @@
+// Benchmark of the PB line escaping and unescaping in each kernel,
+// with payloads of scalar samples and of waveforms.
+
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "pbstreams.h"
+#include "pbescape.h"
+#include "pbeutil.h"
+#include "EPICSEvent.pb.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Serialized, but not escaped, samples
+typedef std::vector<std::string> payload_t;
+
+static payload_t scalarPayload(size_t nsamples)
+{
+    payload_t payload;
+    EPICS::ScalarDouble sample;
+    for (size_t i=0; i<nsamples; i++) {
+        sample.Clear();
+        sample.set_secondsintoyear(i);
+        sample.set_nano(rand()%1000000000);
+        sample.set_val(rand()/(double)RAND_MAX);
+        payload.push_back(sample.SerializeAsString());
+    }
+    return payload;
+}
+
+static payload_t waveformPayload(size_t nsamples, size_t nelements)
+{
+    payload_t payload;
+    EPICS::VectorDouble sample;
+    for (size_t i=0; i<nsamples; i++) {
+        sample.Clear();
+        sample.set_secondsintoyear(i);
+        sample.set_nano(rand()%1000000000);
+        for (size_t j=0; j<nelements; j++)
+            sample.add_val(rand()/(double)RAND_MAX);
+        payload.push_back(sample.SerializeAsString());
+    }
+    return payload;
+}
+
+static void run(const char* name, const payload_t& payload, int repeat)
+{
+    size_t bytes = 0, maxlen = 0;
+    for (size_t i=0; i<payload.size(); i++) {
+        bytes += payload[i].size();
+        maxlen = std::max(maxlen, payload[i].size());
+    }
+
+    std::vector<char> escaped(2*maxlen), unescaped(maxlen);
+    std::vector<std::string> lines;
+    for (size_t i=0; i<payload.size(); i++)
+        lines.push_back(std::string(&escaped[0], escape(payload[i].data(), payload[i].size(), &escaped[0])));
+
+    for (int k=ESCAPE_SCALAR; k<=ESCAPE_AVX2; k++) {
+        if (!escape_select(k))
+            continue;
+
+        double tesc = 1e9, tunesc = 1e9;
+        for (int r=0; r<repeat; r++) {
+            double t0 = now();
+            for (size_t i=0; i<payload.size(); i++)
+                escape(payload[i].data(), payload[i].size(), &escaped[0]);
+            double t1 = now();
+            for (size_t i=0; i<lines.size(); i++) {
+                size_t l = unescape_plan(lines[i].data(), lines[i].size());
+                if (unescape(lines[i].data(), lines[i].size(), &unescaped[0], l)!=0) {
+                    std::cerr << "unescape failed" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            double t2 = now();
+            tesc = std::min(tesc, t1-t0);
+            tunesc = std::min(tunesc, t2-t1);
+        }
+
+        printf("%-10s %-8s %10.1f MB/s escape %10.1f MB/s unescape\n",
+               name, escape_kernel_name(k), bytes/tesc/1e6, bytes/tunesc/1e6);
+    }
+}
+
+void usage(const char *argv0)
+{
+    std::cout << "Usage: " << argv0 << " [-h] [-n REPEAT] [-s SAMPLES] [-w ELEMENTS]" << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << " -h           : Print this message." << std::endl
+              << " -n REPEAT    : Number of runs of each kernel (default = 5)." << std::endl
+              << " -s SAMPLES   : Number of scalar samples (default = 1000000)." << std::endl
+              << " -w ELEMENTS  : Elements of a waveform, 100 of them (default = 100000)." << std::endl
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int repeat = 5;
+    int nscalar = 1000000;
+    int nelements = 100000;
+
+    int ch;
+    while ((ch=getopt(argc, argv, "hn:s:w:")) != EOF) {
+        switch(ch) {
+        case 'n': repeat    = atoi(optarg); break;
+        case 's': nscalar   = atoi(optarg); break;
+        case 'w': nelements = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (repeat<=0 || nscalar<=0 || nelements<=0)
+        usage(argv[0]);
+
+    const int best = escape_kernel();
+    run("scalar", scalarPayload(nscalar), repeat);
+    run("waveform", waveformPayload(100, nelements), repeat);
+    escape_select(best);
+
+    return EXIT_SUCCESS;
+}
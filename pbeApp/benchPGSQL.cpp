@@ -0,0 +1,129 @@
+//////////////////////////////////////////////////////////////////////
+// -*- encoding: utf-8 -*-
+//
+// Benchmark of the sample transfer from RDB in each fetch mode.
+// All modes read the same PV in the same window, so that rows/sec
+// can be compared on the same database.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <unistd.h>
+
+#include "PGSQLReader.h"
+
+//
+#define NumStr(t) {t, #t}
+struct NumStr_t { int num; std::string str; };
+
+// fetch modes to be compared, the first one is the reference
+static std::vector<NumStr_t> kFetchModes = {
+   NumStr(FETCH_TEXT),
+   NumStr(FETCH_BINARY),
+   NumStr(FETCH_COPY),
+   NumStr(FETCH_CHUNK),
+};
+
+static double now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void usage(const char *argv0)
+{
+   std::cout << "Usage: " << argv0 << " [-h] [-S SERVER] [-d DBNAME] [-u USER] [-n REPEAT] [-c CHUNK] [-s START] [-e END] -t DBRTYPE PV" << std::endl
+             << std::endl
+             << "Options:" << std::endl
+             << " -h           : Print this message." << std::endl
+             << " -S SERVER    : PostgreSQL server." << std::endl
+             << " -d DBNAME    : Database name (default = archive)." << std::endl
+             << " -u USER      : Database user (default = report)." << std::endl
+             << " -n REPEAT    : Number of runs in each mode (default = 3)." << std::endl
+             << " -c CHUNK     : Initial rows per FETCH in FETCH_CHUNK (default = 1000)." << std::endl
+             << " -t DBRTYPE   : DBR_TIME_xxxx in numeric expression (required)." << std::endl
+             << " -s START     : Start of the query window." << std::endl
+             << " -e END       : End of the query window." << std::endl
+             << std::endl;
+   exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+   const char  *argv0   = argv[0];
+   std::string  server  = "your.postgresql.server";
+   std::string  dbname  = "archive";
+   std::string  user    = "report";
+   std::string  start   = "";
+   std::string  end     = "";
+   int          dbrtype = -1;
+   int          repeat  = 3;
+   int          chunk   = 1000;
+
+   int ch;
+   while ((ch=getopt(argc, argv, "hS:d:u:n:c:s:e:t:")) != EOF) {
+      switch(ch) {
+      case 'S': server  = optarg;       break;
+      case 'd': dbname  = optarg;       break;
+      case 'u': user    = optarg;       break;
+      case 'n': repeat  = atoi(optarg); break;
+      case 'c': chunk   = atoi(optarg); break;
+      case 's': start   = optarg;       break;
+      case 'e': end     = optarg;       break;
+      case 't': dbrtype = atoi(optarg); break;
+      default:
+         usage(argv0);
+         break;
+      }
+   }
+
+   argc -= optind;
+   argv += optind;
+
+   if (argc!=1 || dbrtype<0 || repeat<=0 || chunk<=0) {
+      usage(argv0);
+   }
+
+   const char *pvname = argv[0];
+   PGSQLReader reader(server.c_str(), dbname.c_str(), user.c_str());
+
+   double reference = 0;
+   for (auto itr = kFetchModes.begin(); itr!=kFetchModes.end(); ++itr) {
+      reader.setFetchMode(itr->num);
+      reader.setChunkSize(chunk);
+
+      double best = 0;
+      unsigned long nrow = 0;
+      for (int i=0; i<repeat; i++) {
+         // find() normalizes the window, so pass a copy
+         std::string s = start;
+         std::string e = end;
+
+         const double t0 = now();
+         unsigned long n = 0;
+         for (const PGSQLReader::Data *samp = reader.find(pvname, dbrtype, s, e); samp; samp = reader.next()) {
+            n++;
+         }
+         const double rate = n / (now() - t0);
+
+         nrow = n;
+         if (rate > best) {
+            best = rate;
+         }
+      }
+
+      if (itr==kFetchModes.begin()) {
+         reference = best;
+      }
+      printf("%-16s %12lu rows %14.0f rows/sec %8.2fx\n", itr->str.c_str(), nrow, best, reference>0 ? best/reference : 0.);
+   }
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+//////////////////////////////////////////////////////////////////////
+// -*- encoding: utf-8 -*-
+//
+// Benchmark of the timestamp conversion of PGSQLReader, against
+// strptime()+timelocal() and localtime_r()+strftime() it replaces.
+// The timestamps are one second apart, as the samples of a query.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <unistd.h>
+
+#include "PGSQLReader.h"
+
+static double now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static time_t libcStr2time(const char *str)
+{
+   struct tm tm;
+   memset(&tm, 0, sizeof(tm));
+   strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+   tm.tm_isdst = -1;
+   return timelocal(&tm);
+}
+
+static const char *libcTime2str(time_t sec)
+{
+   static char buf[32];
+   struct tm tm;
+   localtime_r(&sec, &tm);
+   strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+   return buf;
+}
+
+void usage(const char *argv0)
+{
+   std::cout << "Usage: " << argv0 << " [-h] [-n COUNT] [-s START]" << std::endl
+             << std::endl
+             << "Options:" << std::endl
+             << " -h           : Print this message." << std::endl
+             << " -n COUNT     : Number of timestamps (default = 1000000)." << std::endl
+             << " -s START     : First timestamp (default = 2015-03-01 00:00:00)." << std::endl
+             << std::endl;
+   exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+   int         count = 1000000;
+   const char *start = "2015-03-01 00:00:00";
+
+   int ch;
+   while ((ch=getopt(argc, argv, "hn:s:")) != EOF) {
+      switch(ch) {
+      case 'n': count = atoi(optarg); break;
+      case 's': start = optarg;       break;
+      default:
+         usage(argv[0]);
+         break;
+      }
+   }
+   if (count<=0) {
+      usage(argv[0]);
+   }
+
+   // as PostgreSQL writes timestamp without time zone
+   const time_t first = libcStr2time(start);
+   std::vector<std::string> strs(count);
+   for (int i=0; i<count; i++) {
+      strs[i] = libcTime2str(first + i);
+      strs[i][10] = ' ';
+   }
+
+   int mismatch = 0;
+   double t0 = now();
+   time_t sum0 = 0;
+   for (int i=0; i<count; i++) {
+      sum0 += libcStr2time(strs[i].c_str());
+   }
+   double t1 = now();
+   time_t sum1 = 0;
+   for (int i=0; i<count; i++) {
+      sum1 += PGSQLReader::str2time(strs[i].c_str());
+   }
+   double t2 = now();
+   mismatch += sum0 != sum1;
+
+   size_t len0 = 0;
+   for (int i=0; i<count; i++) {
+      len0 += strlen(libcTime2str(first + i));
+   }
+   double t3 = now();
+   size_t len1 = 0;
+   for (int i=0; i<count; i++) {
+      len1 += strlen(PGSQLReader::time2str(first + i));
+   }
+   double t4 = now();
+   mismatch += len0 != len1;
+
+   for (int i=0; i<count; i+=997) {
+      mismatch += PGSQLReader::str2time(strs[i].c_str()) != first + i;
+      mismatch += strcmp(PGSQLReader::time2str(first + i), libcTime2str(first + i)) != 0;
+   }
+
+   printf("str2time %10.2f Mconv/s  (strptime+timelocal %10.2f Mconv/s)\n", count/(t2-t1)/1e6, count/(t1-t0)/1e6);
+   printf("time2str %10.2f Mconv/s  (localtime+strftime %10.2f Mconv/s)\n", count/(t4-t3)/1e6, count/(t3-t2)/1e6);
+   if (mismatch) {
+      printf("%d mismatches against libc\n", mismatch);
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
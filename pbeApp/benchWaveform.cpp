@@ -0,0 +1,167 @@
+// Benchmark of the transcoding of waveforms into their PB classes, with
+// valueop<DBR,1> and with add_val() of each element as it was done before.
+
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "pbencode.h"
+#include "pbeutil.h"
+#include "EPICSEvent.pb.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// add_val() of each element, the reference
+template<int dbr> struct addeach {
+    static void set(typename dbrstruct<dbr,1>::pbtype& pbc,
+                    const typename dbrstruct<dbr,1>::dbrtype* pdbr,
+                    size_t count)
+    {
+        pbc.mutable_val()->Reserve(count);
+        for (size_t i=0; i<count; i++)
+            pbc.add_val((&pdbr->value)[i]);
+    }
+};
+
+// up to the first zero, as strlen()
+template<> struct addeach<DBR_TIME_CHAR> {
+    static void set(EPICS::VectorChar& pbc,
+                    const dbr_time_char* pdbr,
+                    size_t)
+    {
+        pbc.set_val((const char*)&pdbr->value);
+    }
+};
+
+// valueop<DBR,1> as a template of the DBR type only
+template<int dbr> struct bulk : valueop<dbr,1> {};
+
+// Waveform of n elements, with a zero element after them
+template<int dbr>
+static std::vector<double> waveform(size_t n)
+{
+    typedef typename dbrstruct<dbr,1>::dbrtype dbrtype;
+    const size_t esize = sizeof(dbrtype().value);
+    std::vector<double> buf((sizeof(dbrtype) + (n+1)*esize + sizeof(double)-1)/sizeof(double));
+    char* value = (char*)&((dbrtype*)&buf[0])->value;
+    for (size_t i=0; i<n*esize; i++)
+        value[i] = 1 + rand()%127;
+    if (dbr==DBR_TIME_STRING) {
+        for (size_t i=0; i<n; i++)
+            value[i*esize + i%esize] = '\0';
+    }
+    return buf;
+}
+
+template<int dbr, template<int> class op>
+static void transcode(const std::vector<double>& buf, size_t n, int nsamples,
+                      double* tset, double* ttranscode)
+{
+    typedef typename dbrstruct<dbr,1>::dbrtype dbrtype;
+    const dbrtype* pdbr = (const dbrtype*)&buf[0];
+    typename dbrstruct<dbr,1>::pbtype encoder;
+    std::string out;
+
+    double t0 = now();
+    for (int s=0; s<nsamples; s++) {
+        encoder.Clear();
+        encoder.set_secondsintoyear(s);
+        encoder.set_nano(0);
+        op<dbr>::set(encoder, pdbr, n);
+    }
+    double t1 = now();
+    for (int s=0; s<nsamples; s++) {
+        encoder.Clear();
+        encoder.set_secondsintoyear(s);
+        encoder.set_nano(0);
+        op<dbr>::set(encoder, pdbr, n);
+        encoder.SerializeToString(&out);
+    }
+    double t2 = now();
+    *tset = std::min(*tset, t1-t0);
+    *ttranscode = std::min(*ttranscode, t2-t1);
+}
+
+template<int dbr>
+static void run(const char* name, size_t n, int nsamples, int repeat)
+{
+    typedef typename dbrstruct<dbr,1>::dbrtype dbrtype;
+    const std::vector<double> buf(waveform<dbr>(n));
+    const double bytes = double(n)*sizeof(dbrtype().value)*nsamples;
+
+    double tloop = 1e9, tloopenc = 1e9, tbulk = 1e9, tbulkenc = 1e9;
+    for (int r=0; r<repeat; r++) {
+        transcode<dbr, addeach>(buf, n, nsamples, &tloop, &tloopenc);
+        transcode<dbr, bulk>(buf, n, nsamples, &tbulk, &tbulkenc);
+    }
+
+    printf("%-8s %6zu %10.1f MB/s add_val %10.1f MB/s bulk %10.1f MB/s add_val+serialize %10.1f MB/s bulk+serialize\n",
+           name, n, bytes/tloop/1e6, bytes/tbulk/1e6, bytes/tloopenc/1e6, bytes/tbulkenc/1e6);
+}
+
+void usage(const char *argv0)
+{
+    std::cout << "Usage: " << argv0 << " [-h] [-n REPEAT] [-s SAMPLES] [-w ELEMENTS]" << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << " -h           : Print this message." << std::endl
+              << " -n REPEAT    : Number of runs of each type (default = 5)." << std::endl
+              << " -s SAMPLES   : Number of samples of each run (default = 1000)." << std::endl
+              << " -w ELEMENTS  : Elements of a waveform (default = 4096 and 65536)." << std::endl
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int repeat = 5;
+    int nsamples = 1000;
+    std::vector<size_t> nelements;
+
+    int ch;
+    while ((ch=getopt(argc, argv, "hn:s:w:")) != EOF) {
+        switch(ch) {
+        case 'n': repeat   = atoi(optarg); break;
+        case 's': nsamples = atoi(optarg); break;
+        case 'w':
+            if (atoi(optarg)<=0)
+                usage(argv[0]);
+            nelements.push_back(atoi(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (repeat<=0 || nsamples<=0)
+        usage(argv[0]);
+    if (nelements.empty()) {
+        nelements.push_back(4096);
+        nelements.push_back(65536);
+    }
+
+    for (size_t i=0; i<nelements.size(); i++) {
+        const size_t n = nelements[i];
+        run<DBR_TIME_SHORT>("short", n, nsamples, repeat);
+        run<DBR_TIME_ENUM>("enum", n, nsamples, repeat);
+        run<DBR_TIME_LONG>("long", n, nsamples, repeat);
+        run<DBR_TIME_FLOAT>("float", n, nsamples, repeat);
+        run<DBR_TIME_DOUBLE>("double", n, nsamples, repeat);
+        run<DBR_TIME_CHAR>("char", n, nsamples, repeat);
+        run<DBR_TIME_STRING>("string", n/16, nsamples, repeat);
+    }
+
+    return EXIT_SUCCESS;
+}
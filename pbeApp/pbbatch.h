@@ -0,0 +1,129 @@
+#ifndef PBBATCH_H
+#define PBBATCH_H
+
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+#include <epicsTypes.h>
+#include <db_access.h>
+
+/* Samples of a PV in columns, as PGSQLReader::readBatch() fills them and
+ * transcode_samples<>() of pgsql2pb encodes them. Only the value column
+ * of the DBR type of the batch is used, see batchcolumn<DBR>.
+ */
+struct SampleBatch
+{
+    std::vector<epicsUInt32>  secPastEpoch;
+    std::vector<epicsUInt32>  nsec;
+    std::vector<dbr_short_t>  severity;
+    std::vector<dbr_short_t>  status;
+    std::vector<dbr_enum_t>   enums;   // DBR_TIME_ENUM
+    std::vector<dbr_long_t>   longs;   // DBR_TIME_LONG
+    std::vector<dbr_double_t> doubles; // DBR_TIME_DOUBLE
+    int  dbr;
+    bool sorted; // secPastEpoch never decreases
+
+    SampleBatch() :dbr(-1), sorted(true) {}
+
+    size_t size() const { return secPastEpoch.size(); }
+    bool empty() const { return secPastEpoch.empty(); }
+
+    // The buffers are kept for the next fill
+    void clear(int dbrtype)
+    {
+        secPastEpoch.clear();
+        nsec.clear();
+        severity.clear();
+        status.clear();
+        enums.clear();
+        longs.clear();
+        doubles.clear();
+        dbr = dbrtype;
+        sorted = true;
+    }
+
+    // The value goes to the column of dbr
+    void pushStamp(const epicsTimeStamp& stamp, dbr_short_t sevr, dbr_short_t stat)
+    {
+        if (!secPastEpoch.empty() && stamp.secPastEpoch<secPastEpoch.back())
+            sorted = false;
+        secPastEpoch.push_back(stamp.secPastEpoch);
+        nsec.push_back(stamp.nsec);
+        severity.push_back(sevr);
+        status.push_back(stat);
+    }
+
+    // The first sample from 'from' on at or after endsec, size() if none.
+    // Binary search, unless the time went backwards in the batch.
+    size_t split(size_t from, epicsUInt32 endsec) const
+    {
+        if (sorted)
+            return std::lower_bound(secPastEpoch.begin()+from, secPastEpoch.end(), endsec) - secPastEpoch.begin();
+        size_t i = from;
+        while (i<size() && secPastEpoch[i]<endsec)
+            i++;
+        return i;
+    }
+
+    // out[i-from] = secPastEpoch[i]-startofyear for i in [from, to)
+    void secondsIntoYear(size_t from, size_t to, epicsUInt32 startofyear, epicsUInt32* out) const
+    {
+        const epicsUInt32* sec = secPastEpoch.data() + from;
+        const size_t n = to-from;
+        for (size_t i=0; i<n; i++)
+            out[i] = sec[i] - startofyear;
+    }
+
+    // Sample i as PGSQLReader::Data, a dbr_time_double which is cast to
+    // the dbr_time_* of dbr for the value
+    void get(size_t i, dbr_time_double& out) const
+    {
+        memset(&out, 0, sizeof(out));
+        out.stamp.secPastEpoch = secPastEpoch[i];
+        out.stamp.nsec = nsec[i];
+        out.severity = severity[i];
+        out.status = status[i];
+        switch (dbr) {
+        case DBR_TIME_ENUM:
+            reinterpret_cast<dbr_time_enum*>(&out)->value = enums[i];
+            break;
+        case DBR_TIME_LONG:
+            reinterpret_cast<dbr_time_long*>(&out)->value = longs[i];
+            break;
+        case DBR_TIME_DOUBLE:
+            out.value = doubles[i];
+            break;
+        }
+    }
+};
+
+/* The value column of a DBR type.
+ *  batchcolumn<DBR>::of(batch) is the vector of the values
+ *  batchcolumn<DBR>::dbrtype is the dbr_time_* holding one
+ */
+template<int dbr> struct batchcolumn {};
+
+template<> struct batchcolumn<DBR_TIME_ENUM> {
+    typedef dbr_time_enum dbrtype;
+    typedef dbr_enum_t type;
+    static std::vector<type>& of(SampleBatch& b) { return b.enums; }
+    static const std::vector<type>& of(const SampleBatch& b) { return b.enums; }
+};
+
+template<> struct batchcolumn<DBR_TIME_LONG> {
+    typedef dbr_time_long dbrtype;
+    typedef dbr_long_t type;
+    static std::vector<type>& of(SampleBatch& b) { return b.longs; }
+    static const std::vector<type>& of(const SampleBatch& b) { return b.longs; }
+};
+
+template<> struct batchcolumn<DBR_TIME_DOUBLE> {
+    typedef dbr_time_double dbrtype;
+    typedef dbr_double_t type;
+    static std::vector<type>& of(SampleBatch& b) { return b.doubles; }
+    static const std::vector<type>& of(const SampleBatch& b) { return b.doubles; }
+};
+
+#endif // PBBATCH_H
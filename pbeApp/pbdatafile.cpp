@@ -0,0 +1,260 @@
+#include <cerrno>
+#include <cstring>
+#include <cstddef>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pbdatafile.h"
+
+/* The data header of Channel Archiver, DataHeader::DataHeaderData, with
+ * the file offsets as 32 bit integers:
+ *   0 dir_offset       4 next_offset        8 prev_offset    12 curr_offset
+ *  16 num_samples     20 ctrl_info_offset  24 buf_size       28 buf_free
+ *  32 dbr_type (16)   34 nelements (16)    36 pad[4]         40 period
+ *  48 begin_time      56 next_file_time    64 end_time
+ *  72 prev_file[40]  112 next_file[40]
+ * The samples follow the header, each of the size of dbr_size_n().
+ */
+namespace {
+const size_t kNumSamples = 16;
+const size_t kCtrlInfoOffset = 20;
+const size_t kDbrType = 32;
+const size_t kNelements = 34;
+
+epicsUInt16 get16(const char* p)
+{
+    epicsUInt16 v;
+    memcpy(&v, p, sizeof(v));
+    return be16toh(v);
+}
+
+epicsUInt32 get32(const char* p)
+{
+    epicsUInt32 v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+float getfloat(const char* p)
+{
+    epicsUInt32 v = get32(p);
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+// Offset of the value in dbr_time_* and size of an element, false if the
+// type is not a DBR_TIME_*
+bool valueLayout(int dbr, size_t& offset, size_t& size)
+{
+    switch (dbr) {
+#define CASE(DBR, STRUCT, SIZE) case DBR: \
+    offset = offsetof(STRUCT, value); size = SIZE; return true
+    CASE(DBR_TIME_STRING, dbr_time_string, MAX_STRING_SIZE);
+    CASE(DBR_TIME_SHORT, dbr_time_short, sizeof(dbr_short_t));
+    CASE(DBR_TIME_FLOAT, dbr_time_float, sizeof(dbr_float_t));
+    CASE(DBR_TIME_ENUM, dbr_time_enum, sizeof(dbr_enum_t));
+    CASE(DBR_TIME_CHAR, dbr_time_char, sizeof(dbr_char_t));
+    CASE(DBR_TIME_LONG, dbr_time_long, sizeof(dbr_long_t));
+    CASE(DBR_TIME_DOUBLE, dbr_time_double, sizeof(dbr_double_t));
+#undef CASE
+    default:
+        return false;
+    }
+}
+}
+
+datafilereader::datafilereader()
+    :map(0)
+    ,maplen(0)
+    ,blockoffset(0)
+    ,infooffset(0)
+    ,dbrtype(-1)
+    ,count(0)
+    ,valueoffset(0)
+    ,valuesize(0)
+    ,samplesize(0)
+    ,nsamples(0)
+    ,isample(0)
+    ,current(0)
+    ,infoserial(0)
+{
+    info.type = ctrlinfo_t::Invalid;
+}
+
+datafilereader::~datafilereader()
+{
+    unmapFile();
+}
+
+void datafilereader::mapFile(const std::string& fname)
+{
+    unmapFile();
+    path = fname;
+    int fd = open(fname.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd<0 || fstat(fd, &st)!=0) {
+        int err = errno;
+        if (fd>=0)
+            close(fd);
+        throw std::runtime_error("Can not open "+fname+": "+strerror(err));
+    }
+    maplen = st.st_size;
+    void* p = maplen ? mmap(0, maplen, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    int err = errno;
+    close(fd);
+    if (p==MAP_FAILED) {
+        maplen = 0;
+        throw std::runtime_error("Can not map "+fname+": "+strerror(err));
+    }
+    // the blocks of a channel are read once, front to back
+    madvise(p, maplen, MADV_SEQUENTIAL);
+    map = (const char*)p;
+}
+
+void datafilereader::unmapFile()
+{
+    if (map)
+        munmap((void*)map, maplen);
+    map = 0;
+    maplen = 0;
+}
+
+void datafilereader::corrupted(const char* what) const
+{
+    std::ostringstream msg;
+    msg<<"Error in data header of "<<path<<" @ 0x"<<std::hex<<blockoffset<<": "<<what;
+    throw std::runtime_error(msg.str());
+}
+
+bool datafilereader::readBlock(epicsUInt32 offset)
+{
+    blockoffset = offset;
+    if (size_t(offset)+kHeaderSize > maplen)
+        corrupted("beyond the end of the file");
+    const char* header = map + offset;
+
+    if (!valueLayout(get16(header+kDbrType), valueoffset, valuesize))
+        corrupted("unsupported type");
+    dbrtype = get16(header+kDbrType);
+    count = get16(header+kNelements);
+    if (count==0)
+        corrupted("no elements");
+    samplesize = valueoffset + count*valuesize;
+    nsamples = get32(header+kNumSamples);
+    if (size_t(offset)+kHeaderSize+nsamples*samplesize > maplen)
+        corrupted("samples beyond the end of the file");
+    buf.resize((samplesize+sizeof(double)-1)/sizeof(double));
+
+    epicsUInt32 ctrl = get32(header+kCtrlInfoOffset);
+    if (ctrl!=infooffset) {
+        readInfo(ctrl);
+    }
+    isample = 0;
+    return nsamples>0;
+}
+
+/* CtrlInfo on disk: 16 bit size of all of it and type, then
+ *  Numeric:    disp_high, disp_low, low_warn, low_alarm, high_warn,
+ *              high_alarm as float, 32 bit prec, units
+ *  Enumerated: 16 bit num_states, the states one after the other
+ * with '\0' terminated strings.
+ */
+void datafilereader::readInfo(epicsUInt32 offset)
+{
+    if (size_t(offset)+4 > maplen)
+        corrupted("control information beyond the end of the file");
+    const char* p = map + offset;
+    size_t size = get16(p);
+    if (size<4 || offset+size > maplen)
+        corrupted("invalid size of the control information");
+    const char* end = p + size;
+
+    info.type = get16(p+2);
+    info.units.clear();
+    info.states.clear();
+    if (info.type==ctrlinfo_t::Numeric) {
+        if (size < 4+7*4)
+            corrupted("truncated numeric control information");
+        info.disp_high = getfloat(p+4);
+        info.disp_low = getfloat(p+8);
+        info.low_warn = getfloat(p+12);
+        info.low_alarm = getfloat(p+16);
+        info.high_warn = getfloat(p+20);
+        info.high_alarm = getfloat(p+24);
+        info.prec = (epicsInt32)get32(p+28);
+        info.units.assign(p+32, strnlen(p+32, end-(p+32)));
+    } else if (info.type==ctrlinfo_t::Enumerated) {
+        if (size < 4+2)
+            corrupted("truncated enumerated control information");
+        size_t num = get16(p+4);
+        const char* s = p+6;
+        for (size_t i=0; i<num && s<end; i++) {
+            size_t len = strnlen(s, end-s);
+            info.states.push_back(std::string(s, len));
+            s += len+1;
+        }
+    } else {
+        info.type = ctrlinfo_t::Invalid;
+    }
+    infooffset = offset;
+    infoserial++;
+}
+
+const dbr_time_double* datafilereader::decode()
+{
+    char* out = (char*)&buf[0];
+    memcpy(out, map + blockoffset + kHeaderSize + isample*samplesize, samplesize);
+
+    dbr_time_double* sample = (dbr_time_double*)out;
+    sample->status = be16toh(sample->status);
+    sample->severity = be16toh(sample->severity);
+    sample->stamp.secPastEpoch = be32toh(sample->stamp.secPastEpoch);
+    sample->stamp.nsec = be32toh(sample->stamp.nsec);
+
+    char* value = out + valueoffset;
+    if (dbrtype!=DBR_TIME_STRING) {
+        switch (valuesize) {
+        case 2:
+            for (unsigned i=0; i<count; i++)
+                ((epicsUInt16*)value)[i] = be16toh(((epicsUInt16*)value)[i]);
+            break;
+        case 4:
+            for (unsigned i=0; i<count; i++)
+                ((epicsUInt32*)value)[i] = be32toh(((epicsUInt32*)value)[i]);
+            break;
+        case 8:
+            for (unsigned i=0; i<count; i++)
+                ((uint64_t*)value)[i] = be64toh(((uint64_t*)value)[i]);
+            break;
+        }
+    }
+    return current = sample;
+}
+
+const dbr_time_double* datafilereader::find(const std::string& fname, epicsUInt32 offset)
+{
+    current = 0;
+    // the blocks of a channel are mostly in the same file one after the other
+    if (!map || fname!=path) {
+        mapFile(fname);
+        infooffset = ~epicsUInt32(0);
+    }
+    if (readBlock(offset))
+        return decode();
+    return 0;
+}
+
+const dbr_time_double* datafilereader::next()
+{
+    if (current && ++isample < nsamples)
+        return decode();
+    return current = 0;
+}
@@ -0,0 +1,85 @@
+#ifndef PBDATAFILE_H
+#define PBDATAFILE_H
+
+#include <string>
+#include <vector>
+
+#include <epicsTypes.h>
+#include <db_access.h>
+
+// Samples of a data block of a channel, read straight from the .data files
+// of Channel Archiver through mmap() instead of the Storage library. The
+// blocks are those of the RTree of the index, one after the other, a file
+// stays mapped while its blocks are read.
+//
+// The files are big-endian. Each sample is converted in place of the last
+// one into a dbr_time_* buffer of the reader, valid until the next call to
+// next(). Unlike the Storage library, nothing is shared between readers,
+// so that they can be used in parallel threads.
+class datafilereader
+{
+public:
+    // Control information of the current data block, CtrlInfo on disk
+    struct ctrlinfo_t {
+        enum { Invalid, Numeric, Enumerated };
+        int type;
+        float disp_high, disp_low;
+        float low_warn, low_alarm, high_warn, high_alarm;
+        epicsInt32 prec;
+        std::string units;
+        std::vector<std::string> states;
+    };
+
+    datafilereader();
+    ~datafilereader();
+
+    // The first sample of the block at offset of the data file, NULL if
+    // there is none. Throws std::runtime_error on a corrupted block or a
+    // file which can not be mapped.
+    const dbr_time_double* find(const std::string& path, epicsUInt32 offset);
+    // The sample as dbr_time_* of getType(), NULL at the end of the block
+    const dbr_time_double* get() const { return current; }
+    const dbr_time_double* next();
+
+    int getType() const { return dbrtype; }
+    unsigned getCount() const { return count; }
+    const ctrlinfo_t& getInfo() const { return info; }
+    // Changed whenever getInfo() changes
+    unsigned getInfoSerial() const { return infoserial; }
+
+    // On disk sizes
+    enum { kHeaderSize = 152 };
+
+private:
+    datafilereader(const datafilereader&);
+    datafilereader& operator=(const datafilereader&);
+
+    void mapFile(const std::string& path);
+    void unmapFile();
+    bool readBlock(epicsUInt32 offset);
+    void readInfo(epicsUInt32 offset);
+    const dbr_time_double* decode();
+    void corrupted(const char* what) const;
+
+    std::string path;      // of the mapped file
+    const char* map;
+    size_t maplen;
+
+    epicsUInt32 blockoffset;
+    epicsUInt32 infooffset;
+
+    int dbrtype;
+    unsigned count;
+    size_t valueoffset;    // in dbr_time_*
+    size_t valuesize;      // of an element
+    size_t samplesize;
+    epicsUInt32 nsamples;  // of the block
+    epicsUInt32 isample;
+
+    std::vector<double> buf; // for alignment
+    const dbr_time_double* current;
+    ctrlinfo_t info;
+    unsigned infoserial;
+};
+
+#endif // PBDATAFILE_H
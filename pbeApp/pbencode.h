@@ -0,0 +1,293 @@
+#ifndef PBENCODE_H
+#define PBENCODE_H
+
+#include <string.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <epicsTypes.h>
+#include <db_access.h>
+
+#include "pbsearch.h"
+
+/* Protocol Buffers wire format of a sample, written without a message object.
+ * The output is the same as SerializeToCodedStream() of the message of
+ * dbrstruct<DBR,isarray>::pbtype with secondsintoyear, nano, val and, when
+ * not zero, severity and status set.
+ * The fieldvalues of the PV are encoded once by fieldvaluesblock(), those of
+ * a reconnection are left to protobuf.
+ */
+namespace pbwire {
+
+enum {
+    WIRE_VARINT = 0,
+    WIRE_FIXED64 = 1,
+    WIRE_BYTES = 2,
+    WIRE_FIXED32 = 5,
+};
+
+constexpr char tag(int field, int wiretype)
+{
+    return char(field<<3 | wiretype);
+}
+
+inline char* varint(char* p, uint64_t v)
+{
+    while (v>=0x80) {
+        *p++ = char(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = char(v);
+    return p;
+}
+
+// int32 fields are sign extended to 64 bits, so a negative value takes 10 bytes
+inline char* int32(char* p, epicsInt32 v)
+{
+    return varint(p, uint64_t(int64_t(v)));
+}
+
+inline char* sint32(char* p, epicsInt32 v)
+{
+    return varint(p, (epicsUInt32(v)<<1) ^ epicsUInt32(v>>31));
+}
+
+inline char* fixed32(char* p, epicsUInt32 v)
+{
+    for (int i=0; i<4; i++, v>>=8)
+        *p++ = char(v);
+    return p;
+}
+
+inline char* fixed64(char* p, uint64_t v)
+{
+    for (int i=0; i<8; i++, v>>=8)
+        *p++ = char(v);
+    return p;
+}
+
+inline char* bytes(char* p, const char* s, size_t len)
+{
+    p = varint(p, len);
+    memcpy(p, s, len);
+    return p+len;
+}
+
+} // namespace pbwire
+
+/* The fieldvalues (field 7) of the PV, encoded once.
+ * Protobuf writes field 7 after the fields up to status, so the block is
+ * appended as is to the encoding of a sample, see escapingstream::put().
+ */
+inline std::string fieldvaluesblock(const std::vector<std::pair<std::string, std::string> >& fieldvalues)
+{
+    std::string block;
+    char key[1+10];
+    for (size_t i=0; i<fieldvalues.size(); i++) {
+        const std::string& name = fieldvalues[i].first;
+        const std::string& val = fieldvalues[i].second;
+
+        std::string fv;
+        char* p = key;
+        *p++ = pbwire::tag(1, pbwire::WIRE_BYTES);
+        p = pbwire::varint(p, name.size());
+        fv.append(key, p-key).append(name);
+        p = key;
+        *p++ = pbwire::tag(2, pbwire::WIRE_BYTES);
+        p = pbwire::varint(p, val.size());
+        fv.append(key, p-key).append(val);
+
+        p = key;
+        *p++ = pbwire::tag(7, pbwire::WIRE_BYTES);
+        p = pbwire::varint(p, fv.size());
+        block.append(key, p-key).append(fv);
+    }
+    return block;
+}
+
+/* Writes the val field, following the type of .val of dbrstruct<DBR,0>::pbtype.
+ *  valueenc<DBR>::put(buffer, dbr_* pointer)
+ */
+template<int dbr> struct valueenc {};
+
+template<> struct valueenc<DBR_TIME_STRING> {
+    static char* put(char* p, const dbr_time_string* pdbr)
+    {
+        *p++ = pbwire::tag(3, pbwire::WIRE_BYTES);
+        return pbwire::bytes(p, pdbr->value, strnlen(pdbr->value, MAX_STRING_SIZE));
+    }
+};
+
+// same as valueop<DBR_TIME_CHAR,0>, a zero value is an empty string
+template<> struct valueenc<DBR_TIME_CHAR> {
+    static char* put(char* p, const dbr_time_char* pdbr)
+    {
+        *p++ = pbwire::tag(3, pbwire::WIRE_BYTES);
+        return pbwire::bytes(p, (const char*)&pdbr->value, pdbr->value ? 1 : 0);
+    }
+};
+
+template<> struct valueenc<DBR_TIME_SHORT> {
+    static char* put(char* p, const dbr_time_short* pdbr)
+    {
+        *p++ = pbwire::tag(3, pbwire::WIRE_VARINT);
+        return pbwire::sint32(p, pdbr->value);
+    }
+};
+
+template<> struct valueenc<DBR_TIME_ENUM> {
+    static char* put(char* p, const dbr_time_enum* pdbr)
+    {
+        *p++ = pbwire::tag(3, pbwire::WIRE_VARINT);
+        return pbwire::sint32(p, pdbr->value);
+    }
+};
+
+template<> struct valueenc<DBR_TIME_LONG> {
+    static char* put(char* p, const dbr_time_long* pdbr)
+    {
+        *p++ = pbwire::tag(3, pbwire::WIRE_FIXED32);
+        return pbwire::fixed32(p, epicsUInt32(pdbr->value));
+    }
+};
+
+template<> struct valueenc<DBR_TIME_FLOAT> {
+    static char* put(char* p, const dbr_time_float* pdbr)
+    {
+        epicsUInt32 bits;
+        memcpy(&bits, &pdbr->value, sizeof(bits));
+        *p++ = pbwire::tag(3, pbwire::WIRE_FIXED32);
+        return pbwire::fixed32(p, bits);
+    }
+};
+
+template<> struct valueenc<DBR_TIME_DOUBLE> {
+    static char* put(char* p, const dbr_time_double* pdbr)
+    {
+        uint64_t bits;
+        memcpy(&bits, &pdbr->value, sizeof(bits));
+        *p++ = pbwire::tag(3, pbwire::WIRE_FIXED64);
+        return pbwire::fixed64(p, bits);
+    }
+};
+
+/* Encoder of a sample without fieldvalues.
+ *  sampleenc<DBR,isarray>::supported is 0 when protobuf has to be used.
+ *  sampleenc<DBR,isarray>::encode(buffer of maxsize, ...) returns the length.
+ */
+template<int dbr, int isarray> struct sampleenc {
+    enum { supported = 0, maxsize = 1 };
+    static size_t encode(char*, epicsUInt32, epicsUInt32,
+                         const typename dbrstruct<dbr,isarray>::dbrtype*,
+                         epicsInt32, epicsInt32)
+    {
+        return 0;
+    }
+};
+
+template<int dbr> struct sampleenc<dbr,0> {
+    // tags and varints of secondsintoyear, nano, severity and status, and the value up to a string
+    enum { supported = 1, maxsize = 2*(1+5) + 2*(1+10) + 1+1+MAX_STRING_SIZE };
+
+    static size_t encode(char* buf, epicsUInt32 secondsintoyear, epicsUInt32 nano,
+                         const typename dbrstruct<dbr,0>::dbrtype* pdbr,
+                         epicsInt32 severity, epicsInt32 status)
+    {
+        char* p = buf;
+        *p++ = pbwire::tag(1, pbwire::WIRE_VARINT);
+        p = pbwire::varint(p, secondsintoyear);
+        *p++ = pbwire::tag(2, pbwire::WIRE_VARINT);
+        p = pbwire::varint(p, nano);
+        p = valueenc<dbr>::put(p, pdbr);
+        if (severity!=0) {
+            *p++ = pbwire::tag(4, pbwire::WIRE_VARINT);
+            p = pbwire::int32(p, severity);
+        }
+        if (status!=0) {
+            *p++ = pbwire::tag(5, pbwire::WIRE_VARINT);
+            p = pbwire::int32(p, status);
+        }
+        return p-buf;
+    }
+};
+
+/* Element-typed bulk copy of a waveform into the repeated val of a PB class.
+ * Elements of the same type as the field are copied with memcpy(), the
+ * others (short and enum into sint32) are converted in one loop over the
+ * resized field, without add_val() for each.
+ */
+template<typename T, typename E>
+inline void setarray(google::protobuf::RepeatedField<T>* val, const E* pvalue, size_t count)
+{
+    val->Resize(count, T());
+    T* out = val->mutable_data();
+    for (size_t i=0; i<count; i++)
+        out[i] = pvalue[i];
+}
+
+template<typename T>
+inline void setarray(google::protobuf::RepeatedField<T>* val, const T* pvalue, size_t count)
+{
+    val->Resize(count, T());
+    if (count)
+        memcpy(val->mutable_data(), pvalue, count*sizeof(T));
+}
+
+// Strings up to the terminating zero, if there is one
+inline void setarray(google::protobuf::RepeatedPtrField<std::string>* val, const dbr_string_t* pvalue, size_t count)
+{
+    val->Reserve(count);
+    for (size_t i=0; i<count; i++)
+        val->Add()->assign(pvalue[i], strnlen(pvalue[i], MAX_STRING_SIZE));
+}
+
+/* Type specific operations helper for transcode_samples<>().
+ *  valueop<DBR,isarray>::set(PBClass, dbr_* pointer, # of elements)
+ *   Assign a scalar or array to the .val of a PB class instance (ie. EPICS::ScalarDouble)
+ */
+template<int dbr, int isarray> struct valueop {
+    static void set(typename dbrstruct<dbr,isarray>::pbtype& pbc,
+                    const typename dbrstruct<dbr,isarray>::dbrtype* pdbr,
+                    size_t)
+    {
+        pbc.set_val(pdbr->value);
+    }
+};
+
+// Partial specialization for arrays, see setarray()
+template<int dbr> struct valueop<dbr,1> {
+    static void set(typename dbrstruct<dbr,1>::pbtype& pbc,
+                    const typename dbrstruct<dbr,1>::dbrtype* pdbr,
+                    size_t count)
+    {
+        setarray(pbc.mutable_val(), &pdbr->value, count);
+    }
+};
+
+// specialization for scalar char
+template<> struct valueop<DBR_TIME_CHAR,0> {
+    static void set(EPICS::ScalarByte& pbc,
+                    const dbr_time_char* pdbr,
+                    size_t)
+    {
+        char buf[2];
+        buf[0] = pdbr->value;
+        buf[1] = '\0';
+        pbc.set_val(buf);
+    }
+};
+
+// specialization for vector char, all elements as bytes
+template<> struct valueop<DBR_TIME_CHAR,1> {
+    static void set(EPICS::VectorChar& pbc,
+                    const dbr_time_char* pdbr,
+                    size_t count)
+    {
+        pbc.set_val((const char*)&pdbr->value, count);
+    }
+};
+
+#endif // PBENCODE_H
@@ -0,0 +1,160 @@
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PBESCAPE_X86
+#include <immintrin.h>
+#endif
+
+#include "pbescape.h"
+
+// Scalar fallback, also used for the tail shorter than a vector
+template<int special>
+static const char* find_scalar(const char* p, const char* e)
+{
+    for (; p<e; p++) {
+        if (*p=='\x1b' || (special && (*p=='\n' || *p=='\r')))
+            return p;
+    }
+    return e;
+}
+
+#ifdef PBESCAPE_X86
+// SSE2 is always there on x86_64
+template<int special>
+static const char* find_sse2(const char* p, const char* e)
+{
+    const __m128i esc = _mm_set1_epi8('\x1b');
+    const __m128i nl  = _mm_set1_epi8('\n');
+    const __m128i cr  = _mm_set1_epi8('\r');
+    for (; e-p>=16; p+=16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i m = _mm_cmpeq_epi8(v, esc);
+        if (special)
+            m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+        int bits = _mm_movemask_epi8(m);
+        if (bits)
+            return p + __builtin_ctz(bits);
+    }
+    return find_scalar<special>(p, e);
+}
+
+template<int special>
+__attribute__((target("avx2")))
+static const char* find_avx2(const char* p, const char* e)
+{
+    const __m256i esc = _mm256_set1_epi8('\x1b');
+    const __m256i nl  = _mm256_set1_epi8('\n');
+    const __m256i cr  = _mm256_set1_epi8('\r');
+    for (; e-p>=32; p+=32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i m = _mm256_cmpeq_epi8(v, esc);
+        if (special)
+            m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr)));
+        unsigned bits = _mm256_movemask_epi8(m);
+        if (bits)
+            return p + __builtin_ctz(bits);
+    }
+    return find_sse2<special>(p, e);
+}
+#endif
+
+typedef const char* (*find_t)(const char*, const char*);
+
+struct kernel_t {
+    const char* name;
+    find_t find;
+    find_t find_esc;
+};
+
+static const kernel_t kernels[] = {
+    {"scalar", &find_scalar<1>, &find_scalar<0>},
+#ifdef PBESCAPE_X86
+    {"sse2",   &find_sse2<1>,   &find_sse2<0>},
+    {"avx2",   &find_avx2<1>,   &find_avx2<0>},
+#else
+    {"sse2",   0, 0},
+    {"avx2",   0, 0},
+#endif
+};
+
+static int supported(int kernel)
+{
+    switch (kernel) {
+    case ESCAPE_SCALAR:
+        return 1;
+#ifdef PBESCAPE_X86
+    case ESCAPE_SSE2:
+        return 1;
+    case ESCAPE_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+static int best()
+{
+    for (int k=ESCAPE_AVX2; k>ESCAPE_SCALAR; k--) {
+        if (supported(k))
+            return k;
+    }
+    return ESCAPE_SCALAR;
+}
+
+static int current = best();
+
+int escape_select(int kernel)
+{
+    if (!supported(kernel))
+        return 0;
+    current = kernel;
+    return 1;
+}
+
+int escape_kernel()
+{
+    return current;
+}
+
+const char* escape_kernel_name(int kernel)
+{
+    if (kernel<ESCAPE_SCALAR || kernel>ESCAPE_AVX2)
+        return "unknown";
+    return kernels[kernel].name;
+}
+
+const char* escape_find(const char* p, const char* e)
+{
+    return kernels[current].find(p, e);
+}
+
+const char* escape_find_esc(const char* p, const char* e)
+{
+    return kernels[current].find_esc(p, e);
+}
+
+size_t escape(const char* in, size_t inlen, char* out)
+{
+    const find_t find = kernels[current].find;
+    const char* e = in+inlen;
+    char* o = out;
+    for (;;) {
+        // copy the clean run at once
+        const char* q = find(in, e);
+        if (o!=in)
+            memmove(o, in, q-in);
+        o += q-in;
+        if (q==e)
+            break;
+        *o++ = '\x1b';
+        switch (*q) {
+        case '\x1b': *o++ = 1; break;
+        case '\n':   *o++ = 2; break;
+        case '\r':   *o++ = 3; break;
+        }
+        in = q+1;
+    }
+    return o-out;
+}
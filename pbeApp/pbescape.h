@@ -0,0 +1,30 @@
+#ifndef PBESCAPE_H
+#define PBESCAPE_H
+
+#include <stddef.h>
+
+// Kernels which look for the bytes to be escaped in the PB line format
+// (0x1b, '\n' and '\r'), many bytes at a time. The best one supported by
+// the CPU is chosen at startup.
+enum escape_kernel_t {
+    ESCAPE_SCALAR,
+    ESCAPE_SSE2,
+    ESCAPE_AVX2,
+};
+
+// Returns 0 if the kernel is not supported by this build or CPU
+int escape_select(int kernel);
+int escape_kernel();
+const char* escape_kernel_name(int kernel);
+
+// First byte to be escaped in [p, e), or e if none
+const char* escape_find(const char* p, const char* e);
+// First 0x1b in [p, e), or e if none
+const char* escape_find_esc(const char* p, const char* e);
+
+// Escape inlen bytes into out, which has room for 2*inlen bytes.
+// Returns the number of bytes written. The output may overlap the input
+// when out+inlen <= in, as at most two bytes are written per byte read.
+size_t escape(const char* in, size_t inlen, char* out);
+
+#endif // PBESCAPE_H
@@ -4,17 +4,28 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <stdexcept>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <algorithm>
 
 #include <epicsTime.h>
 #include <osiFileName.h>
 
+#include "pbeutil.h"
+#include "pbescape.h"
+
 static const char pvseps_def[] = ":-{}";
 const char *pvseps = pvseps_def;
 
@@ -36,29 +47,205 @@ std::string pvpathname(const char* pvname)
     return fname;
 }
 
-// Recurisvely create (if needed) the directory components of the path
-void createDirs(const std::string& path)
+namespace {
+
+// Open directories, by path without the trailing separator
+class dircache
 {
-    size_t p=0;
-    while((p=path.find_first_of(pathsep[0], p))!=std::string::npos)
+public:
+    struct dir_t {
+        int fd;
+        int refs;               // users of the fd, which is not closed then
+        unsigned long lastuse;
+    };
+
+    dircache() :clock(0) {}
+    ~dircache()
     {
-        std::string part(path.substr(0, p));
-        p++;
-        if (part.size()<=0) {
-            continue;
-        }
-        if (mkdir(part.c_str(), 0755)!=0) {
-            switch(errno) {
-            case EEXIST:
+        for (cache_t::iterator it=cache.begin(); it!=cache.end(); ++it)
+            close(it->second.fd);
+    }
+
+    // The directory, created if missing, or NULL on failure. It stays open
+    // until released. The system calls are made without the lock, the
+    // directories opened are cached afterwards.
+    dir_t* acquire(const std::string& path)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // deepest cached ancestor
+        size_t end = path.size();
+        cache_t::iterator it = cache.find(path);
+        while (it==cache.end() && end>0) {
+            end = path.rfind(pathsep[0], end-1);
+            if (end==std::string::npos || end==0) {
+                end = 0;
                 break;
-            default:
-                printf("mkdir(%s) : %s\n", part.c_str(), strerror(errno));
+            }
+            it = cache.find(path.substr(0, end));
+        }
+        // kept open while the directories below are created
+        dir_t* ancestor = it==cache.end() ? 0 : &it->second;
+        if (ancestor) {
+            ancestor->refs++;
+        }
+        lock.unlock();
+
+        // the directories below, created and opened one level at a time
+        std::vector<std::pair<std::string, int> > opened;
+        int base = ancestor ? ancestor->fd : AT_FDCWD;
+        bool failed = false;
+        while (end<path.size()) {
+            size_t next = path.find(pathsep[0], end+1);
+            if (next==std::string::npos)
+                next = path.size();
+            // the first component is opened with its leading separator,
+            // as the path may be absolute
+            const std::string name(base==AT_FDCWD ? path.substr(0, next) : path.substr(end+1, next-end-1));
+            end = next;
+            if (name.empty())
+                continue;
+
+            int fd = openat(base, name.c_str(), O_PATH|O_DIRECTORY|O_CLOEXEC);
+            if (fd<0 && errno==ENOENT) {
+                if (mkdirat(base, name.c_str(), 0755)!=0 && errno!=EEXIST)
+                    pvlog_printf("mkdir(%s) : %s\n", path.substr(0, next).c_str(), strerror(errno));
+                fd = openat(base, name.c_str(), O_PATH|O_DIRECTORY|O_CLOEXEC);
+            }
+            if (fd<0) {
+                failed = true;
                 break;
             }
-        } else {
-           // std::cerr<<"Create directory "<<part<<"\n";
+            opened.push_back(std::make_pair(path.substr(0, next), fd));
+            base = fd;
+        }
+
+        lock.lock();
+        if (ancestor) {
+            ancestor->refs--;
+        }
+        for (size_t i=0; i<opened.size(); i++) {
+            dir_t dir = {opened[i].second, 0, 0};
+            std::pair<cache_t::iterator, bool> ins = cache.insert(std::make_pair(opened[i].first, dir));
+            if (!ins.second) {
+                // cached by another thread meanwhile
+                close(opened[i].second);
+            }
+            it = ins.first;
+        }
+        if (failed || it==cache.end()) {
+            evict();
+            return 0;
+        }
+
+        it->second.refs++;
+        it->second.lastuse = ++clock;
+        evict();
+        return &it->second;
+    }
+
+    void release(dir_t* dir)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        dir->refs--;
+    }
+
+    // Drop the directory, its ancestors and the directories below, which
+    // are stale when it was removed or renamed. Those in use are dropped
+    // when they are found stale again once released.
+    void forget(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cache_t::iterator it = cache.begin();
+        while (it!=cache.end()) {
+            const std::string& name = it->first;
+            const bool related = name==path
+                    || (path.compare(0, name.size(), name)==0 && path[name.size()]==pathsep[0])
+                    || (name.compare(0, path.size(), path)==0 && name[path.size()]==pathsep[0]);
+            if (related && it->second.refs==0) {
+                close(it->second.fd);
+                cache.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    // keep well below the limit of open files
+    enum { kMaxDirs = 256 };
+
+    // close the least recently used directories not in use
+    void evict()
+    {
+        while (cache.size()>kMaxDirs) {
+            cache_t::iterator lru = cache.end();
+            for (cache_t::iterator it=cache.begin(); it!=cache.end(); ++it) {
+                if (it->second.refs==0 && (lru==cache.end() || it->second.lastuse<lru->second.lastuse))
+                    lru = it;
+            }
+            if (lru==cache.end())
+                break;
+            close(lru->second.fd);
+            cache.erase(lru);
         }
     }
+
+    typedef std::map<std::string, dir_t> cache_t;
+    cache_t cache;
+    unsigned long clock;
+    std::mutex mutex;
+};
+
+dircache dirs;
+
+} // namespace
+
+void createDirs(const std::string& path)
+{
+    size_t p = path.rfind(pathsep[0]);
+    if (p==std::string::npos || p==0)
+        return;
+    const std::string dirpath(path.substr(0, p));
+    for (int attempt=0; attempt<2; attempt++) {
+        dircache::dir_t* dir = dirs.acquire(dirpath);
+        if (!dir)
+            return;
+        // a cached directory which was removed or renamed is not the one
+        // of the path any more
+        struct stat cached, named;
+        const bool same = fstat(dir->fd, &cached)==0 && stat(dirpath.c_str(), &named)==0
+                && cached.st_dev==named.st_dev && cached.st_ino==named.st_ino;
+        dirs.release(dir);
+        if (same)
+            return;
+        dirs.forget(dirpath);
+    }
+}
+
+int openCreateDirs(const std::string& path, int flags, int mode)
+{
+    size_t p = path.rfind(pathsep[0]);
+    if (p==std::string::npos || p==0)
+        return open(path.c_str(), flags, mode);
+    const std::string dirpath(path.substr(0, p));
+    int fd = -1;
+    for (int attempt=0; attempt<2; attempt++) {
+        dircache::dir_t* dir = dirs.acquire(dirpath);
+        if (!dir)
+            return open(path.c_str(), flags, mode);
+        fd = openat(dir->fd, path.c_str()+p+1, flags, mode);
+        const int err = errno;
+        dirs.release(dir);
+        if (fd>=0 || err!=ENOENT || !(flags & O_CREAT)) {
+            errno = err;
+            return fd;
+        }
+        // the cached directory was removed or renamed, once more by path
+        dirs.forget(dirpath);
+        errno = err;
+    }
+    return fd;
 }
 
 // Get the year in which the given timestamp falls
@@ -117,29 +304,156 @@ void getStartOfYearMonth(int year, int month, epicsTimeStamp* t)
     t->nsec = 0;
 }
 
-int unescape(const char *in, size_t inlen, char *out, size_t outlen)
+// Days since 1970-01-01 of a proleptic Gregorian date
+static long long daysFromCivil(int y, int m, int d)
+{
+    y -= m<=2;
+    const long long era = (y>=0 ? y : y-399) / 400;
+    const int yoe = y - era*400;
+    const int doy = (153*(m>2 ? m-3 : m+9) + 2)/5 + d-1;
+    const int doe = yoe*365 + yoe/4 - yoe/100 + doy;
+    return era*146097 + doe - 719468;
+}
+
+static void civilFromDays(long long z, int *y, int *m, int *d)
 {
-    char *initout = out;
-    int escape = 0;
+    z += 719468;
+    const long long era = (z>=0 ? z : z-146096) / 146097;
+    const int doe = z - era*146097;
+    const int yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    const int doy = doe - (365*yoe + yoe/4 - yoe/100);
+    const int mp = (5*doy + 2)/153;
+    *d = doy - (153*mp + 2)/5 + 1;
+    *m = mp<10 ? mp+3 : mp-9;
+    *y = yoe + era*400 + (*m<=2);
+}
+
+// n digits at str, or -1
+static inline int digits(const char *str, int n)
+{
+    int v = 0;
+    for (int i=0; i<n; i++) {
+        const unsigned c = str[i]-'0';
+        if (c>9)
+            return -1;
+        v = v*10 + c;
+    }
+    return v;
+}
+
+int parseIsoTime(const char *str, long long *wall, int *hasoffset, long *offset)
+{
+    // the samples of a query come in order, the date rarely changes
+    static thread_local char lastdate[10];
+    static thread_local long long lastdays = 0;
+
+    if (strnlen(str, 19)<19)
+        return 0;
+
+    long long days;
+    if (memcmp(str, lastdate, sizeof(lastdate))==0) {
+        days = lastdays;
+    } else {
+        const int y = digits(str, 4), m = digits(str+5, 2), d = digits(str+8, 2);
+        if (y<0 || str[4]!='-' || m<1 || m>12 || str[7]!='-' || d<1 || d>31)
+            return 0;
+        days = daysFromCivil(y, m, d);
+        memcpy(lastdate, str, sizeof(lastdate));
+        lastdays = days;
+    }
+
+    if (str[10]!=' ' && str[10]!='T')
+        return 0;
+    const int hh = digits(str+11, 2), mm = digits(str+14, 2), ss = digits(str+17, 2);
+    if (hh<0 || hh>24 || str[13]!=':' || mm<0 || mm>59 || str[16]!=':' || ss<0 || ss>60)
+        return 0;
+    *wall = days*86400 + hh*3600 + mm*60 + ss;
 
-    for(; inlen; inlen--, in++) {
-        char I = *in;
+    const char *p = str+19;
+    if (*p=='.') {
+        for (p++; *p>='0' && *p<='9'; p++)
+            ;
+    }
 
-        if(escape) {
-            escape = 0;
-            switch(I) {
-            case 1: *out++ = 0x1b; break;
-            case 2: *out++ = '\n'; break;
-            case 3: *out++ = '\r'; break;
-            default:               return 1;
+    *hasoffset = 0;
+    *offset = 0;
+    if (*p=='Z') {
+        *hasoffset = 1;
+        p++;
+    } else if (*p=='+' || *p=='-') {
+        const int sign = *p++=='-' ? -1 : 1;
+        long off = 0;
+        // hh, then optional :mm and :ss
+        for (int i=0, scale=3600; i<3; i++, scale/=60) {
+            if (i>0) {
+                if (*p!=':')
+                    break;
+                p++;
             }
-        } else if(I==0x1b){
-            escape = 1;
-        } else {
-            *out++ = I;
+            const int v = digits(p, 2);
+            if (v<0)
+                return 0;
+            off += v*scale;
+            p += 2;
+        }
+        *hasoffset = 1;
+        *offset = sign*off;
+    }
+    return *p=='\0';
+}
+
+void formatIsoTime(long long wall, char *buf)
+{
+    long long days = wall/86400;
+    long secs = wall%86400;
+    if (secs<0) {
+        secs += 86400;
+        days--;
+    }
+    int y, m, d;
+    civilFromDays(days, &y, &m, &d);
+    const int v[6] = {y, m, d, int(secs/3600), int(secs/60%60), int(secs%60)};
+    // "YYYY-MM-DDThh:mm:ss"
+    static const char sep[] = "--T::";
+    char *p = buf;
+    for (int i=0; i<6; i++) {
+        if (i==0) {
+            *p++ = '0' + v[0]/1000%10;
+            *p++ = '0' + v[0]/100%10;
         }
+        *p++ = '0' + v[i]/10%10;
+        *p++ = '0' + v[i]%10;
+        if (i<5)
+            *p++ = sep[i];
     }
-    if(initout+outlen!=out)
+    *p = '\0';
+}
+
+int unescape(const char *in, size_t inlen, char *out, size_t outlen)
+{
+    const char *e = in+inlen;
+    char *oe = out+outlen;
+
+    for (;;) {
+        // copy the run up to the next escape at once
+        const char *q = escape_find_esc(in, e);
+        if ((size_t)(oe-out) < (size_t)(q-in))
+            return 2;
+        memcpy(out, in, q-in);
+        out += q-in;
+        if (q==e || q+1==e)
+            break;
+        if (out==oe)
+            return 2;
+        switch(q[1]) {
+        case 1: *out++ = 0x1b; break;
+        case 2: *out++ = '\n'; break;
+        case 3: *out++ = '\r'; break;
+        default:               return 1;
+        }
+        in = q+2;
+    }
+    if(oe!=out)
         return 2;
     return 0;
 }
@@ -147,22 +461,82 @@ int unescape(const char *in, size_t inlen, char *out, size_t outlen)
 /* compute the size of the unescaped string */
 size_t unescape_plan(const char *in, size_t inlen)
 {
+    const char *e = in+inlen;
     size_t outlen = inlen;
 
-    while(inlen-- && outlen>=0) {
-        if(*in++ == 0x1b) {
-            // skip next
-            in++;
-            inlen--;
-            // remove one from output
-            outlen--;
+    // each escape and the byte after it become a single byte
+    while ((in=escape_find_esc(in, e))!=e) {
+        outlen--;
+        in += 2;
+        if (in>=e)
+            break;
+    }
+
+    return outlen;
+}
+
+// Offset of the last newline in [limit, end) of the file, or -1 if none.
+// Read backward in blocks, so that only the tail of a large file is touched.
+static off_t rfindNewline(int fd, off_t end, off_t limit)
+{
+    char buf[64*1024];
+    while (end>limit) {
+        size_t len = std::min<off_t>(sizeof(buf), end-limit);
+        off_t pos = end-len;
+        if (pread(fd, buf, len, pos)!=(ssize_t)len)
+            return -1;
+        for (size_t i=len; i>0; i--) {
+            if (buf[i-1]=='\n')
+                return pos+i-1;
         }
+        end = pos;
     }
+    return -1;
+}
 
-    if(outlen<0)
-        return -1;
+int readHeadTail(const char *file, std::string& head, std::string& tail)
+{
+    head.clear();
+    tail.clear();
 
-    return outlen;
+    int fd = open(file, O_RDONLY);
+    if (fd<0)
+        return 0;
+
+    struct stat st;
+    int ok = fstat(fd, &st)==0;
+
+    // The header is small, read forward up to its newline
+    off_t headend = -1;
+    char buf[4096];
+    for (off_t pos=0; ok && headend<0 && pos<st.st_size; ) {
+        ssize_t n = pread(fd, buf, sizeof(buf), pos);
+        if (n<=0) {
+            ok = 0;
+            break;
+        }
+        char *nl = (char*)memchr(buf, '\n', n);
+        head.append(buf, nl ? nl-buf : n);
+        if (nl)
+            headend = pos + (nl-buf);
+        pos += n;
+    }
+    ok = ok && headend>=0;
+
+    // The last complete line is between the last two newlines. A partial
+    // line after the last newline is ignored.
+    off_t e = ok ? rfindNewline(fd, st.st_size, headend+1) : -1;
+    if (e>=0) {
+        off_t b = rfindNewline(fd, e, headend+1);
+        if (b<0)
+            b = headend;
+        tail.resize(e-b-1);
+        if (tail.size()>0 && pread(fd, &tail[0], tail.size(), b+1)!=(ssize_t)tail.size())
+            ok = 0;
+    }
+
+    close(fd);
+    return ok;
 }
 
 std::ostream& operator<<(std::ostream& strm, const epicsTime& t)
@@ -171,3 +545,91 @@ std::ostream& operator<<(std::ostream& strm, const epicsTime& t)
     strm<<ctime(&sec.ts);
     return strm;
 }
+
+struct pvlog_t {
+    int active;
+    std::string tag;
+    std::ostringstream buf;
+    pvlog_t() :active(0) {}
+};
+
+static thread_local pvlog_t pvlog_state;
+static std::mutex pvlog_mutex;
+static std::ostream* pvlog_out = &std::cout;
+
+void pvlog_redirect(std::ostream& strm)
+{
+    pvlog_out = &strm;
+}
+
+std::ostream& pvlog()
+{
+    if (pvlog_state.active)
+        return pvlog_state.buf;
+    return *pvlog_out;
+}
+
+void pvlog_printf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    if (pvlog_state.active || pvlog_out!=&std::cout) {
+        std::ostream& out = pvlog();
+        char buf[1024];
+        va_list copy;
+        va_copy(copy, args);
+        int n = vsnprintf(buf, sizeof(buf), fmt, copy);
+        va_end(copy);
+        if (n >= (int)sizeof(buf)) {
+            std::vector<char> big(n+1);
+            vsnprintf(&big[0], big.size(), fmt, args);
+            out << &big[0];
+        } else if (n > 0) {
+            out << buf;
+        }
+    } else {
+        vprintf(fmt, args);
+    }
+    va_end(args);
+}
+
+void pvlog_end()
+{
+    if (!pvlog_state.active)
+        return;
+    pvlog_state.active = 0;
+
+    const std::string msg(pvlog_state.buf.str());
+    pvlog_state.buf.str("");
+
+    std::lock_guard<std::mutex> lock(pvlog_mutex);
+    size_t p = 0, q;
+    while (p < msg.size()) {
+        q = msg.find('\n', p);
+        if (q == std::string::npos)
+            q = msg.size();
+        *pvlog_out << "[" << pvlog_state.tag << "] ";
+        pvlog_out->write(msg.data()+p, q-p);
+        *pvlog_out << "\n";
+        p = q+1;
+    }
+    pvlog_out->flush();
+}
+
+// messages of a thread which calls exit() are not lost
+static void pvlog_atexit()
+{
+    if (pvlog_state.active)
+        pvlog_end();
+}
+
+void pvlog_begin(const std::string& tag)
+{
+    static std::once_flag once;
+    std::call_once(once, []() { atexit(pvlog_atexit); });
+
+    pvlog_state.active = 1;
+    pvlog_state.tag = tag;
+    pvlog_state.buf.str("");
+    pvlog_state.buf.clear();
+}
@@ -2,6 +2,7 @@
 #define PVEUTIL_H
 
 #include <string>
+#include <ostream>
 
 #include <epicsTime.h>
 
@@ -16,7 +17,19 @@ enum boundary_t {
 size_t unescape_plan(const char *in, size_t inlen);
 int unescape(const char *in, size_t inlen, char *out, size_t outlen);
 
+// Read the first line (header) and the last complete line of a .pb file,
+// without reading the lines in between. tail is empty when there is no
+// sample. Returns 0 when the file or the header cannot be read.
+int readHeadTail(const char *file, std::string& head, std::string& tail);
+
+// Create the missing directory components of the path of a file.
+// The directories are kept open in a cache shared by the threads, and
+// created and opened relative to the deepest cached ancestor, instead of
+// walking the path from the root for every file.
 void createDirs(const std::string& path);
+// open() of a file after creating its directories, relative to the cached
+// directory. Returns -1 with errno set on failure.
+int openCreateDirs(const std::string& path, int flags, int mode);
 
 void getYear(const epicsTimeStamp& t, int *year);
 void getStartOfYear(int year, epicsTimeStamp* t);
@@ -24,6 +37,28 @@ void getStartOfYear(int year, epicsTimeStamp* t);
 void getYearMonth(const epicsTimeStamp& t, int *year, int *month);
 void getStartOfYearMonth(int year, int month, epicsTimeStamp* t);
 
+// Parse "YYYY-MM-DD hh:mm:ss" (or with 'T'), optionally followed by a
+// fraction of a second and a UTC offset ("Z", "+hh", "-hh:mm", ...), as
+// PostgreSQL writes timestamps. wall is the date and time in seconds as if
+// it were UTC, the fraction is dropped. offset is the UTC offset in
+// seconds, and hasoffset tells whether the string has one.
+// Returns 0 when the string is not in this format.
+int parseIsoTime(const char *str, long long *wall, int *hasoffset, long *offset);
+// Write wall clock seconds as "YYYY-MM-DDThh:mm:ss" into buf of at least
+// 20 bytes
+void formatIsoTime(long long wall, char *buf);
+
 std::ostream& operator<<(std::ostream& strm, const epicsTime& t);
 
+// Messages of the PV being exported by the calling thread.
+// They go to stdout, unless pvlog_begin() is called. Then they are buffered
+// and written by pvlog_end() at once, with the tag prefixed on each line,
+// so that messages of worker threads do not interleave.
+std::ostream& pvlog();
+void pvlog_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void pvlog_begin(const std::string& tag);
+void pvlog_end();
+// Send the messages to strm instead of stdout, before any thread logs
+void pvlog_redirect(std::ostream& strm);
+
 #endif // PVEUTIL_H
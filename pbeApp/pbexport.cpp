@@ -12,6 +12,14 @@
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <regex>
+#include <unordered_set>
+
+#include <unistd.h>
+#include <dirent.h>
 
 // Base
 #include <epicsVersion.h>
@@ -28,15 +36,183 @@
 
 #include "pbsearch.h"
 #include "pbstreams.h"
+#include "pbencode.h"
+#include "pbfile.h"
+#include "pbsched.h"
+#include "pbdatafile.h"
 #include "pbeutil.h"
 #include "EPICSEvent.pb.h"
 
 #include <google/protobuf/stubs/common.h>
 #include <google/protobuf/io/coded_stream.h>
 
-struct PBWriter
+// The storage library of Channel Archiver keeps the open data files in a
+// process wide cache without locking. Calls into it are serialized, the
+// workers of -j encode and write in parallel, and read too with -m.
+static std::mutex archivermutex;
+
+static bool before(const epicsTimeStamp& a, const epicsTimeStamp& b)
+{
+    return a.secPastEpoch<b.secPastEpoch || (a.secPastEpoch==b.secPastEpoch && a.nsec<b.nsec);
+}
+
+// Samples of the PV being exported
+class samplereader
+{
+public:
+    virtual ~samplereader() {}
+    virtual const RawValue::Data *get() = 0;
+    virtual const RawValue::Data *next() = 0;
+    virtual DbrType getType() = 0;
+    virtual DbrCount getCount() = 0;
+    virtual const CtrlInfo& getInfo() = 0;
+};
+
+// From a DataReader of the storage library
+class storagereader : public samplereader
 {
     DataReader& reader;
+public:
+    explicit storagereader(DataReader& reader) :reader(reader) {}
+    virtual const RawValue::Data *get() { return reader.get(); }
+    virtual const RawValue::Data *next()
+    {
+        std::lock_guard<std::mutex> lock(archivermutex);
+        return reader.next();
+    }
+    virtual DbrType getType() { return reader.getType(); }
+    virtual DbrCount getCount() { return reader.getCount(); }
+    virtual const CtrlInfo& getInfo() { return reader.getInfo(); }
+};
+
+// From the data files mapped by a datafilereader, without the storage
+// library. The datablocks are those of the RTree of the index, as for
+// RawDataReader, each one clipped to the time range of its entry. The
+// CtrlInfo follows the one of the current data block. The block is used
+// under the lock only, and deleted with it held.
+class mappedreader : public samplereader
+{
+    datafilereader reader;
+    CtrlInfo info;
+    unsigned infoserial;
+    const stdString name;
+    const std::string dirname;
+    AutoPtr<RTree::Datablock> block;
+    epicsTimeStamp blockstart, blockend;
+    const RawValue::Data *samp;
+    epicsTimeStamp last;   // of samp, once there was one
+    bool havelast;
+    bool fresh;            // nothing returned from the current block yet
+
+    const RawValue::Data *update(const RawValue::Data *samp)
+    {
+        if (samp && reader.getInfoSerial()!=infoserial) {
+            const datafilereader::ctrlinfo_t& ci = reader.getInfo();
+            if (ci.type==datafilereader::ctrlinfo_t::Numeric) {
+                info.setNumeric(ci.prec, ci.units.c_str(), ci.disp_low, ci.disp_high,
+                                ci.low_alarm, ci.low_warn, ci.high_warn, ci.high_alarm);
+            } else if (ci.type==datafilereader::ctrlinfo_t::Enumerated) {
+                size_t len = 0;
+                for (size_t i=0; i<ci.states.size(); i++)
+                    len += ci.states[i].size()+1;
+                info.allocEnumerated(ci.states.size(), len);
+                for (size_t i=0; i<ci.states.size(); i++)
+                    info.setEnumeratedString(i, ci.states[i].c_str());
+                info.calcEnumeratedSize();
+            } else {
+                info = CtrlInfo();
+            }
+            infoserial = reader.getInfoSerial();
+        }
+        return samp;
+    }
+
+    // Maps the current datablock, or the next one with advance. A block
+    // which can not be read is logged and skipped, as the corrupted headers
+    // of PBWriter::write(). False after the last block.
+    bool openBlock(bool advance)
+    {
+        for (;;) {
+            std::string path;
+            epicsUInt32 offset;
+            {
+                std::lock_guard<std::mutex> lock(archivermutex);
+                if (advance ? !block->getNextDatablock() : !block->isValid()) {
+                    return false;
+                }
+                advance = true;
+                path = block->getDataFilename().c_str();
+                if (path[0]!='/' && !dirname.empty()) {
+                    path = dirname + "/" + path;
+                }
+                offset = block->getDataOffset();
+                blockstart = block->getStart();
+                blockend = block->getEnd();
+            }
+            try {
+                reader.find(path, offset);
+                fresh = true;
+                return true;
+            } catch (std::runtime_error& e) {
+                pvlog()<<"ERROR: "<<name.c_str()<<": Corrupted datablock, continuing with the next one.\n"<<e.what()<<"\n";
+            }
+        }
+    }
+
+    // The first sample from s on in the range of its block, else of the
+    // following blocks. Where the blocks overlap, the samples up to the last
+    // one returned are dropped.
+    const RawValue::Data *clip(const RawValue::Data *s)
+    {
+        for (;;) {
+            while (s && (before(s->stamp, blockstart) ||
+                         (fresh && havelast && !before(last, s->stamp)))) {
+                s = reader.next();
+            }
+            if (s && !before(blockend, s->stamp)) {
+                fresh = false;
+                havelast = true;
+                last = s->stamp;
+                return samp = update(s);
+            }
+            if (!openBlock(true)) {
+                return samp = 0;
+            }
+            s = reader.get();
+        }
+    }
+public:
+    // From block of the RTree of name on
+    mappedreader(const stdString& name, const stdString& dirname, RTree::Datablock *block)
+        :infoserial(0), name(name), dirname(dirname.c_str()), block(block), samp(0)
+        ,havelast(false), fresh(true)
+    {}
+    // The first sample, NULL if there is none. Call without the lock.
+    const RawValue::Data *start()
+    {
+        if (!block || !openBlock(false)) {
+            return 0;
+        }
+        return clip(reader.get());
+    }
+    virtual const RawValue::Data *get() { return samp; }
+    virtual const RawValue::Data *next() { return clip(reader.next()); }
+    virtual DbrType getType() { return reader.getType(); }
+    virtual DbrCount getCount() { return reader.getCount(); }
+    virtual const CtrlInfo& getInfo() { return info; }
+};
+
+// The last sample of the newest partition of a PV, as found by -i before
+// the export, so that the file is not read again when it is appended to
+struct lastsample_t {
+    std::string file;
+    int pbtype;           // PayloadType of the file
+    epicsTimeStamp stamp;
+};
+
+struct PBWriter
+{
+    samplereader& reader;
     // Last returned sample, or NULL if all consumed
     const RawValue::Data *samp;
     const CtrlInfo& info;
@@ -50,13 +226,27 @@ struct PBWriter
     //epicsTimeStamp startofboundary;
     epicsTimeStamp endofboundary;
 
-    std::ofstream outpb;
+    pbfile outpb;
     int typeChangeError;
     const stdString name;
+    const std::string outdir;
+    const epicsTimeStamp endofwindow; // samples from here on are not exported
+    const lastsample_t* resume;       // NULL once the file is opened
 
-    PBWriter(DataReader& reader, stdString pv);
+    PBWriter(samplereader& reader, stdString pv, const std::string& outdir, const epicsTimeStamp& endofwindow,
+             const lastsample_t* resume);
     void write(); // all work is done through this method
 
+    const RawValue::Data *inWindow(const RawValue::Data *s)
+    {
+        return s && before(s->stamp, endofwindow) ? s : 0;
+    }
+
+    const RawValue::Data *next()
+    {
+        return inWindow(reader.next());
+    }
+
     bool prepFile();
 
     void forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNano);
@@ -67,56 +257,6 @@ struct PBWriter
 };
 
 
-/* Type specific operations helper for transcode_samples<>().
- *  valueop<DBR,isarray>::set(PBClass, dbr_* pointer, # of elements)
- *   Assign a scalar or array to the .val of a PB class instance (ie. EPICS::ScalarDouble)
- */
-template<int dbr, int isarray> struct valueop {
-    static void set(typename dbrstruct<dbr,isarray>::pbtype& pbc,
-                    const typename dbrstruct<dbr,isarray>::dbrtype* pdbr,
-                    DbrCount)
-    {
-        pbc.set_val(pdbr->value);
-    }
-};
-
-// Partial specialization for arrays (works for numerics and scalar string)
-// does this work for array of string? Verified by jbobnar: YES, it works for array of strings
-template<int dbr> struct valueop<dbr,1> {
-    static void set(typename dbrstruct<dbr,1>::pbtype& pbc,
-                    const typename dbrstruct<dbr,1>::dbrtype* pdbr,
-                    DbrCount count)
-    {
-        pbc.mutable_val()->Reserve(count);
-        for(DbrCount i=0; i<count; i++)
-            pbc.add_val((&pdbr->value)[i]);
-    }
-};
-
-// specialization for scalar char
-template<> struct valueop<DBR_TIME_CHAR,0> {
-    static void set(EPICS::ScalarByte& pbc,
-                    const dbr_time_char* pdbr,
-                    DbrCount)
-    {
-        char buf[2];
-        buf[0] = pdbr->value;
-        buf[1] = '\0';
-        pbc.set_val(buf);
-    }
-};
-
-// specialization for vector char
-template<> struct valueop<DBR_TIME_CHAR,1> {
-    static void set(EPICS::VectorChar& pbc,
-                    const dbr_time_char* pdbr,
-                    DbrCount count)
-    {
-        const epicsUInt8 *pbuf = &pdbr->value;
-        pbc.set_val((const char*)pbuf);
-    }
-};
-
 template<int dbr, int isarray>
 void transcode_samples(PBWriter& self)
 {
@@ -126,7 +266,7 @@ void transcode_samples(PBWriter& self)
 
 
     encoder_t encoder;
-    escapingarraystream encbuf;
+    escapingstream encbuf;
     fieldvalues_t fieldvalues;
 
     epicsUInt32 disconnected_epoch = 0;
@@ -177,11 +317,15 @@ void transcode_samples(PBWriter& self)
         }
     }
 
+    // the fields are constant for the PV, encode them once
+    const std::string fieldblock(fieldvaluesblock(fieldvalues));
+    const std::string noblock;
+
     DbrType previousType = self.reader.getType();
     do{
         if (self.reader.getType() != previousType) {
-            std::cerr<<"ERROR: The type of PV "<<self.name.c_str()<<" changed from " << previousType << " to " << self.reader.getType() << "\n";
-            std::cerr<<"wrote: "<<nwrote<<"\n";
+            pvlog()<<"ERROR: The type of PV "<<self.name.c_str()<<" changed from " << previousType << " to " << self.reader.getType() << "\n";
+            pvlog()<<"wrote: "<<nwrote<<"\n";
             self.typeChangeError += 1;
             return;
         }
@@ -189,8 +333,8 @@ void transcode_samples(PBWriter& self)
         sample_t *sample = (sample_t*)self.samp;
 
         if(sample->stamp.secPastEpoch>=self.endofboundary.secPastEpoch) {
-            std::cerr<<"Boundary "<<sample->stamp.secPastEpoch<<" "<<self.endofboundary.secPastEpoch <<"\n";
-            std::cerr<<"wrote: "<<nwrote<<"\n";
+            pvlog()<<"Boundary "<<sample->stamp.secPastEpoch<<" "<<self.endofboundary.secPastEpoch <<"\n";
+            pvlog()<<"wrote: "<<nwrote<<"\n";
             self.typeChangeError = 0;
             return;
         }
@@ -224,7 +368,7 @@ void transcode_samples(PBWriter& self)
             continue;
         } else if (sevr > 3) {
             //sevr == 3856 || sevr == 3968
-            std::cerr<<"WARN: "<<self.name.c_str()<<": Severity "<< sevr<<" encountered\n";
+            pvlog()<<"WARN: "<<self.name.c_str()<<": Severity "<< sevr<<" encountered\n";
             write_fields = 0; //don't write fields if special severity
         } else if (disconnected_epoch != 0) {
             //this is the first sample with value after a disconnected one
@@ -251,6 +395,20 @@ void transcode_samples(PBWriter& self)
             disconnected_epoch = 0;
         }
 
+        // the fields of the PV go with the first sample of each day
+        const std::string& fields = fieldvalues.size() && write_fields ? fieldblock : noblock;
+        if (fieldvalues.size() && write_fields)
+            last_day_fields_written = day;
+
+        if (sampleenc<dbr, isarray>::supported && encoder.fieldvalues_size()==0) {
+            // no fieldvalues of a reconnection, write the wire format without the message
+            char raw[sampleenc<dbr, isarray>::maxsize];
+            encbuf.put(raw, sampleenc<dbr, isarray>::encode(raw, secintoyear, sample->stamp.nsec, sample, sample->severity, sample->status), fields);
+            self.outpb.write(encbuf.data(), encbuf.size());
+            nwrote++;
+            continue;
+        }
+
         if (sevr!=0)
             encoder.set_severity(sample->severity);
         if(sample->status!=0)
@@ -261,39 +419,21 @@ void transcode_samples(PBWriter& self)
 
         valueop<dbr, isarray>::set(encoder, sample, self.reader.getCount());
 
-        if(fieldvalues.size() && write_fields)
-        {
-            // encoder accumulated fieldvalues for this sample
-            for(fieldvalues_t::const_iterator it=fieldvalues.begin(), end=fieldvalues.end();
-                it!=end; ++it)
-            {
-                EPICS::FieldValue* FV(encoder.add_fieldvalues());
-                FV->set_name(it->first);
-                FV->set_val(it->second);
-            }
-            //fieldvalues.clear(); // don't clear the fields, we will use them again later
-            last_day_fields_written = day;
-        }
-
         try{
-            {
-                google::protobuf::io::CodedOutputStream encstrm(&encbuf);
-                encoder.SerializeToCodedStream(&encstrm);
-            }
-            encbuf.finalize();
-            self.outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+            encbuf.serialize(encoder, fields);
+            self.outpb.write(encbuf.data(), encbuf.size());
             nwrote++;
         }catch(std::exception& e) {
-            std::cerr<<"ERROR encoding sample! : "<<e.what()<<"\n";
+            pvlog()<<"ERROR encoding sample! : "<<e.what()<<"\n";
             encbuf.reset();
             // skip
         }
 
-    }while(self.outpb.good() && (self.samp=self.reader.next()));
+    }while(self.outpb.good() && (self.samp=self.next()));
 
 
-    std::cerr<<"End file "<<self.samp<<" "<<self.outpb.good()<<"\n";
-    std::cerr<<"Wrote "<<nwrote<<"\n";
+    pvlog()<<"End file "<<self.samp<<" "<<self.outpb.good()<<"\n";
+    pvlog()<<"Wrote "<<nwrote<<"\n";
 }
 
 void PBWriter::forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNano)
@@ -304,7 +444,7 @@ void PBWriter::forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNa
     //now skip forward to the first sample that is later than the last event read from the file
     unsigned int sampseconds = samp->stamp.secPastEpoch;
     while ((sampseconds < sec) && samp) {
-        samp = reader.next();
+        samp = next();
         if (samp)
             sampseconds = samp->stamp.secPastEpoch;
     }
@@ -312,7 +452,7 @@ void PBWriter::forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNa
     if (samp && (sampseconds == sec)) {
         unsigned int sampnano = samp->stamp.nsec; //in some cases I got overflow!?
         while (samp && (sampseconds == sec && sampnano <= nano)) {
-            samp = reader.next();
+            samp = next();
             if (samp) {
                 sampseconds = samp->stamp.secPastEpoch;
                 sampnano = samp->stamp.nsec;
@@ -364,7 +504,7 @@ bool PBWriter::prepFile()
 
     EPICS::PayloadInfo header;
 
-    std::cerr<<"is a "<<(isarray?"array\n":"scalar\n");
+    pvlog()<<"is a "<<(isarray?"array\n":"scalar\n");
     if(!isarray) {
         // Scalars
         switch(dtype)
@@ -411,15 +551,15 @@ bool PBWriter::prepFile()
 
     header.set_elementcount(reader.getCount());
     header.set_year(year);
-    header.set_pvname(reader.channel_name.c_str());
+    header.set_pvname(name.c_str());
 
     std::ostringstream fname;
     switch (b) {
     case PARTITION_YEAR:
-       fname << pvpathname(reader.channel_name.c_str())<<":"<<year<<".pb";
+       fname << outdir << pvpathname(name.c_str())<<":"<<year<<".pb";
        break;
     case PARTITION_MONTH:
-       fname << pvpathname(reader.channel_name.c_str())<<":"<<year<<"_"<<std::setfill('0')<<std::setw(2)<<std::right<<month<<".pb";
+       fname << outdir << pvpathname(name.c_str())<<":"<<year<<"_"<<std::setfill('0')<<std::setw(2)<<std::right<<month<<".pb";
        break;
     default:
             std::ostringstream msg;
@@ -436,43 +576,51 @@ bool PBWriter::prepFile()
         if(fp) {
             fclose(fp);
             fileexists = 1;
-            try {
-                (*skipForward)(*this,fname.str().c_str());
-            } catch (std::invalid_argument& e) {
-                //invalid argument is thrown when the sample type
-                //doesn't match the type in the existing file
-                typeChangeError++;
-                return false;
+            if (resume && resume->file==fname.str()) {
+                if (resume->pbtype!=header.type()) {
+                    pvlog()<<"ERROR: The existing file "<<resume->file<<" is of a different type '"<<resume->pbtype
+                           <<"' than the new data '"<<header.type()<<"\n";
+                    typeChangeError++;
+                    resume = 0;
+                    return false;
+                }
+                // known from before the export, the file is not read again
+                forwardReaderToTime(resume->stamp.secPastEpoch, resume->stamp.nsec);
+            } else {
+                try {
+                    (*skipForward)(*this,fname.str().c_str());
+                } catch (std::invalid_argument& e) {
+                    //invalid argument is thrown when the sample type
+                    //doesn't match the type in the existing file
+                    typeChangeError++;
+                    return false;
+                }
             }
         }
     }
+    resume = 0;
 
-    std::cerr<<"Starting to write "<<fname.str()<<"\n";
-    createDirs(fname.str());
-
-    escapingarraystream encbuf;
-    {
-        if (!fileexists) {
-            google::protobuf::io::CodedOutputStream encstrm(&encbuf);
-            header.SerializeToCodedStream(&encstrm);
-        }
-    }
-    encbuf.finalize();
-
-    outpb.open(fname.str().c_str(), std::fstream::app);
+    pvlog()<<"Starting to write "<<fname.str()<<"\n";
+    outpb.open(fname.str(), 1);
     if (!fileexists) { //if file exists do not write header
-        outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+        escapingstream encbuf;
+        encbuf.serialize(header);
+        outpb.write(encbuf.data(), encbuf.size());
     }
     return true;
 }
 
-PBWriter::PBWriter(DataReader& reader, stdString pv)
+PBWriter::PBWriter(samplereader& reader, stdString pv, const std::string& outdir, const epicsTimeStamp& endofwindow,
+                   const lastsample_t* resume)
     :reader(reader)
     ,info(reader.getInfo())
     ,year(0)
     ,name(pv)
+    ,outdir(outdir)
+    ,endofwindow(endofwindow)
+    ,resume(resume)
 {
-    samp = reader.get();
+    samp = inWindow(reader.get());
 }
 
 void PBWriter::write()
@@ -490,8 +638,8 @@ void PBWriter::write()
                 //Error in the data header means a corrupted sample data.
                 //It can happen in the prepFile or in the transcode. Either way the resolution is the same.
                 //We try to move ahead. If it doesn't work, abort.
-                std::cerr<<"ERROR: "<<name.c_str()<<": Corrupted header, continuing with the next sample.\n"<<up.what()<<"\n";
-                samp = reader.next();
+                pvlog()<<"ERROR: "<<name.c_str()<<": Corrupted header, continuing with the next sample.\n"<<up.what()<<"\n";
+                samp = next();
             } else {
                 //tough luck
                 outpb.close();
@@ -502,24 +650,331 @@ void PBWriter::write()
             throw;
         }
 
-        bool ok = outpb.good();
         outpb.close();
-        if(!ok) {
-            std::cerr<<"Error writing file\n";
+        if(!outpb.good()) {
+            pvlog()<<"Error writing file\n";
             break;
         }
     }
 }
 
+// Samples to export, from start up to but not including end. With
+// incremental, from the last sample of the newest partition of the PV
+// already in the output directory on, if that is later.
+struct window_t {
+    epicsTimeStamp start; // {0, 0} for the first sample of the PV
+    epicsTimeStamp end;   // {~0, ~0} for the last
+    bool incremental;
+};
+
+// The newest partition file of the PV in outdir, empty if there is none.
+// Files of a type change, with a ".N" suffix, are not considered.
+static std::string newestPartition(const std::string& outdir, const stdString& pvname)
+{
+    const std::string path(outdir + pvpathname(pvname.c_str()) + ":");
+    const size_t slash = path.rfind('/');
+    const std::string dir(slash==std::string::npos ? "." : path.substr(0, slash));
+    const std::string prefix(slash==std::string::npos ? path : path.substr(slash+1));
+
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        return std::string();
+    }
+    // YYYY.pb or YYYY_MM.pb, which sort by time
+    std::string newest;
+    while (struct dirent *ent = readdir(d)) {
+        const std::string fname(ent->d_name);
+        if (fname.size() > prefix.size()+3
+                && fname.compare(0, prefix.size(), prefix)==0
+                && fname.find_first_not_of("0123456789_", prefix.size())==fname.size()-3
+                && fname.compare(fname.size()-3, 3, ".pb")==0
+                && fname > newest) {
+            newest = fname;
+        }
+    }
+    closedir(d);
+    if (newest.empty() || slash==std::string::npos) {
+        return newest;
+    }
+    return dir + "/" + newest;
+}
+
+static void writePV(samplereader& reader, const stdString& pvname, const std::string& outdir,
+                    const epicsTimeStamp& from, const epicsTimeStamp& end, const lastsample_t* resume)
+{
+    try {
+        // the datablock found for the start holds earlier samples too
+        const RawValue::Data *samp = reader.get();
+        while (samp && before(samp->stamp, from)) {
+            samp = reader.next();
+        }
+        if (!samp) {
+            pvlog()<<"WARN: No data after the start\n";
+            return;
+        }
+        PBWriter writer(reader, pvname, outdir, end, resume);
+        writer.write();
+    } catch (std::exception& e) {
+        pvlog()<<"Exception: "<<pvname.c_str()<<": "<<e.what()<<"\n";
+    }
+}
+
+// Export the samples of a PV in the window. The reader starts at the
+// datablock of the index which covers the start. With mapped, the data
+// files are read by a mappedreader.
+static void exportPV(AutoIndex& idx, const stdString& pvname, const std::string& outdir,
+                     const window_t& window, bool mapped)
+{
+    try {
+        pvlog()<<"Visit PV "<<pvname.c_str()<<"\n";
+        epicsTimeStamp from = window.start;
+        bool resumed = false;
+        lastsample_t last;
+        if (window.incremental) {
+            last.file = newestPartition(outdir, pvname);
+            if (!last.file.empty() && getLastSampleTime(last.file.c_str(), &last.stamp, &last.pbtype)
+                    && before(from, last.stamp)) {
+                pvlog()<<"Resume after the last sample of "<<last.file<<"\n";
+                from = last.stamp;
+                resumed = true;
+            }
+        }
+
+        // the readers, the index and its blocks are deleted before the lock
+        // is released
+        std::unique_lock<std::mutex> lock(archivermutex);
+
+        epicsTime start,end;
+        stdString dirname;
+        AutoPtr<RTree> tree(idx.getTree(pvname, dirname));
+        if(!tree || !tree->getInterval(start, end)) {
+            pvlog()<<"WARN: No Data or no times\n";
+            return;
+        }
+        if (before(from, start)) {
+            from = start;
+        }
+        if (!before(from, window.end) || before(end, from) || (resumed && !before(from, end))) {
+            pvlog()<<"WARN: No new data in the window\n";
+            return;
+        }
+
+        pvlog()<<" start "<<start<<" end   "<<end<<"\n";
+
+        if (mapped) {
+            mappedreader reader(pvname, dirname, tree->search(epicsTime(from)));
+            lock.unlock();
+            if(!reader.start()) {
+                pvlog()<<"WARN: No data after all\n";
+                lock.lock();
+                return;
+            }
+            pvlog()<<" Type "<<reader.getType()<<" count "<<reader.getCount()<<"\n";
+            writePV(reader, pvname, outdir, from, window.end, resumed ? &last : 0);
+            lock.lock();
+            return;
+        }
+
+        AutoPtr<DataReader> reader(ReaderFactory::create(idx, ReaderFactory::Raw, 0.0));
+
+        pvlog()<<" Type "<<reader->getType()<<" count "<<reader->getCount()<<"\n";
+
+        const epicsTime seek(from);
+        if(!reader->find(pvname, &seek)) {
+            pvlog()<<"WARN: No data after all\n";
+            return;
+        }
+
+        lock.unlock();
+        storagereader samples(*reader);
+        writePV(samples, pvname, outdir, from, window.end, resumed ? &last : 0);
+        lock.lock();
+    } catch (std::exception& e) {
+        //print exception and continue with the next pv
+        pvlog()<<"Exception: "<<pvname.c_str()<<": "<<e.what()<<"\n";
+    }
+}
+
+// Estimated cost of exporting a PV, in datablocks. Each month of the time
+// span counts as one more, for the partition file opened and closed.
+struct cost_t {
+    double   predicted;
+    unsigned blocks;
+    double   span;   // seconds
+};
+
+static cost_t estimateCost(AutoIndex& idx, const stdString& pvname)
+{
+    cost_t cost = {1, 0, 0};
+    stdString dirname;
+    AutoPtr<RTree> tree(idx.getTree(pvname, dirname));
+    epicsTime start,end;
+    if(!tree || !tree->getInterval(start, end)) {
+        return cost;
+    }
+    cost.span = epicsTimeStamp(end).secPastEpoch - epicsTimeStamp(start).secPastEpoch;
+
+    AutoPtr<RTree::Datablock> block(tree->getFirstDatablock());
+    if (block) {
+        for (bool ok = block->isValid(); ok; ok = block->getNextDatablock()) {
+            cost.blocks++;
+        }
+    }
+    cost.predicted = cost.blocks + cost.span/(30*86400.0) + 1;
+    return cost;
+}
+
+// PVs of the index which match the regular expression from the start, as
+// Python re.match() of exportall.py, and are in the list if one is given
+static std::vector<stdString> listPVs(AutoIndex& idx, const std::string& pattern, const std::string& listfile)
+{
+    std::unordered_set<std::string> pvlist;
+    if (!listfile.empty()) {
+        std::ifstream in(listfile.c_str());
+        if (!in) {
+            throw std::runtime_error("Can not read "+listfile);
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            const size_t first = line.find_first_not_of(" \t\r");
+            const size_t last = line.find_last_not_of(" \t\r");
+            if (first!=std::string::npos) {
+                pvlist.insert(line.substr(first, last-first+1));
+            }
+        }
+    }
+    const std::regex regex(pattern);
+
+    std::vector<stdString> names;
+    Index::NameIterator iter;
+    if(!idx.getFirstChannel(iter)) {
+        return names;
+    }
+    do {
+        const std::string name(iter.getName().c_str());
+        if (!std::regex_search(name, regex, std::regex_constants::match_continuous)) {
+            continue;
+        }
+        if (!listfile.empty() && pvlist.find(name)==pvlist.end()) {
+            continue;
+        }
+        names.push_back(iter.getName());
+    } while(idx.getNextChannel(iter));
+    return names;
+}
+
+// "YYYY-MM-DDThh:mm:ss" in UTC, or with a UTC offset
+static bool parseTime(const char *str, epicsTimeStamp *t)
+{
+    long long wall;
+    int hasoffset;
+    long offset;
+    if (!parseIsoTime(str, &wall, &hasoffset, &offset)) {
+        return false;
+    }
+    wall -= offset;
+    if (wall < POSIX_TIME_AT_EPICS_EPOCH || wall-POSIX_TIME_AT_EPICS_EPOCH > 0xffffffffLL) {
+        return false;
+    }
+    t->secPastEpoch = wall - POSIX_TIME_AT_EPICS_EPOCH;
+    t->nsec = 0;
+    return true;
+}
+
+void usage(const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " [-h] [-m] [-i] [-s START] [-e END] [-j JOBS] [-r REGEX] [-l PVLIST] [-o OUTDIR] index-file" << std::endl
+              << std::endl
+              << "Without -j, names of the PVs to export are read from stdin, one per line," << std::endl
+              << "and \"Done\" is written to stdout after each PV." << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << " -h           : Print this message." << std::endl
+              << " -m           : Read the data files through mmap() instead of the storage" << std::endl
+              << "                library of Channel Archiver, datablock by datablock of the" << std::endl
+              << "                index. The readers of -j then run in parallel." << std::endl
+              << " -s START     : Export the samples from START on, YYYY-MM-DDThh:mm:ss in UTC" << std::endl
+              << "                unless followed by an offset (+hh:mm). The reader starts at" << std::endl
+              << "                the datablock of the index which covers START." << std::endl
+              << " -e END       : Export the samples before END." << std::endl
+              << " -i           : Incremental. Export the samples after the last one in the" << std::endl
+              << "                newest partition of each PV in OUTDIR, without reading the" << std::endl
+              << "                datablocks before it." << std::endl
+              << " -j JOBS      : Export the PVs of the index with JOBS worker threads." << std::endl
+              << "                PVs of more datablocks in the index are started first." << std::endl
+              << "                Messages are prefixed with the PV name, and the predicted" << std::endl
+              << "                and actual cost of each PV are reported." << std::endl
+              << " -r REGEX     : With -j, only PVs that match REGEX from the start are exported." << std::endl
+              << " -l PVLIST    : With -j, only PVs listed in the file PVLIST are exported." << std::endl
+              << " -o OUTDIR    : Specify output directory (default = current directory)." << std::endl
+              << std::endl
+              << "Names of the output files are split at the characters of $NAMESEPS." << std::endl;
+    exit(2);
+}
+
 int main(int argc, char *argv[])
 {
     //comment this if you want to see the protobuf logs
     google::protobuf::LogSilencer *silencer = new google::protobuf::LogSilencer();
 
-    if(argc<2) {
-        std::cerr << "Usage: " << argv[0] << " index-file" << std::endl;
-        return 2;
+    const char *argv0 = argv[0];
+    int njobs = 0;
+    bool mapped = false;
+    window_t window = {{0, 0}, {~0u, ~0u}, false};
+    std::string pattern("^.*$");
+    std::string listfile;
+    std::string outdir;
+
+    int ch;
+    while ((ch=getopt(argc, argv, "he:ij:l:mo:r:s:")) != EOF) {
+        switch(ch) {
+        case 'e':
+        case 's':
+            if (!parseTime(optarg, ch=='s' ? &window.start : &window.end)) {
+                std::cerr << "invalid time: " << optarg << std::endl;
+                usage(argv0);
+            }
+            break;
+        case 'i':
+            window.incremental = true;
+            break;
+        case 'j':
+            njobs = atoi(optarg);
+            if (njobs<=0) {
+                std::cerr << "invalid number of jobs: " << optarg << std::endl;
+                usage(argv0);
+            }
+            break;
+        case 'l':
+            listfile = optarg;
+            break;
+        case 'm':
+            mapped = true;
+            break;
+        case 'o':
+            outdir = optarg;
+            if (outdir[outdir.size()-1] != '/') {
+                outdir.push_back('/');
+            }
+            break;
+        case 'r':
+            pattern = optarg;
+            break;
+        default:
+            usage(argv0);
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if(argc<1) {
+        usage(argv0);
     }
+
+    // stdout is left to "Done" of the PVs read from stdin
+    pvlog_redirect(std::cerr);
+
     try{
     {
         char *seps = getenv("NAMESEPS");
@@ -527,55 +982,62 @@ int main(int argc, char *argv[])
             pvseps = seps;
     }
     AutoIndex idx;
-    idx.open(argv[1]);
+    idx.open(argv[0]);
+
+    if (njobs>0) {
+        const std::vector<stdString> pvs(listPVs(idx, pattern, listfile));
+        pvlog()<<"Export "<<pvs.size()<<" PVs with "<<njobs<<" workers\n";
+
+        // Largest PVs first, so that none of them is left to the end
+        const double t0 = stagetime::now();
+        std::vector<cost_t> costs;
+        std::vector<double> predicted;
+        for (size_t i=0; i<pvs.size(); i++) {
+            costs.push_back(estimateCost(idx, pvs[i]));
+            predicted.push_back(costs[i].predicted);
+        }
+        pvlog()<<"Estimated costs in "<<stagetime::now()-t0<<" s\n";
+        worksched sched(predicted, njobs);
+
+        auto worker = [&](int id) {
+            size_t i;
+            while (sched.take(id, i)) {
+                pvlog_begin(pvs[i].c_str());
+                const double t1 = stagetime::now();
+                exportPV(idx, pvs[i], outdir, window, mapped);
+                pvlog()<<"Cost: predicted "<<costs[i].predicted<<" actual "<<stagetime::now()-t1
+                       <<" s (blocks "<<costs[i].blocks<<" span "<<costs[i].span<<" s)\n";
+                pvlog()<<"Done\n";
+                pvlog_end();
+            }
+        };
 
-    std::string stdpvname;
-    while(std::getline(std::cin, stdpvname).good()) {
-        try {
+        std::vector<std::thread> workers;
+        for (int i=0; i<njobs; i++) {
+            workers.push_back(std::thread(worker, i));
+        }
+        for (size_t i=0; i<workers.size(); i++) {
+            workers[i].join();
+        }
+    } else {
+        std::string stdpvname;
+        while(std::getline(std::cin, stdpvname).good()) {
             if(stdpvname=="<>exit")
                 break;
             stdString pvname(stdpvname.c_str());
 
-            std::cerr<<"Got "<<stdpvname<<"\n";
-
-            std::cerr<<"Visit PV "<<pvname.c_str()<<"\n";
-            stdString dirname;
-            AutoPtr<RTree> tree(idx.getTree(pvname, dirname));
-
-            epicsTime start,end;
-            if(!tree || !tree->getInterval(start, end)) {
-                std::cerr<<"WARN: No Data or no times\n";
-                std::cout<<"Done\n"; // exportall.py uses this
-                continue;
-            }
-
-            std::cerr<<" start "<<start<<" end   "<<end<<"\n";
-
-            AutoPtr<DataReader> reader(ReaderFactory::create(idx, ReaderFactory::Raw, 0.0));
-
-            std::cerr<<" Type "<<reader->getType()<<" count "<<reader->getCount()<<"\n";
-
-            if(!reader->find(pvname, &start)) {
-                std::cerr<<"WARN: No data after all\n";
-                std::cout<<"Done\n"; // exportall.py uses this
-                continue;
-            }
-
-            PBWriter writer(*reader,pvname);
-            writer.write();
-        } catch (std::exception& e) {
-            //print exception and continue with the next pv
-            std::cerr<<"Exception: "<<stdpvname.c_str()<<": "<<e.what()<<"\n";
+            pvlog()<<"Got "<<stdpvname<<"\n";
+            exportPV(idx, pvname, outdir, window, mapped);
+            pvlog()<<"Done\n";
+            std::cout<<"Done"<<std::endl; // exportall.py uses this
         }
-        std::cerr<<"Done\n";
-        std::cout<<"Done\n"; // exportall.py uses this
     }
 
-    std::cerr<<"Done\n";
+    pvlog()<<"Done\n";
     delete silencer;
     return 0;
 }catch(std::exception& e){
-    std::cerr<<"Exception: "<<e.what()<<"\n";
+    pvlog()<<"Exception: "<<e.what()<<"\n";
     return 1;
 }
 }
@@ -0,0 +1,449 @@
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "pbfile.h"
+#include "pburing.h"
+#include "pbeutil.h"
+
+size_t pbfile::preallocate = 0;
+int pbfile::uringall = 0;
+
+pbfile::pbfile(int mode, size_t blocksize)
+    :fd(-1)
+    ,offset(0)
+    ,allocated(0)
+    ,block()
+    ,failed(0)
+    ,nclosed(0)
+    ,nclose(0)
+    ,fmode(uringall ? PBFILE_URING : mode)
+    ,blocksize(blocksize)
+    ,ring(fmode==PBFILE_THREAD ? kMaxGather : 0)
+    ,thread()
+    ,writer()
+    ,waited(0)
+    ,uring(0)
+    ,inflight()
+    ,nextslot(0)
+    ,truncateat(-1)
+{
+    block.op = OP_WRITE;
+    block.mkdirs = 0;
+    block.data.reserve(blocksize);
+    if (fmode==PBFILE_URING) {
+#ifdef PB_IO_URING
+        uring = pburing::worker();
+        if (uring && !uring->supports(IORING_OP_OPENAT))
+            uring = 0;
+#endif
+        if (uring)
+            inflight.resize(kMaxGather);
+        else
+            fmode = PBFILE_BLOCKING;
+    }
+    if (fmode==PBFILE_THREAD)
+        thread = std::thread(&pbfile::run, this);
+}
+
+pbfile::~pbfile()
+{
+    if (fmode==PBFILE_THREAD) {
+        submit(OP_QUIT);
+        thread.join();
+        return;
+    }
+    if (fmode==PBFILE_URING)
+        uringDrain();
+    if (fd>=0)
+        ::close(fd);
+}
+
+void pbfile::open(const std::string& fname, int mkdirs)
+{
+    failed.store(0, std::memory_order_release);
+    block.fname = fname;
+    block.mkdirs = mkdirs;
+    submit(OP_OPEN);
+}
+
+void pbfile::close()
+{
+    submit(OP_CLOSE);
+    nclose++;
+    if (fmode==PBFILE_THREAD) {
+        // the writer thread is idle after the close, nothing to spin for
+        const double t0 = stagetime::now();
+        std::unique_lock<std::mutex> lock(closedlock);
+        closedcv.wait(lock, [this] { return nclosed==nclose; });
+        waited += stagetime::now()-t0;
+    }
+}
+
+void pbfile::flush()
+{
+    if (!block.data.empty())
+        submit(OP_WRITE);
+}
+
+// Pass the current block to the writer, after the pending data
+void pbfile::submit(int op)
+{
+    if (op!=OP_WRITE)
+        flush();
+
+    block.op = op;
+    if (fmode==PBFILE_THREAD) {
+        waited += ring.push(block);
+    } else if (fmode==PBFILE_URING) {
+        switch (op) {
+        case OP_OPEN:
+            uringOpen(block);
+            break;
+        case OP_WRITE:
+            uringWrite(block);
+            break;
+        case OP_CLOSE:
+            uringDrain();
+            execute(block);
+            break;
+        }
+    } else {
+        execute(block);
+    }
+    block.op = OP_WRITE;
+    block.data.clear();
+    // the buffer swapped out of the ring may be a new one
+    block.data.reserve(blocksize);
+}
+
+void pbfile::execute(block_t& blk)
+{
+    switch (blk.op) {
+    case OP_OPEN:
+        // not O_APPEND, the blocks are written at the tracked offset
+        if (blk.mkdirs)
+            fd = openCreateDirs(blk.fname, O_RDWR|O_CREAT, 0644);
+        else
+            fd = ::open(blk.fname.c_str(), O_RDWR|O_CREAT, 0644);
+        opened();
+        break;
+    case OP_WRITE:
+        writeBlocks(&blk, 1);
+        break;
+    case OP_CLOSE:
+        if (fd>=0) {
+            // give back the preallocated space past the end
+            if (allocated>offset && ftruncate(fd, offset)!=0)
+                failed.store(1, std::memory_order_release);
+            if (::close(fd)!=0)
+                failed.store(1, std::memory_order_release);
+        }
+        fd = -1;
+        break;
+    }
+}
+
+// Start at the end of the file just opened
+void pbfile::opened()
+{
+    offset = fd<0 ? -1 : lseek(fd, 0, SEEK_END);
+    allocated = offset;
+    if (offset<0)
+        failed.store(1, std::memory_order_release);
+    else
+        truncateTail();
+}
+
+// Preallocate the space for len more bytes
+void pbfile::reserve(size_t len)
+{
+    if (preallocate>0 && allocated>=0 && offset+(off_t)len>allocated) {
+        const off_t step = ((offset+len-allocated)/preallocate+1)*preallocate;
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, step)==0)
+            allocated += step;
+        else
+            allocated = -1; // not supported by the file system, don't try again
+    }
+}
+
+// Write the blocks at the end of the file with one syscall
+void pbfile::writeBlocks(block_t* blks, int n)
+{
+    if (n==0 || fd<0 || !good())
+        return;
+
+    struct iovec iov[kMaxGather];
+    size_t left = 0;
+    for (int i=0; i<n; i++) {
+        iov[i].iov_base = blks[i].data.empty() ? 0 : &blks[i].data[0];
+        iov[i].iov_len = blks[i].data.size();
+        left += iov[i].iov_len;
+    }
+
+    reserve(left);
+
+    const off_t start = offset;
+    struct iovec* v = iov;
+    while (left>0) {
+        ssize_t w = pwritev(fd, v, n, offset);
+        if (w<0 && errno==EINTR)
+            continue;
+        if (w<=0) {
+            // do not leave part of a line behind
+            failed.store(1, std::memory_order_release);
+            if (ftruncate(fd, start)==0)
+                offset = start;
+            return;
+        }
+        offset += w;
+        left -= w;
+        for (; n>0 && (size_t)w>=v->iov_len; v++, n--)
+            w -= v->iov_len;
+        if (n>0) {
+            v->iov_base = (char*)v->iov_base + w;
+            v->iov_len -= w;
+        }
+    }
+}
+
+// Drop a partially written line at the end of the file, as left by a crash
+void pbfile::truncateTail()
+{
+    char buf[4096];
+    off_t end = offset;
+    while (end>0) {
+        const off_t start = end>(off_t)sizeof(buf) ? end-(off_t)sizeof(buf) : 0;
+        if (pread(fd, buf, end-start, start)!=end-start) {
+            failed.store(1, std::memory_order_release);
+            return;
+        }
+        off_t i = end-start;
+        while (i>0 && buf[i-1]!='\n')
+            i--;
+        if (i>0) {
+            end = start+i;
+            break;
+        }
+        end = start;
+    }
+
+    if (end!=offset) {
+        if (ftruncate(fd, end)!=0) {
+            failed.store(1, std::memory_order_release);
+            return;
+        }
+        offset = allocated = end;
+    }
+}
+
+// Writer thread
+void pbfile::run()
+{
+    block_t blks[kMaxGather];
+    for (;;) {
+        writer.wait += ring.pop(blks[0]);
+        const double t0 = stagetime::now();
+
+        // gather the blocks queued behind a write while the disk was busy
+        int n = 1;
+        while (blks[0].op==OP_WRITE && n<kMaxGather && ring.trypop(blks[n])) {
+            if (blks[n++].op!=OP_WRITE)
+                break;
+        }
+        block_t& last = blks[n-1];
+        writeBlocks(blks, last.op==OP_WRITE ? n : n-1);
+
+        if (last.op==OP_QUIT)
+            break;
+        if (last.op!=OP_WRITE) {
+            execute(last);
+            if (last.op==OP_CLOSE) {
+                std::lock_guard<std::mutex> lock(closedlock);
+                nclosed++;
+                closedcv.notify_one();
+            }
+        }
+        writer.busy += stagetime::now()-t0;
+    }
+    if (fd>=0)
+        ::close(fd);
+}
+
+#ifdef PB_IO_URING
+
+// IORING_OP_MKDIRAT of 5.15, an enum value missing from older headers.
+// Whether the running kernel has it is told by pburing::supports().
+static const int kOpMkdirat = 37;
+
+// Open the file, and when its directory is missing, create the parent
+// directories and open it again with a single submission. The entries are
+// hard linked, so that they run in order whatever the result of each
+// mkdirat, which fails with EEXIST for the directories already there.
+void pbfile::uringOpen(block_t& blk)
+{
+    pending_t io = {0, 0};
+    uringOpenAt(blk.fname, io);
+    uringWait(io);
+    if (io.res!=-ENOENT || !blk.mkdirs) {
+        fd = io.res<0 ? -1 : io.res;
+        opened();
+        return;
+    }
+
+    // The chain has to be submitted at once, sqe() would split it when
+    // the queue fills up and the open could run before the last mkdirat
+    std::vector<std::string> dirs;
+    if (uring->supports(kOpMkdirat)) {
+        for (size_t p=blk.fname.find('/', 1); p!=std::string::npos; p=blk.fname.find('/', p+1))
+            dirs.push_back(blk.fname.substr(0, p));
+        if (uring->space() < dirs.size()+1)
+            uring->submit();
+        if (uring->space() < dirs.size()+1)
+            dirs.clear();
+    }
+    if (dirs.empty()) {
+        createDirs(blk.fname);
+    }
+
+    std::vector<pending_t> made(dirs.size());
+    for (size_t i=0; i<dirs.size(); i++) {
+        struct io_uring_sqe* e = uring->sqe();
+        e->opcode = kOpMkdirat;
+        e->fd = AT_FDCWD;
+        e->addr = (uintptr_t)dirs[i].c_str();
+        e->len = 0755;
+        e->flags = IOSQE_IO_HARDLINK;
+        e->user_data = (uintptr_t)&made[i];
+        made[i].done = 0;
+    }
+    io.done = 0;
+    uringOpenAt(blk.fname, io);
+
+    uringWait(io);
+    for (size_t i=0; i<dirs.size(); i++) {
+        uringWait(made[i]);
+        if (made[i].res<0 && made[i].res!=-EEXIST)
+            pvlog_printf("mkdir(%s) : %s\n", dirs[i].c_str(), strerror(-made[i].res));
+    }
+
+    fd = io.res<0 ? -1 : io.res;
+    opened();
+}
+
+void pbfile::uringOpenAt(const std::string& fname, pending_t& io)
+{
+    struct io_uring_sqe* e = uring->sqe();
+    e->opcode = IORING_OP_OPENAT;
+    e->fd = AT_FDCWD;
+    e->addr = (uintptr_t)fname.c_str();
+    e->len = 0644;
+    // not O_APPEND, the blocks are written at the tracked offset
+    e->open_flags = O_RDWR|O_CREAT;
+    e->user_data = (uintptr_t)&io;
+}
+
+// Submit the block without waiting for it, unless all slots are in flight
+void pbfile::uringWrite(block_t& blk)
+{
+    if (fd<0 || !good() || blk.data.empty())
+        return;
+    reserve(blk.data.size());
+
+    inflight_t& slot = inflight[nextslot];
+    nextslot = (nextslot+1)%inflight.size();
+    if (slot.busy) {
+        const double t0 = stagetime::now();
+        uringWait(slot.io);
+        waited += stagetime::now()-t0;
+        uringFinish(slot);
+    }
+
+    // the buffer of the slot comes back to the caller for the next block
+    std::swap(slot.data, blk.data);
+    slot.offset = offset;
+    slot.busy = 1;
+    slot.io.done = 0;
+    offset += slot.data.size();
+
+    struct io_uring_sqe* e = uring->sqe();
+    e->opcode = IORING_OP_WRITE;
+    e->fd = fd;
+    e->addr = (uintptr_t)&slot.data[0];
+    e->len = slot.data.size();
+    e->off = slot.offset;
+    e->user_data = (uintptr_t)&slot.io;
+    uring->submit();
+}
+
+// Check a completed write, and finish it if it was short
+void pbfile::uringFinish(inflight_t& slot)
+{
+    slot.busy = 0;
+    size_t done = slot.io.res<0 ? 0 : slot.io.res;
+    while (slot.io.res>=0 && done<slot.data.size()) {
+        ssize_t n = pwrite(fd, &slot.data[done], slot.data.size()-done, slot.offset+done);
+        if (n<0 && errno==EINTR)
+            continue;
+        if (n<=0)
+            break;
+        done += n;
+    }
+    if (done<slot.data.size()) {
+        failed.store(1, std::memory_order_release);
+        if (truncateat<0 || slot.offset<truncateat)
+            truncateat = slot.offset;
+    }
+}
+
+// Wait for an operation, taking the completions of all files of the ring
+void pbfile::uringWait(pending_t& io)
+{
+    uint64_t data;
+    int res;
+    while (!io.done) {
+        if (uring->submit(1)<0) {
+            io.done = 1;
+            io.res = -EIO;
+            break;
+        }
+        while (uring->complete(data, res)) {
+            pending_t* p = (pending_t*)(uintptr_t)data;
+            p->res = res;
+            p->done = 1;
+        }
+    }
+}
+
+// Wait for all writes in flight
+void pbfile::uringDrain()
+{
+    for (size_t i=0; i<inflight.size(); i++) {
+        if (inflight[i].busy) {
+            uringWait(inflight[i].io);
+            uringFinish(inflight[i]);
+        }
+    }
+    // do not leave part of a line behind
+    if (truncateat>=0) {
+        if (fd>=0 && ftruncate(fd, truncateat)==0)
+            offset = truncateat;
+        truncateat = -1;
+    }
+}
+
+#else // PB_IO_URING
+
+// never in PBFILE_URING mode
+void pbfile::uringOpen(block_t&) {}
+void pbfile::uringOpenAt(const std::string&, pending_t&) {}
+void pbfile::uringWrite(block_t&) {}
+void pbfile::uringFinish(inflight_t&) {}
+void pbfile::uringWait(pending_t&) {}
+void pbfile::uringDrain() {}
+
+#endif // PB_IO_URING
@@ -0,0 +1,133 @@
+#ifndef PBFILE_H
+#define PBFILE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include <sys/types.h>
+
+#include "pbpipe.h"
+
+class pburing;
+
+enum pbfile_mode_t {
+    PBFILE_BLOCKING, // write() in the calling thread
+    PBFILE_THREAD,   // blocks handed to a writer thread
+    PBFILE_URING,    // blocks submitted to the io_uring of the calling thread
+};
+
+// Output .pb file, opened for append.
+// Written data is collected in large blocks of whole lines, written with
+// one syscall each. With PBFILE_THREAD, the blocks are handed to a writer
+// thread, so that the caller does not wait for the disk, and the blocks
+// queued while the disk is busy are written together with pwritev().
+// With PBFILE_URING, the blocks, the open and the creation of the
+// directories are submitted to the io_uring of the calling thread, which
+// the pbfile is then bound to. It falls back to PBFILE_BLOCKING when
+// io_uring is not available.
+//
+// A partially written line at the end of an existing file, as left by a
+// crash, is truncated away by open(). A failed write truncates the file
+// back to the end of the last block written in full.
+class pbfile
+{
+public:
+    explicit pbfile(int mode = PBFILE_BLOCKING, size_t blocksize = kBlockSize);
+    ~pbfile();
+
+    // Create the missing parent directories first if mkdirs is set
+    void open(const std::string& fname, int mkdirs = 0);
+    // buf holds whole lines
+    void write(const char* buf, size_t len)
+    {
+        if (block.data.size()+len > blocksize && !block.data.empty())
+            flush();
+        block.data.insert(block.data.end(), buf, buf+len);
+    }
+    // Returns after all data is written and the file is closed
+    void close();
+    bool good() const { return !failed.load(std::memory_order_acquire); }
+    int mode() const { return fmode; }
+
+    // Time of the writer thread, and the time the caller waited for it
+    const stagetime& writerTime() const { return writer; }
+    double waitTime() const { return waited; }
+
+    // Reserve disk space in steps of bytes ahead of the writes, 0 to disable.
+    // The file size is not changed, so that a crash leaves no hole.
+    static void setPreallocate(size_t bytes) { preallocate = bytes; }
+    // Use PBFILE_URING instead of the mode given to the constructor
+    static void setURing(int enable) { uringall = enable; }
+
+    static const size_t kBlockSize = 4*1024*1024;
+
+private:
+    enum { OP_OPEN, OP_WRITE, OP_CLOSE, OP_QUIT };
+    struct block_t {
+        int op;
+        int mkdirs;
+        std::string fname;
+        std::vector<char> data;
+    };
+    // blocks written by one pwritev(), or in flight in the io_uring
+    enum { kMaxGather = 4 };
+
+    // an operation submitted to the io_uring
+    struct pending_t {
+        int done;
+        int res;
+    };
+    struct inflight_t {
+        std::vector<char> data;
+        off_t offset;
+        int busy;
+        pending_t io;
+    };
+
+    void flush();
+    void submit(int op);
+    void execute(block_t& blk);
+    void opened();
+    void reserve(size_t len);
+    void writeBlocks(block_t* blks, int n);
+    void truncateTail();
+    void run();
+
+    void uringOpen(block_t& blk);
+    void uringOpenAt(const std::string& fname, pending_t& io);
+    void uringWrite(block_t& blk);
+    void uringFinish(inflight_t& slot);
+    void uringWait(pending_t& io);
+    void uringDrain();
+
+    int fd;
+    off_t offset;    // end of the data written
+    off_t allocated; // end of the preallocated space
+    block_t block;
+    std::atomic<int> failed;
+    unsigned nclosed;              // OP_CLOSE done by the writer thread
+    unsigned nclose;               // OP_CLOSE submitted
+    std::mutex closedlock;         // of nclosed
+    std::condition_variable closedcv;
+
+    int fmode;
+    const size_t blocksize;
+    spscring<block_t> ring;
+    std::thread thread;
+    stagetime writer;
+    double waited;
+
+    pburing* uring;
+    std::vector<inflight_t> inflight;
+    size_t nextslot;
+    off_t truncateat; // start of the first failed write in flight
+
+    static size_t preallocate;
+    static int uringall;
+};
+
+#endif // PBFILE_H
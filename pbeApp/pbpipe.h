@@ -0,0 +1,106 @@
+#ifndef PBPIPE_H
+#define PBPIPE_H
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <utility>
+
+#include <time.h>
+
+// Time spent by a stage of the pipeline, either working or waiting for
+// the neighbouring stages.
+struct stagetime
+{
+    double busy, wait;
+
+    stagetime() :busy(0), wait(0) {}
+
+    double utilization() const
+    {
+        return busy+wait>0 ? busy/(busy+wait) : 0;
+    }
+
+    static double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec*1e-9;
+    }
+};
+
+// Bounded ring between a single producer thread and a single consumer thread.
+// Items are swapped in and out, so that the buffers they own are recycled
+// instead of reallocated. push() blocks while the ring is full, and pop()
+// while it is empty. Both return the time spent blocking.
+template<typename T>
+class spscring
+{
+public:
+    explicit spscring(size_t capacity)
+        :slots(capacity+1)
+        ,head(0)
+        ,tail(0)
+    {}
+
+    double push(T& item)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        const size_t n = (t+1)%slots.size();
+        double waited = 0;
+        if (n==head.load(std::memory_order_acquire)) {
+            const double t0 = stagetime::now();
+            for (unsigned i=0; n==head.load(std::memory_order_acquire); i++)
+                backoff(i);
+            waited = stagetime::now()-t0;
+        }
+        std::swap(slots[t], item);
+        tail.store(n, std::memory_order_release);
+        return waited;
+    }
+
+    double pop(T& item)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        double waited = 0;
+        if (h==tail.load(std::memory_order_acquire)) {
+            const double t0 = stagetime::now();
+            for (unsigned i=0; h==tail.load(std::memory_order_acquire); i++)
+                backoff(i);
+            waited = stagetime::now()-t0;
+        }
+        std::swap(slots[h], item);
+        head.store((h+1)%slots.size(), std::memory_order_release);
+        return waited;
+    }
+
+    // Returns false instead of blocking when the ring is empty
+    bool trypop(T& item)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h==tail.load(std::memory_order_acquire))
+            return false;
+        std::swap(slots[h], item);
+        head.store((h+1)%slots.size(), std::memory_order_release);
+        return true;
+    }
+
+private:
+    // Spin shortly, then sleep so that a stalled stage does not burn a core
+    static void backoff(unsigned i)
+    {
+        if (i<64) {
+            std::this_thread::yield();
+        } else {
+            struct timespec ts = {0, 50000};
+            nanosleep(&ts, 0);
+        }
+    }
+
+    std::vector<T> slots;
+    std::atomic<size_t> head; // written by the consumer
+    char pad[64];             // keep head and tail in separate cache lines
+    std::atomic<size_t> tail; // written by the producer
+};
+
+#endif // PBPIPE_H
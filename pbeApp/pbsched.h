@@ -0,0 +1,92 @@
+#ifndef PBSCHED_H
+#define PBSCHED_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+
+// Jobs of estimated cost, dealt to a queue per worker, largest first, each
+// to the queue with the least cost so far. A worker takes the largest job
+// of its own queue. When it runs out, it steals the smallest job of the
+// queue with the most cost left, so that a huge job is not left waiting
+// behind the small ones of a busy worker.
+class worksched
+{
+public:
+    worksched(const std::vector<double>& cost, int nworkers)
+        :cost(cost)
+    {
+        for (int w=0; w<nworkers; w++)
+            queues.push_back(std::unique_ptr<queue_t>(new queue_t));
+
+        std::vector<size_t> order(cost.size());
+        for (size_t i=0; i<order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), bylargest(cost));
+
+        for (size_t i=0; i<order.size(); i++) {
+            queue_t* least = queues[0].get();
+            for (size_t w=1; w<queues.size(); w++)
+                if (queues[w]->left < least->left)
+                    least = queues[w].get();
+            least->jobs.push_back(order[i]);
+            least->left += cost[order[i]];
+        }
+    }
+
+    // The next job of the worker, false when no job is left
+    bool take(int worker, size_t& job)
+    {
+        {
+            queue_t& own = *queues[worker];
+            std::lock_guard<std::mutex> lock(own.lock);
+            if (!own.jobs.empty()) {
+                job = own.jobs.front();
+                own.jobs.pop_front();
+                own.left -= cost[job];
+                return true;
+            }
+        }
+        for (;;) {
+            queue_t* victim = 0;
+            double most = 0;
+            for (size_t w=0; w<queues.size(); w++) {
+                std::lock_guard<std::mutex> lock(queues[w]->lock);
+                if (!queues[w]->jobs.empty() && (!victim || queues[w]->left > most)) {
+                    victim = queues[w].get();
+                    most = victim->left;
+                }
+            }
+            if (!victim)
+                return false;
+
+            std::lock_guard<std::mutex> lock(victim->lock);
+            if (victim->jobs.empty())
+                continue; // taken meanwhile, look again
+            job = victim->jobs.back();
+            victim->jobs.pop_back();
+            victim->left -= cost[job];
+            return true;
+        }
+    }
+
+private:
+    struct queue_t {
+        std::mutex lock;
+        std::deque<size_t> jobs; // largest first
+        double left;             // cost of the jobs
+        queue_t() :left(0) {}
+    };
+    struct bylargest {
+        const std::vector<double>& cost;
+        explicit bylargest(const std::vector<double>& cost) :cost(cost) {}
+        bool operator()(size_t a, size_t b) const { return cost[a] > cost[b]; }
+    };
+
+    const std::vector<double> cost;
+    std::vector<std::unique_ptr<queue_t> > queues;
+};
+
+#endif // PBSCHED_H
@@ -1,3 +1,6 @@
+#ifndef PBSEARCH_H
+#define PBSEARCH_H
+
 #include <time.h>
 #include <string.h>
 #include <errno.h>
@@ -8,6 +11,7 @@
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
+#include <vector>
 
 #include <db_access.h>
 #include "EPICSEvent.pb.h"
@@ -38,6 +42,34 @@ ENTRY(1, DBR_TIME_FLOAT, dbr_time_float, VectorFloat, WAVEFORM_FLOAT);
 ENTRY(1, DBR_TIME_DOUBLE, dbr_time_double, VectorDouble, WAVEFORM_DOUBLE);
 #undef ENTRY
 
+// Reads the header and the last line of a .pb file, the line unescaped
+// into last, left empty if it can not be unescaped. Returns false when the
+// file has no sample, throws when the header can not be decoded. Only the
+// header and the last line are read, so that appending to a large file
+// takes constant time.
+inline bool readHeaderLast(const char* file, EPICS::PayloadInfo& info, std::vector<char>& last)
+{
+    std::string head, tail;
+    std::vector<char> buf;
+    if (readHeadTail(file, head, tail)) {
+        buf.resize(unescape_plan(head.c_str(), head.length()));
+    }
+    if (buf.empty()
+            || unescape(head.c_str(), head.length(), &buf[0], buf.size())!=0
+            || !info.ParseFromArray(&buf[0], buf.size())) {
+        std::ostringstream msg;
+        msg<<"Cannot decode the file header in "<<file;
+        throw std::runtime_error(msg.str());
+    }
+    last.clear();
+    if (tail.empty())
+        return false;
+    last.resize(unescape_plan(tail.c_str(), tail.length()));
+    if (!last.empty() && unescape(tail.c_str(), tail.length(), &last[0], last.size())!=0)
+        last.clear();
+    return true;
+}
+
 template<int dbr, int array> struct searcher
 {
     static typename dbrstruct<dbr, array>::pbtype getLastSample(const char* file)
@@ -45,24 +77,13 @@ template<int dbr, int array> struct searcher
         typedef typename dbrstruct<dbr, array>::pbtype decoder;
         dbrstruct<dbr, array> type;
 
-        //find the last sample that was written into the given file and skip forward the reader to the first
-        //sample that has a timestamp later than the last sample in the file
-        std::ifstream inpstr(file);
-        std::string temp;
+        //find the last sample that was written into the given file, so that the reader can skip
+        //forward to the first sample later than that.
+        std::vector<char> last;
         decoder sample;
 
-        //payload info; don't care what it is, just make sure it was read
-        if (!std::getline(inpstr, temp).good()) {
-            std::ostringstream msg;
-            msg<<"Cannot decode the file header in "<<file;
-            throw std::runtime_error(msg.str());
-        }
-
         EPICS::PayloadInfo info;
-        int l = unescape_plan(temp.c_str(), temp.length());
-        std::vector<char> buf(l);
-        unescape(temp.c_str(), temp.length(), &buf[0], buf.size());
-        info.ParseFromArray(&buf[0], l);
+        const bool hassample = readHeaderLast(file, info, last);
 
         if ((int) (info.type()) != type.pbcode) {
             std::ostringstream msg;
@@ -73,57 +94,74 @@ template<int dbr, int array> struct searcher
             //self.typeChangeError += 1;
             throw std::invalid_argument("Incompatible data type");
         }
-        
-//reading just the last few lines in the file can be much faster in case of a large file        
-/*
-        //try to read just the last few lines to handle really long files faster
-        int start, bfr_size;
-        start = inpstr.tellg();
-        inpstr.seekg(0, std::ios_base::end);
-        bfr_size = 1024;
-        //if the size of the file is larger than our buffer
-        if (inpstr.tellg() > bfr_size) {
-            int linecount = 0;
-            while (linecount < 3) {
-                //find at least 3 lines
-                inpstr.seekg(-bfr_size, std::ios_base::cur);
-                std::vector<char> buf(bfr_size);
-                inpstr.read(&buf[0], bfr_size);
-                linecount += std::count(buf.begin(), buf.end(), '\n');
-                inpstr.seekg(-bfr_size, std::ios_base::cur);
-                if (inpstr.tellg() < start) {
-                    //we reached the payload info before finding 3 lines
-                    inpstr.seekg(start, std::ios_base::beg);
-                    break;
-                }
-            }
-            //in case we found enough lines, we might not be located at the correct position
-            //to start parsing the data into a sample, so just read the current line.
-            if (linecount > 3) {
-                if (!std::getline(inpstr, temp).good()) {
-                    inpstr.seekg(start, std::ios_base::beg);
-                }
-            }
-        } else {
-            //the file size is smaller than buffer. Scan the entire file.
-            inpstr.seekg(start, std::ios_base::beg);
-        }
-*/        
 
-        int logged = 0;
-        while (std::getline(inpstr, temp).good()) {
-            int l = unescape_plan(temp.c_str(), temp.length());
-            std::vector<char> buf(l);
-            unescape(temp.c_str(), temp.length(), &buf[0], buf.size());
-            bool ok = sample.ParseFromArray(&buf[0], l);
-            if (!ok && logged == 0) {
-                std::cerr << "WARN: " << file
-                        << ": Can't parse the data. Probably value is missing.\n";
-                logged++;
-            }
+        if (hassample && (last.empty() || !sample.ParseFromArray(&last[0], last.size()))) {
+            std::cerr << "WARN: " << file
+                    << ": Can't parse the data. Probably value is missing.\n";
         }
-        inpstr.close();
         return sample;
     }
+
+    // Seconds into the year and nano of the sample of last, an unescaped
+    // line of a file of this type, false if it can not be decoded
+    static bool getSampleTime(const std::vector<char>& last, epicsUInt32* secondsintoyear, epicsUInt32* nano)
+    {
+        typename dbrstruct<dbr, array>::pbtype sample;
+        if (last.empty() || !sample.ParseFromArray(&last[0], last.size())
+                || !sample.has_secondsintoyear())
+            return false;
+        *secondsintoyear = sample.secondsintoyear();
+        *nano = sample.nano();
+        return true;
+    }
 };
 
+// Time of the last sample of a .pb file of any type, and the type of the
+// file, as the PayloadType, if pbtype is given. Returns false when the file
+// has no sample which can be decoded, throws when the header can not be
+// decoded.
+inline bool getLastSampleTime(const char* file, epicsTimeStamp* stamp, int* pbtype = 0)
+{
+    EPICS::PayloadInfo info;
+    std::vector<char> last;
+    const bool hassample = readHeaderLast(file, info, last);
+    if (pbtype)
+        *pbtype = info.type();
+    if (!hassample)
+        return false;
+
+    epicsUInt32 secondsintoyear, nano;
+    bool found;
+    switch (info.type()) {
+#define CASE(DBR, ARR) case dbrstruct<DBR, ARR>::pbcode: \
+    found = searcher<DBR, ARR>::getSampleTime(last, &secondsintoyear, &nano); break
+    CASE(DBR_TIME_STRING, 0);
+    CASE(DBR_TIME_CHAR, 0);
+    CASE(DBR_TIME_SHORT, 0);
+    CASE(DBR_TIME_ENUM, 0);
+    CASE(DBR_TIME_LONG, 0);
+    CASE(DBR_TIME_FLOAT, 0);
+    CASE(DBR_TIME_DOUBLE, 0);
+    CASE(DBR_TIME_STRING, 1);
+    CASE(DBR_TIME_CHAR, 1);
+    CASE(DBR_TIME_SHORT, 1);
+    CASE(DBR_TIME_ENUM, 1);
+    CASE(DBR_TIME_LONG, 1);
+    CASE(DBR_TIME_FLOAT, 1);
+    CASE(DBR_TIME_DOUBLE, 1);
+#undef CASE
+    default: {
+        std::ostringstream msg;
+        msg<<"Unsupported type "<<info.type()<<" in "<<file;
+        throw std::runtime_error(msg.str());
+    }
+    }
+    if (!found)
+        return false;
+    getStartOfYear(info.year(), stamp);
+    stamp->secPastEpoch += secondsintoyear;
+    stamp->nsec = nano;
+    return true;
+}
+
+#endif // PBSEARCH_H
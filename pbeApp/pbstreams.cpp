@@ -1,5 +1,6 @@
 
 #include "pbstreams.h"
+#include "pbescape.h"
 
 escapingarraystream::escapingarraystream()
     :inbuf()
@@ -30,47 +31,88 @@ escapingarraystream::ByteCount() const
     return pos;
 }
 
-static size_t plan_size(const char* b, size_t l)
-{
-    size_t outlen=l;
-    for(;l;--l, ++b)
-        switch(*b)
-        {
-        case '\n':
-        case '\r':
-        case '\x1b':
-            outlen++;
-        }
-    return outlen;
-}
-
 void escapingarraystream::finalize()
 {
     inbuf.resize(pos);
-    outbuf.clear();
-    outbuf.resize(plan_size(&inbuf[0], inbuf.size()));
-    for(size_t i=0, o=0, s=inbuf.size(); i<s; ++i)
-    {
-        char c=inbuf[i];
-        switch(c)
-        {
-        case '\n':
-        case '\r':
-        case '\x1b':
-            outbuf[o++] = '\x1b';
-            break;
-        default:
-            outbuf[o++] = c;
-            continue;
-        }
-        switch(c)
-        {
-        case '\x1b': outbuf[o++] = 1; break;
-        case '\n': outbuf[o++] = 2; break;
-        case '\r': outbuf[o++] = 3; break;
-        }
-    }
+    outbuf.resize(2*inbuf.size());
+    outbuf.resize(inbuf.empty() ? 0 : escape(&inbuf[0], inbuf.size(), &outbuf[0]));
     outbuf.push_back('\n');
     inbuf.clear();
     pos=0;
 }
+
+escapingstream::escapingstream()
+    :outbuf()
+    ,out(0)
+    ,win(0)
+    ,winlen(0)
+    ,hint(0)
+    ,count(0)
+{}
+
+bool escapingstream::Next(void **data, int *size)
+{
+    flush();
+
+    size_t len = hint>0 ? hint : 256;
+    hint = 0;
+    // room for all bytes of the window escaped, and the newline
+    if (outbuf.size() < out+2*len+1)
+        outbuf.resize(out+2*len+1);
+
+    win = out+len;
+    winlen = len;
+    count += len;
+    *data = &outbuf[win];
+    *size = len;
+    return true;
+}
+
+void escapingstream::BackUp(int n)
+{
+    winlen -= n;
+    count -= n;
+}
+
+escapingstream::int64
+escapingstream::ByteCount() const
+{
+    return count;
+}
+
+// escape the window forward to the end of the output
+void escapingstream::flush()
+{
+    if (winlen==0)
+        return;
+    out += escape(&outbuf[win], winlen, &outbuf[out]);
+    win = winlen = 0;
+}
+
+// escape raw data after the output
+void escapingstream::append(const char* raw, size_t len)
+{
+    flush();
+    if (len==0)
+        return;
+    if (outbuf.size() < out+2*len+1)
+        outbuf.resize(out+2*len+1);
+    out += escape(raw, len, &outbuf[out]);
+}
+
+void escapingstream::put(const char* raw, size_t len, const std::string& fields)
+{
+    reset();
+    append(raw, len);
+    append(fields.data(), fields.size());
+    finalize();
+}
+
+void escapingstream::finalize()
+{
+    if (outbuf.size() < out+1)
+        outbuf.resize(out+1);
+    if (winlen>0)
+        flush();
+    outbuf[out++] = '\n';
+}
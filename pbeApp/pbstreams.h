@@ -1,8 +1,11 @@
 
 #include <ostream>
 #include <vector>
+#include <string>
 
 #include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/stubs/common.h>
 
 struct escapingarraystream : public google::protobuf::io::ZeroCopyOutputStream
 {
@@ -25,3 +28,65 @@ struct escapingarraystream : public google::protobuf::io::ZeroCopyOutputStream
         pos = 0;
     }
 };
+
+// Escapes while serializing, without a second buffer.
+// Each window returned by Next() lies after the escaped output by its own
+// size, so that it can be escaped forward in place, where even all bytes
+// escaped would not overrun the part not yet read.
+// With serialize(), the window is sized once from the message size.
+struct escapingstream : public google::protobuf::io::ZeroCopyOutputStream
+{
+    typedef google::protobuf::int64 int64;
+    std::vector<char> outbuf; // escaped line is [0, size())
+
+    escapingstream();
+
+    virtual bool Next(void **data, int *size);
+    virtual void BackUp(int count);
+    virtual int64 ByteCount() const;
+
+    // Serialize a message into a newline terminated line. The fields,
+    // already encoded, are appended to the message.
+    template<class M>
+    void serialize(const M& msg, const std::string& fields = std::string())
+    {
+#if GOOGLE_PROTOBUF_VERSION >= 3001000
+        size_t n = msg.ByteSizeLong();
+#else
+        size_t n = msg.ByteSize();
+#endif
+        reset();
+        hint = n;
+        {
+            google::protobuf::io::CodedOutputStream encstrm(this);
+            msg.SerializeWithCachedSizes(&encstrm);
+        }
+        append(fields.data(), fields.size());
+        finalize();
+    }
+
+    // Escape an encoded message, and the fields appended to it, into a
+    // newline terminated line
+    void put(const char* raw, size_t len, const std::string& fields = std::string());
+
+    // Terminate the line after the data written through Next()
+    void finalize();
+    void reset()
+    {
+        out = win = winlen = 0;
+        count = 0;
+    }
+
+    const char* data() const { return &outbuf[0]; }
+    size_t size() const { return out; }
+
+private:
+    void flush();
+    void append(const char* raw, size_t len);
+
+    size_t out;    // end of the escaped output
+    size_t win;    // window handed by Next()
+    size_t winlen;
+    size_t hint;   // size of the next window
+    int64 count;
+};
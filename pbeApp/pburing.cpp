@@ -0,0 +1,162 @@
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "pburing.h"
+
+#ifdef PB_IO_URING
+
+pburing::pburing(unsigned entries)
+    :fd(-1)
+    ,sqmap(MAP_FAILED)
+    ,cqmap(MAP_FAILED)
+    ,sqmaplen(0)
+    ,cqmaplen(0)
+    ,sqes((struct io_uring_sqe*)MAP_FAILED)
+    ,sqeslen(0)
+    ,sqentries(0)
+    ,sqlocal(0)
+{
+    memset(supported, 0, sizeof(supported));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int ringfd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ringfd<0)
+        return; // ENOSYS on old kernels, EPERM when disabled
+
+    sqmaplen = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    cqmaplen = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sqmaplen = cqmaplen = sqmaplen>cqmaplen ? sqmaplen : cqmaplen;
+    sqeslen = p.sq_entries*sizeof(struct io_uring_sqe);
+
+    sqmap = mmap(0, sqmaplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cqmap = sqmap;
+    else
+        cqmap = mmap(0, cqmaplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+    sqes = (struct io_uring_sqe*)mmap(0, sqeslen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (sqmap==MAP_FAILED || cqmap==MAP_FAILED || sqes==MAP_FAILED) {
+        ::close(ringfd);
+        return;
+    }
+    fd = ringfd;
+
+    char* sq = (char*)sqmap;
+    sqhead  = (unsigned*)(sq + p.sq_off.head);
+    sqtail  = (unsigned*)(sq + p.sq_off.tail);
+    sqmask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    sqarray = (unsigned*)(sq + p.sq_off.array);
+    sqentries = p.sq_entries;
+    sqlocal = *sqtail;
+
+    char* cq = (char*)cqmap;
+    cqhead = (unsigned*)(cq + p.cq_off.head);
+    cqtail = (unsigned*)(cq + p.cq_off.tail);
+    cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes   = cq + p.cq_off.cqes;
+
+    // operations added after io_uring itself, as IORING_OP_MKDIRAT in 5.15
+    const size_t len = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+    std::unique_ptr<char[]> buf(new char[len]);
+    memset(buf.get(), 0, len);
+    struct io_uring_probe* probe = (struct io_uring_probe*)buf.get();
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)==0) {
+        for (int i=0; i<probe->ops_len && i<256; i++)
+            supported[probe->ops[i].op] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) ? 1 : 0;
+    }
+}
+
+pburing::~pburing()
+{
+    if (sqes!=MAP_FAILED)
+        munmap(sqes, sqeslen);
+    if (cqmap!=MAP_FAILED && cqmap!=sqmap)
+        munmap(cqmap, cqmaplen);
+    if (sqmap!=MAP_FAILED)
+        munmap(sqmap, sqmaplen);
+    if (fd>=0)
+        ::close(fd);
+}
+
+bool pburing::supports(int op) const
+{
+    return ok() && op>=0 && op<256 && supported[op];
+}
+
+unsigned pburing::space() const
+{
+    return sqentries - (sqlocal - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE));
+}
+
+struct io_uring_sqe* pburing::sqe()
+{
+    if (sqlocal - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE) >= sqentries)
+        submit();
+
+    const unsigned idx = sqlocal & *sqmask;
+    struct io_uring_sqe* e = &sqes[idx];
+    memset(e, 0, sizeof(*e));
+    sqarray[idx] = idx;
+    sqlocal++;
+    return e;
+}
+
+int pburing::submit(unsigned nwait)
+{
+    __atomic_store_n(sqtail, sqlocal, __ATOMIC_RELEASE);
+    for (;;) {
+        const unsigned n = sqlocal - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, fd, n, nwait, nwait>0 ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+        if (ret>=0)
+            return ret;
+        if (errno!=EINTR)
+            return -errno;
+    }
+}
+
+bool pburing::complete(uint64_t& data, int& res)
+{
+    const unsigned head = *cqhead;
+    if (head==__atomic_load_n(cqtail, __ATOMIC_ACQUIRE))
+        return false;
+    const struct io_uring_cqe* e = (const struct io_uring_cqe*)cqes + (head & *cqmask);
+    data = e->user_data;
+    res = e->res;
+    __atomic_store_n(cqhead, head+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else // PB_IO_URING
+
+pburing::pburing(unsigned)
+    :fd(-1)
+{}
+
+pburing::~pburing() {}
+
+bool pburing::supports(int) const { return false; }
+unsigned pburing::space() const { return 0; }
+struct io_uring_sqe* pburing::sqe() { return 0; }
+int pburing::submit(unsigned) { return -ENOSYS; }
+bool pburing::complete(uint64_t&, int&) { return false; }
+
+#endif // PB_IO_URING
+
+pburing* pburing::worker()
+{
+    static thread_local std::unique_ptr<pburing> ring;
+    static thread_local int tried = 0;
+    if (!tried) {
+        tried = 1;
+        ring.reset(new pburing(64));
+        if (!ring->ok())
+            ring.reset();
+    }
+    return ring.get();
+}
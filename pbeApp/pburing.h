@@ -0,0 +1,62 @@
+#ifndef PBURING_H
+#define PBURING_H
+
+#include <stdint.h>
+
+// Minimal io_uring, set up with the raw system calls, as liburing is not
+// available everywhere. Built only with USE_IO_URING=YES in CONFIG_SITE,
+// otherwise ok() is always false and the callers fall back to blocking
+// system calls. A ring is used by a single thread.
+#ifdef PB_IO_URING
+#include <linux/io_uring.h>
+#else
+struct io_uring_sqe;
+#endif
+
+class pburing
+{
+public:
+    explicit pburing(unsigned entries);
+    ~pburing();
+
+    // False when the kernel does not provide io_uring
+    bool ok() const { return fd>=0; }
+    // Whether the kernel knows the IORING_OP_* operation
+    bool supports(int op) const;
+
+    // The next submission entry, cleared. The queued entries are submitted
+    // first if the queue is full.
+    struct io_uring_sqe* sqe();
+    // Entries which sqe() hands out before it submits the queued ones
+    unsigned space() const;
+    // Submit the queued entries, and wait for at least nwait completions.
+    // Returns the number submitted or -errno.
+    int submit(unsigned nwait = 0);
+    // Take a completion. Returns false if there is none.
+    bool complete(uint64_t& data, int& res);
+
+    // The ring of the calling thread, or NULL if io_uring is not available
+    static pburing* worker();
+
+private:
+    pburing(const pburing&);
+    pburing& operator=(const pburing&);
+
+    int fd;
+    void* sqmap;
+    void* cqmap;
+    size_t sqmaplen, cqmaplen;
+    struct io_uring_sqe* sqes;
+    size_t sqeslen;
+
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned sqentries;
+    unsigned sqlocal; // tail of the entries not yet submitted
+
+    unsigned *cqhead, *cqtail, *cqmask;
+    void* cqes;
+
+    unsigned char supported[256];
+};
+
+#endif // PBURING_H
@@ -14,6 +14,8 @@
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
+#include <thread>
+#include <mutex>
 
 #include <unistd.h>
 
@@ -28,6 +30,10 @@
 //
 #include "pbsearch.h"
 #include "pbstreams.h"
+#include "pbencode.h"
+#include "pbbatch.h"
+#include "pbpipe.h"
+#include "pbfile.h"
 #include "pbeutil.h"
 #include "EPICSEvent.pb.h"
 
@@ -54,6 +60,14 @@ static std::vector<NumStr_t> kDBRtypes = {
    NumStr(DBR_TIME_DOUBLE),
 };
 
+// supported fetch modes
+static std::vector<NumStr_t> kFetchModes = {
+   NumStr(FETCH_TEXT),
+   NumStr(FETCH_BINARY),
+   NumStr(FETCH_COPY),
+   NumStr(FETCH_CHUNK),
+};
+
 int str2num(const std::string &str, const std::vector<NumStr_t> &list)
 {
    // Numeric expression
@@ -73,10 +87,98 @@ int str2num(const std::string &str, const std::vector<NumStr_t> &list)
    return -1;
 }
 
+// samples taken from the reader at once
+static const size_t kSampleBatchSize = 1024;
+
+// Reader stage of the pipeline. Samples are read from RDB in a thread of
+// its own, and handed over in batches. The first sample is the one found by
+// PGSQLReader::find().
+struct SampleFetcher
+{
+   PGSQLReader& reader;
+   spscring<SampleBatch> ring;
+   std::thread thread;
+   int eof;
+   stagetime readTime;  // of the reader thread, valid after finish()
+   double waitTime;     // of the consumer
+
+   SampleFetcher(PGSQLReader& reader);
+   ~SampleFetcher();
+
+   // Swap the next batch in, false at the end of the query
+   bool pop(SampleBatch& batch)
+   {
+      if (eof) {
+         return false;
+      }
+      waitTime += ring.pop(batch);
+      if (batch.empty()) {
+         // end of the query
+         eof = 1;
+         return false;
+      }
+      return true;
+   }
+   void finish();
+   void run();
+};
+
+SampleFetcher::SampleFetcher(PGSQLReader& reader)
+:reader(reader)
+,ring(8)
+,thread()
+,eof(0)
+,readTime()
+,waitTime(0)
+{
+   thread = std::thread(&SampleFetcher::run, this);
+}
+
+SampleFetcher::~SampleFetcher()
+{
+   finish();
+}
+
+// Drop the rest of the query, so that the connection can be used again
+void SampleFetcher::finish()
+{
+   SampleBatch batch;
+   while (pop(batch));
+   if (thread.joinable()) {
+      thread.join();
+   }
+}
+
+void SampleFetcher::run()
+{
+   SampleBatch out;
+   for (;;) {
+      const double t0 = stagetime::now();
+      out.clear(reader.getType());
+      reader.readBatch(out, kSampleBatchSize);
+      readTime.busy += stagetime::now()-t0;
+
+      const int last = out.size()<kSampleBatchSize;
+      if (!out.empty()) {
+         readTime.wait += ring.push(out);
+      }
+      if (last) {
+         out.clear(reader.getType());
+         readTime.wait += ring.push(out);
+         break;
+      }
+   }
+}
+
 //
 struct PBWriter
 {
    PGSQLReader& reader;
+   SampleFetcher *fetcher; // NULL unless pipelined
+   // Samples taken from the reader, samp is batch[pos]
+   SampleBatch batch;
+   size_t pos;
+   PGSQLReader::Data current;
    // Last returned sample, or NULL if all consumed
    const PGSQLReader::Data *samp;
 
@@ -88,16 +190,33 @@ struct PBWriter
    epicsTimeStamp startofyear;
    //epicsTimeStamp startofboundary;
    epicsTimeStamp endofboundary;
+   epicsTimeStamp endofslice; // samples from this time on are left to the next slice
 
-   std::ofstream outpb;
+   pbfile outpb;
    int typeChangeError;
    const std::string name;
    const std::string outdir;
    const boundary_t  boundary;
 
-   PBWriter(PGSQLReader& reader, std::string pv, std::string outdir, int b);
+   PBWriter(PGSQLReader& reader, std::string pv, std::string outdir, int b, int pipeline);
+   ~PBWriter();
    void write(); // all work is done through this method
 
+   const PGSQLReader::Data *get() const { return samp; }
+   const PGSQLReader::Data *next() { return moveTo(pos+1); }
+   // Make batch[i] the current sample, taking the next batch past the end
+   const PGSQLReader::Data *moveTo(size_t i)
+   {
+      pos = i;
+      if (pos>=batch.size() && !refill()) {
+         return samp = 0;
+      }
+      batch.get(pos, current);
+      return samp = &current;
+   }
+   bool refill();
+   void restart();
+
    bool prepFile();
 
    void forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNano);
@@ -108,66 +227,17 @@ struct PBWriter
 };
 
 
-/* Type specific operations helper for transcode_samples<>().
- *  valueop<DBR,isarray>::set(PBClass, dbr_* pointer, # of elements)
- *   Assign a scalar or array to the .val of a PB class instance (ie. EPICS::ScalarDouble)
- */
-template<int dbr, int isarray> struct valueop {
-   static void set(typename dbrstruct<dbr,isarray>::pbtype& pbc,
-                   const typename dbrstruct<dbr,isarray>::dbrtype* pdbr,
-                   unsigned)
-   {
-      pbc.set_val(pdbr->value);
-   }
-};
-
-// Partial specialization for arrays (works for numerics and scalar string)
-// does this work for array of string? Verified by jbobnar: YES, it works for array of strings
-template<int dbr> struct valueop<dbr,1> {
-   static void set(typename dbrstruct<dbr,1>::pbtype& pbc,
-                   const typename dbrstruct<dbr,1>::dbrtype* pdbr,
-                   unsigned count)
-   {
-      pbc.mutable_val()->Reserve(count);
-      for(unsigned i=0; i<count; i++)
-         pbc.add_val((&pdbr->value)[i]);
-   }
-};
-
-// specialization for scalar char
-template<> struct valueop<DBR_TIME_CHAR,0> {
-    static void set(EPICS::ScalarByte& pbc,
-                    const dbr_time_char* pdbr,
-                    unsigned)
-    {
-        char buf[2];
-        buf[0] = pdbr->value;
-        buf[1] = '\0';
-        pbc.set_val(buf);
-    }
-};
-
-// specialization for vector char
-template<> struct valueop<DBR_TIME_CHAR,1> {
-    static void set(EPICS::VectorChar& pbc,
-                    const dbr_time_char* pdbr,
-                    unsigned)
-    {
-        const epicsUInt8 *pbuf = &pdbr->value;
-        pbc.set_val((const char*)pbuf);
-    }
-};
-
 template<int dbr, int isarray>
 void transcode_samples(PBWriter& self)
 {
-   typedef const typename dbrstruct<dbr,isarray>::dbrtype sample_t;
+   typedef typename dbrstruct<dbr,isarray>::dbrtype sample_t;
    typedef typename dbrstruct<dbr,isarray>::pbtype encoder_t;
+   typedef typename batchcolumn<dbr>::type value_t;
    typedef std::vector<std::pair<std::string, std::string> > fieldvalues_t;
 
 
    encoder_t encoder;
-   escapingarraystream encbuf;
+   escapingstream encbuf;
    fieldvalues_t fieldvalues;
 
    epicsUInt32 disconnected_epoch = 0;
@@ -217,138 +287,160 @@ void transcode_samples(PBWriter& self)
        //}
     }
 
+    // the fields are constant for the PV, encode them once
+    const std::string fieldblock(fieldvaluesblock(fieldvalues));
+    const std::string noblock;
+
     int previousType = self.reader.getType();
-    do {
+    std::vector<epicsUInt32> secsintoyear;
+    for (;;) {
        if (self.reader.getType() != previousType) {
-          std::cout << "ERROR: The type of PV " << self.name.c_str() << " changed from " << previousType << " to " << self.reader.getType() << std::endl;
-          std::cout << "Wrote: " << nwrote << std::endl;
+          pvlog() << "ERROR: The type of PV " << self.name.c_str() << " changed from " << previousType << " to " << self.reader.getType() << std::endl;
+          pvlog() << "Wrote: " << nwrote << std::endl;
           self.typeChangeError += 1;
           return;
        }
        previousType = self.reader.getType();
-       sample_t *sample = (sample_t*)self.samp;
 
-       if (sample->stamp.secPastEpoch>=self.endofboundary.secPastEpoch) {
-          std::cout << "Boundary " << sample->stamp.secPastEpoch << " " << self.endofboundary.secPastEpoch << std::endl;
-          std::cout << "Wrote: " << nwrote << std::endl;
-          self.typeChangeError = 0;
-          return;
-       }
-       unsigned int secintoyear = sample->stamp.secPastEpoch - self.startofyear.secPastEpoch;
-
-       encoder.Clear();
-
-       int write_fields = 0;
-       int day = sample->stamp.secPastEpoch / 86400;
-       if (day != last_day_fields_written) {
-          //if we switched to a new day, write the fields
-          write_fields = 1;
-       }
-
-       const dbr_short_t sevr = sample->severity;
-       const dbr_short_t stat = sample->status;
-       const char *timestr = PGSQLReader::time2str(sample->stamp.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
-
-       // sevr                     ArchiveDataClient.pl
-       // stat                     RDB archiver
-       // 3904 : Disconnected      "ARCH_DISCONNECT"
-       // 3872 : Archive Off       "ARCH_STOPPED"
-       // 3848 : Archive Disabled  "ARCH_DISABLED"
-       // 3856 : Repeat            "ARCH_REPEAT"
-       // 3968 : Est_Repeat        "ARCH_EST_REPEAT"
-       // 3976 : Write_Error       CSS Archive specific
-       if (stat==3904 || stat==3872 || stat==3848 || stat==3976) {
-          if (disconnected_epoch == 0) {
-             disconnected_epoch = sample->stamp.secPastEpoch;
+       // the samples of the batch up to the end of the partition
+       const SampleBatch &batch = self.batch;
+       const size_t first = self.pos;
+       const size_t end = batch.split(first, self.endofboundary.secPastEpoch);
+       secsintoyear.resize(end-first);
+       batch.secondsIntoYear(first, end, self.startofyear.secPastEpoch, secsintoyear.data());
+       const value_t *values = batchcolumn<dbr>::of(batch).data();
+
+       size_t i;
+       for (i=first; i<end && self.outpb.good(); i++) {
+          const epicsUInt32 secpastepoch = batch.secPastEpoch[i];
+          const epicsUInt32 secintoyear = secsintoyear[i-first];
+          const epicsUInt32 nsec = batch.nsec[i];
+          sample_t sample;
+          sample.value = values[i];
+
+          encoder.Clear();
+
+          int write_fields = 0;
+          int day = secpastepoch / 86400;
+          if (day != last_day_fields_written) {
+             //if we switched to a new day, write the fields
+             write_fields = 1;
           }
-          if ((stat==3872 || stat==3848 || stat==3976) && prev_stat < 3000) {
+
+          const dbr_short_t sevr = batch.severity[i];
+          const dbr_short_t stat = batch.status[i];
+
+          // sevr                     ArchiveDataClient.pl
+          // stat                     RDB archiver
+          // 3904 : Disconnected      "ARCH_DISCONNECT"
+          // 3872 : Archive Off       "ARCH_STOPPED"
+          // 3848 : Archive Disabled  "ARCH_DISABLED"
+          // 3856 : Repeat            "ARCH_REPEAT"
+          // 3968 : Est_Repeat        "ARCH_EST_REPEAT"
+          // 3976 : Write_Error       CSS Archive specific
+          const int statclass = PGSQLReader::statusClass(stat);
+          if (statclass == STAT_ALARM && sevr >= 0 && disconnected_epoch == 0) {
+             // the common case, checked first
+          } else if ((statclass & STAT_DISCONNECT) == STAT_DISCONNECT) {
+             if (disconnected_epoch == 0) {
+                disconnected_epoch = secpastepoch;
+             }
+             if (statclass == STAT_STOPPED && prev_stat < 3000) {
+                prev_stat = stat;
+             }
+             write_fields = 0; //don't write fields if disconnected
+             continue;
+          } else if (statclass == STAT_SPECIAL) {
+             //sevr == 3856 || sevr == 3968
+             pvlog() << "WARN: " << self.name.c_str() << " " << PGSQLReader::time2str(secpastepoch+POSIX_TIME_AT_EPICS_EPOCH) << ": special stat " << stat << " encountered" << std::endl;
+             write_fields = 0; //don't write fields if special severity/status
+          } else if (statclass == STAT_UNKNOWN) {
+             // unknown status
+             pvlog() << "WARN: " << self.name.c_str() << " " << PGSQLReader::time2str(secpastepoch+POSIX_TIME_AT_EPICS_EPOCH) << ": unknown stat " << stat << " encountered" << std::endl;
+             //write_fields = 0; //don't write fields if special severity/status
+          } else if (sevr < 0) {
+             // unknown severity
+             pvlog() << "WARN: " << self.name.c_str() << " " << PGSQLReader::time2str(secpastepoch+POSIX_TIME_AT_EPICS_EPOCH) << ": unknown sevr " << sevr << " encountered" << std::endl;
+             //write_fields = 0; //don't write fields if special severity/status
+          } else if (disconnected_epoch != 0) {
+             //this is the first sample with value after a disconnected one
+             EPICS::FieldValue* FV(encoder.add_fieldvalues());
+             std::stringstream str; str << (disconnected_epoch + POSIX_TIME_AT_EPICS_EPOCH);
+             FV->set_name("cnxlostepsecs");
+             FV->set_val(str.str());
+
+             EPICS::FieldValue* FV2(encoder.add_fieldvalues());
+             str.str(""); str.clear(); str << (secpastepoch + POSIX_TIME_AT_EPICS_EPOCH);
+             FV2->set_name("cnxregainedepsecs");
+             FV2->set_val(str.str());
+
+             if (prev_stat == 3872) {
+                EPICS::FieldValue* FV3(encoder.add_fieldvalues());
+                FV3->set_name("startup");
+                FV3->set_val("true");
+             } else if (prev_stat == 3848) {
+                EPICS::FieldValue* FV3(encoder.add_fieldvalues());
+                FV3->set_name("resume");
+                FV3->set_val("true");
+             } else if (prev_stat == 3976) {
+                EPICS::FieldValue* FV3(encoder.add_fieldvalues());
+                FV3->set_name("writeerror");
+                FV3->set_val("true");
+             }
              prev_stat = stat;
+             disconnected_epoch = 0;
           }
-          write_fields = 0; //don't write fields if disconnected
-          continue;
-       } else if (stat >= 3000) {
-          //sevr == 3856 || sevr == 3968
-          std::cout << "WARN: " << self.name.c_str() << " " << timestr << ": special stat " << stat << " encountered" << std::endl;
-          write_fields = 0; //don't write fields if special severity/status
-       } else if (stat < 0) {
-          // unknown status
-          std::cout << "WARN: " << self.name.c_str() << " " << timestr << ": unknown stat " << stat << " encountered" << std::endl;
-          //write_fields = 0; //don't write fields if special severity/status
-       } else if (sevr < 0) {
-          // unknown severity
-          std::cout << "WARN: " << self.name.c_str() << " " << timestr << ": unknown sevr " << sevr << " encountered" << std::endl;
-          //write_fields = 0; //don't write fields if special severity/status
-       } else if (disconnected_epoch != 0) {
-          //this is the first sample with value after a disconnected one
-          EPICS::FieldValue* FV(encoder.add_fieldvalues());
-          std::stringstream str; str << (disconnected_epoch + POSIX_TIME_AT_EPICS_EPOCH);
-          FV->set_name("cnxlostepsecs");
-          FV->set_val(str.str());
-
-          EPICS::FieldValue* FV2(encoder.add_fieldvalues());
-          str.str(""); str.clear(); str << (sample->stamp.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH);
-          FV2->set_name("cnxregainedepsecs");
-          FV2->set_val(str.str());
-
-          if (prev_stat == 3872) {
-             EPICS::FieldValue* FV3(encoder.add_fieldvalues());
-             FV3->set_name("startup");
-             FV3->set_val("true");
-          } else if (prev_stat == 3848) {
-             EPICS::FieldValue* FV3(encoder.add_fieldvalues());
-             FV3->set_name("resume");
-             FV3->set_val("true");
-          } else if (prev_stat == 3976) {
-             EPICS::FieldValue* FV3(encoder.add_fieldvalues());
-             FV3->set_name("writeerror");
-             FV3->set_val("true");
+
+          // the fields of the PV go with the first sample of each day
+          const std::string& fields = fieldvalues.size() && write_fields ? fieldblock : noblock;
+          if (fieldvalues.size() && write_fields)
+             last_day_fields_written = day;
+
+          if (sampleenc<dbr, isarray>::supported && encoder.fieldvalues_size()==0) {
+             // no fieldvalues of a reconnection, write the wire format without the message
+             char raw[sampleenc<dbr, isarray>::maxsize];
+             encbuf.put(raw, sampleenc<dbr, isarray>::encode(raw, secintoyear, nsec, &sample, sevr, stat), fields);
+             self.outpb.write(encbuf.data(), encbuf.size());
+             nwrote++;
+             continue;
           }
-          prev_stat = stat;
-          disconnected_epoch = 0;
-       }
 
-       if (sample->severity!=0)
-          encoder.set_severity(sample->severity);
-       if (sample->status!=0)
-          encoder.set_status(sample->status);
+          if (sevr!=0)
+             encoder.set_severity(sevr);
+          if (stat!=0)
+             encoder.set_status(stat);
 
-       encoder.set_secondsintoyear(secintoyear);
-       encoder.set_nano(sample->stamp.nsec);
+          encoder.set_secondsintoyear(secintoyear);
+          encoder.set_nano(nsec);
 
-       valueop<dbr, isarray>::set(encoder, sample, self.reader.getCount());
+          valueop<dbr, isarray>::set(encoder, &sample, self.reader.getCount());
 
-       if(fieldvalues.size() && write_fields)
-       {
-          // encoder accumulated fieldvalues for this sample
-          for(fieldvalues_t::const_iterator it=fieldvalues.begin(), end=fieldvalues.end();
-              it!=end; ++it)
-          {
-             EPICS::FieldValue* FV(encoder.add_fieldvalues());
-             FV->set_name(it->first);
-             FV->set_val(it->second);
+          try {
+             encbuf.serialize(encoder, fields);
+             self.outpb.write(encbuf.data(), encbuf.size());
+             nwrote++;
+          } catch(std::exception& e) {
+             pvlog() << "ERROR encoding sample! : " << e.what() << std::endl;
+             encbuf.reset();
+             // skip
           }
-          //fieldvalues.clear(); // don't clear the fields, we will use them again later
-          last_day_fields_written = day;
        }
 
-       try {
-          {
-             google::protobuf::io::CodedOutputStream encstrm(&encbuf);
-             encoder.SerializeToCodedStream(&encstrm);
-          }
-          encbuf.finalize();
-          self.outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
-          nwrote++;
-       } catch(std::exception& e) {
-          std::cout << "ERROR encoding sample! : " << e.what() << std::endl;
-          encbuf.reset();
-          // skip
-        }
-
-    } while(self.outpb.good() && (self.samp=self.reader.next()));
+       const bool boundary = i==end && end<batch.size();
+       self.moveTo(i);
+       if (boundary) {
+          pvlog() << "Boundary " << self.samp->stamp.secPastEpoch << " " << self.endofboundary.secPastEpoch << std::endl;
+          pvlog() << "Wrote: " << nwrote << std::endl;
+          self.typeChangeError = 0;
+          return;
+       }
+       if (!self.samp || !self.outpb.good()) {
+          break;
+       }
+    }
 
-    std::cout << "End file " << self.samp << " " << self.outpb.good() << std::endl;
-    std::cout << "Wrote: " << nwrote << std::endl;
+    pvlog() << "End file " << self.samp << " " << self.outpb.good() << std::endl;
+    pvlog() << "Wrote: " << nwrote << std::endl;
 }
 
 void PBWriter::forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNano)
@@ -359,7 +451,7 @@ void PBWriter::forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNa
    //now skip forward to the first sample that is later than the last event read from the file
    unsigned int sampseconds = samp->stamp.secPastEpoch;
    while ((sampseconds < sec) && samp) {
-      samp = reader.next();
+      samp = next();
       if (samp)
          sampseconds = samp->stamp.secPastEpoch;
    }
@@ -367,7 +459,7 @@ void PBWriter::forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNa
    if (samp && (sampseconds == sec)) {
       unsigned int sampnano = samp->stamp.nsec; //in some cases I got overflow!?
       while (samp && (sampseconds == sec && sampnano <= nano)) {
-         samp = reader.next();
+         samp = next();
          if (samp) {
             sampseconds = samp->stamp.secPastEpoch;
             sampnano = samp->stamp.nsec;
@@ -379,31 +471,34 @@ void PBWriter::forwardReaderToTime(unsigned int sampleSec, unsigned int sampleNa
 template<int dbr, int array>
 void skip(PBWriter& self, const char* file)
 {
-#if 0
    typedef typename dbrstruct<dbr, array>::pbtype decoder;
 
    decoder sample;
    sample = searcher<dbr,array>::getLastSample(file);
 
-   // There is a room for optimization:
-   // 1) Cancel current query
-   // 2) Extract Start-of-query time from sample
-   // 3) Issue a new query
-   std::cout << "skip not implemented yet" << std::endl;
-   exit(-1);
-#else
-   typedef typename dbrstruct<dbr, array>::pbtype decoder;
+   epicsTimeStamp last;
+   last.secPastEpoch = sample.secondsintoyear() + self.startofyear.secPastEpoch;
+   last.nsec = sample.nano();
+   pvlog() << "Skipping until " << PGSQLReader::time2str(last.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH) << std::endl;
 
-   decoder sample;
-   sample = searcher<dbr,array>::getLastSample(file);
-   std::cout << "Skipping until " << PGSQLReader::time2str(sample.secondsintoyear() + self.startofyear.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH) << std::endl;
-   self.forwardReaderToTime(sample.secondsintoyear() + self.startofyear.secPastEpoch, sample.nano());
-#endif
+   if (self.samp->stamp.secPastEpoch > last.secPastEpoch ||
+       (self.samp->stamp.secPastEpoch == last.secPastEpoch && self.samp->stamp.nsec > last.nsec)) {
+      // nothing to skip
+      return;
+   }
+
+   // Issue the query again from the last sample, unless the rows are
+   // shared with other PVs (group query) or read ahead (pipeline).
+   if (!self.fetcher && self.reader.seek(last)) {
+      self.restart();
+   } else {
+      self.forwardReaderToTime(last.secPastEpoch, last.nsec);
+   }
 }
 
 bool PBWriter::prepFile()
 {
-   const PGSQLReader::Data *samp(reader.get());
+   const PGSQLReader::Data *samp(get());
 //    typedef const typename dbrstruct<dbr,isarray>::dbrtype sample_t;
 //    const dbrstruct<DBR_TIME_SHORT,0>::dbrtype *samp((const dbrstruct<DBR_TIME_SHORT,0>::dbrtype*)reader.get()); // this is OK - shuei
    getYearMonth(samp->stamp, &year, &month);
@@ -434,22 +529,18 @@ bool PBWriter::prepFile()
 
    EPICS::PayloadInfo header;
 
-   std::cout << "is a " << (isarray?"array":"scalar") << std::endl;
+   pvlog() << "is a " << (isarray?"array":"scalar") << std::endl;
    //exit(-1);
 
    if (!isarray) {
-      // Scalars
+      // Scalars, of the types PGSQLReader::readBatch() fills
       switch(dtype)
       {
 #define CASE(DBR) case DBR: transcode = &transcode_samples<DBR, 0>; \
          skipForward = &skip<DBR, 0>;                                   \
     header.set_type((EPICS::PayloadType)dbrstruct<DBR, 0>::pbcode); break
-         CASE(DBR_TIME_STRING);
-         CASE(DBR_TIME_CHAR);
-         CASE(DBR_TIME_SHORT);
          CASE(DBR_TIME_ENUM);
          CASE(DBR_TIME_LONG);
-         CASE(DBR_TIME_FLOAT);
          CASE(DBR_TIME_DOUBLE);
 #undef CASE
       default: {
@@ -459,26 +550,10 @@ bool PBWriter::prepFile()
       }
       }
    } else {
-      // Vectors
-      switch(dtype)
-      {
-#define CASE(DBR) case DBR: transcode = &transcode_samples<DBR, 1>; \
-         skipForward = &skip<DBR, 1>;                                   \
-         header.set_type((EPICS::PayloadType)dbrstruct<DBR, 1>::pbcode); break
-         CASE(DBR_TIME_STRING);
-         CASE(DBR_TIME_CHAR);
-         CASE(DBR_TIME_SHORT);
-         CASE(DBR_TIME_ENUM);
-         CASE(DBR_TIME_LONG);
-         CASE(DBR_TIME_FLOAT);
-         CASE(DBR_TIME_DOUBLE);
-#undef CASE
-      default: {
-         std::ostringstream msg;
-         msg << "Unsupported type " << dtype;
-         throw std::runtime_error(msg.str());
-      }
-      }
+      // Vectors are not stored in RDB, see PGSQLReader::getCount()
+      std::ostringstream msg;
+      msg << "Unsupported array of type " << dtype;
+      throw std::runtime_error(msg.str());
    }
 
    header.set_elementcount(reader.getCount());
@@ -519,43 +594,68 @@ bool PBWriter::prepFile()
       }
    }
 
-   std::cout << "Starting to write " << fname.str() << std::endl;
-   createDirs(fname.str());
-
-   escapingarraystream encbuf;
-   {
-      if (!fileexists) {
-         google::protobuf::io::CodedOutputStream encstrm(&encbuf);
-         header.SerializeToCodedStream(&encstrm);
-      }
-   }
-   encbuf.finalize();
-
-   outpb.open(fname.str().c_str(), std::fstream::app);
+   pvlog() << "Starting to write " << fname.str() << std::endl;
+   outpb.open(fname.str(), 1);
    if (!fileexists) { //if file exists do not write header
-      outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+      escapingstream encbuf;
+      encbuf.serialize(header);
+      outpb.write(encbuf.data(), encbuf.size());
    }
    return true;
 }
 
-PBWriter::PBWriter(PGSQLReader& reader, std::string pv, std::string outdir, int boundary)
+PBWriter::PBWriter(PGSQLReader& reader, std::string pv, std::string outdir, int boundary, int pipeline)
 :reader(reader)
+,fetcher(0)
+,batch()
+,pos(0)
+,samp(0)
 ,year(0)
+,outpb(pipeline ? PBFILE_THREAD : PBFILE_BLOCKING)
 ,name(pv)
 ,outdir(outdir)
 ,boundary(static_cast<boundary_t>(boundary))
 {
-   samp = reader.get();
+   if (pipeline) {
+      fetcher = new SampleFetcher(reader);
+   }
+   restart();
+   endofslice.secPastEpoch = ~0u;
+   endofslice.nsec = 0;
+}
+
+PBWriter::~PBWriter()
+{
+   delete fetcher;
+}
+
+// Take the next batch of samples, false at the end of the query
+bool PBWriter::refill()
+{
+   pos = 0;
+   if (fetcher) {
+      return fetcher->pop(batch);
+   }
+   batch.clear(reader.getType());
+   return reader.get() && reader.readBatch(batch, kSampleBatchSize)>0;
+}
+
+// Samples from get() of the reader on, as after find() or seek()
+void PBWriter::restart()
+{
+   batch.clear(reader.getType());
+   moveTo(0);
 }
 
 void PBWriter::write()
 {
+   const double t0 = stagetime::now();
    typeChangeError = 0;
-   while(samp) {
+   while(samp && samp->stamp.secPastEpoch<endofslice.secPastEpoch) {
       try {
          if (prepFile()) {
             if (!samp) {
-               std::cout << __FILE__ << " " << __func__ << " " << samp << std::endl;
+               pvlog() << __FILE__ << " " << __func__ << " " << samp << std::endl;
                break;
             }
             (*transcode)(*this);
@@ -580,13 +680,184 @@ void PBWriter::write()
          throw;
       }
 
-      bool ok = outpb.good();
       outpb.close();
-      if (!ok) {
-         std::cout << "Error writing file" << std::endl;
+      if (!outpb.good()) {
+         pvlog() << "Error writing file" << std::endl;
          break;
       }
    }
+
+   if (fetcher) {
+      // The stage close to 100% is the bottleneck
+      fetcher->finish();
+      samp = 0;
+      stagetime encode;
+      encode.wait = fetcher->waitTime + outpb.waitTime();
+      encode.busy = stagetime::now() - t0 - encode.wait;
+      pvlog() << "Utilization: read " << (int)(100*fetcher->readTime.utilization())
+              << "% encode " << (int)(100*encode.utilization())
+              << "% write " << (int)(100*outpb.writerTime().utilization()) << "%" << std::endl;
+   }
+}
+
+// A unit of work: a PV, a group of PVs (see planGroups()) or a slice of a PV (see planSlices())
+struct job_t {
+   std::vector<std::string> pvs;
+   std::string    start;      // query window
+   std::string    end;
+   epicsTimeStamp endofslice; // samples from this time on are not written
+};
+
+// Export samples of a PV in the query window
+static void exportPV(PGSQLReader &reader, const std::string &pvname, int dbrtype, const std::string &start, const std::string &end, const std::string &outdir, int boundary, const epicsTimeStamp &endofslice, int pipeline)
+{
+   // find() fills the window of each PV, when it is not specified
+   std::string pvstart = start;
+   std::string pvend   = end;
+
+   try {
+      pvlog() << "Visit PV " << pvname << std::endl;
+
+      if(!reader.find(pvname, dbrtype, pvstart, pvend)) {
+         // PV not found or no data in the query window
+         return;
+      }
+
+      pvlog() << " start " << pvstart << " end " << pvend << std::endl;
+      pvlog() << " Type " << reader.getType() << " count " << reader.getCount() << std::endl;
+
+      PBWriter writer(reader, pvname, outdir, boundary, pipeline);
+      writer.endofslice = endofslice;
+      writer.write();
+
+      // Drop the rest of the window. The slice ends on a partition boundary, and
+      // the window is only a second longer than that, see PGSQLReader::setEndTime().
+      if (endofslice.secPastEpoch!=~0u) {
+         while (writer.samp) {
+            writer.samp = writer.next();
+         }
+      }
+   } catch (std::exception& e) {
+      //print exception and continue with the next pv
+      pvlog() << "Exception: " << pvname << ": " << e.what() << std::endl;
+   }
+   pvlog() << "Done" << std::endl;
+}
+
+// Export PVs of a job. With tag, messages of each PV are written at once
+// after the PV is done.
+static void exportJob(PGSQLReader &reader, const PGSQLCatalog &catalog, const job_t &job, int dbrtype, const std::string &outdir, int boundary, int pipeline, int tag)
+{
+   const std::vector<std::string> &group = job.pvs;
+
+   if (group.size()>1) {
+      std::vector<int> ids;
+      for (size_t j=0; j<group.size(); j++) {
+         ids.push_back(catalog.find(group[j])->channel_id);
+      }
+      if (tag) pvlog_begin(group[0]);
+      pvlog() << "Group of " << group.size() << " PVs" << std::endl;
+      reader.setGroupQuery(ids, job.start, job.end);
+      if (tag) pvlog_end();
+   }
+
+   for (size_t j=0; j<group.size(); j++) {
+      if (tag) pvlog_begin(job.endofslice.secPastEpoch==~0u ? group[j] : group[j] + " " + job.start);
+      exportPV(reader, group[j], dbrtype, job.start, job.end, outdir, boundary, job.endofslice, pipeline);
+      if (tag) pvlog_end();
+   }
+
+   reader.endGroup();
+}
+
+// Group PVs in ascending order of channel_id, so that estimated rows of a group
+// do not exceed grouprows. PVs with more rows are left alone, as well as those
+// not in the catalog.
+static const size_t kMaxGroupSize = 1000;
+
+static std::vector<std::vector<std::string> > planGroups(const PGSQLReader &reader, const PGSQLCatalog &catalog, int npv, char **pvs, double grouprows)
+{
+   std::vector<std::vector<std::string> > groups;
+   std::vector<std::pair<int, std::string> > small;
+
+   for (int i=0; i<npv; i++) {
+      const PGSQLCatalog::channel_t *ch = catalog.find(pvs[i]);
+      if (ch && reader.estimateRows(ch->channel_id) < grouprows) {
+         small.push_back(std::make_pair(ch->channel_id, std::string(pvs[i])));
+      } else {
+         groups.push_back(std::vector<std::string>(1, pvs[i]));
+      }
+   }
+
+   std::sort(small.begin(), small.end());
+
+   double rows = 0;
+   std::vector<std::string> group;
+   for (size_t i=0; i<small.size(); i++) {
+      const double est = reader.estimateRows(small[i].first);
+      if (group.size()>0 && (rows+est > grouprows || group.size() >= kMaxGroupSize)) {
+         groups.push_back(group);
+         group.clear();
+         rows = 0;
+      }
+      group.push_back(small[i].second);
+      rows += est;
+   }
+   if (group.size()>0) {
+      groups.push_back(group);
+   }
+
+   return groups;
+}
+
+// Split the window of a PV on partition boundaries, so that the slices are
+// exported in parallel. Each partition, thus each .pb file, is written by
+// a single slice. Either end of the window not given is read from RDB.
+static std::vector<job_t> planSlices(PGSQLReader &reader, const PGSQLCatalog &catalog, const std::string &pvname, const std::string &start, const std::string &end, int boundary)
+{
+   std::vector<job_t> slices;
+
+   double first = 0, last = 0;
+   if (start.empty() || end.empty()) {
+      const PGSQLCatalog::channel_t *ch = catalog.find(pvname);
+      if (!ch || reader.readTimeRange(ch->channel_id, first, last)<=0) {
+         return slices;
+      }
+   }
+   if (!start.empty()) first = PGSQLReader::str2time(start.c_str());
+   if (!end.empty())   last  = PGSQLReader::str2time(end.c_str());
+
+   job_t job;
+   job.pvs.push_back(pvname);
+
+   epicsTimeStamp t;
+   t.secPastEpoch = (epicsUInt32)first - POSIX_TIME_AT_EPICS_EPOCH;
+   t.nsec = 0;
+   while (t.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH <= last) {
+      int year, month;
+      getYearMonth(t, &year, &month);
+      if (boundary==PARTITION_YEAR) {
+         getStartOfYear(year+1, &job.endofslice);
+      } else {
+         getStartOfYearMonth(year, month+1, &job.endofslice);
+      }
+
+      const time_t sliceend = job.endofslice.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH;
+      job.start = PGSQLReader::time2str(t.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH);
+      if (sliceend > last) {
+         // the last slice, up to the end of the window
+         job.end = PGSQLReader::time2str(last);
+         job.endofslice.secPastEpoch = ~0u;
+      } else {
+         // the end of the window is extended by a second, see PGSQLReader::setEndTime()
+         job.end = PGSQLReader::time2str(sliceend - 1);
+      }
+      slices.push_back(job);
+
+      t = job.endofslice;
+   }
+
+   return slices;
 }
 
 void usage(const char *argv0)
@@ -596,7 +867,7 @@ void usage(const char *argv0)
    const char *end   = "2017-02-02T00:00:00";
    const char *type  = "DBR_TIME_DOUBLE";
 
-   std::cout << "Usage: " << argv0 << "[-h] [-v] [-o OUTDIR] [-s START] [-e END] -t DBRTYPE PV [PV ...]" << std::endl
+   std::cout << "Usage: " << argv0 << "[-h] [-v] [-o OUTDIR] [-p PARTITION] [-f FETCH] [-n CHUNK] [-k] [-K CATALOG] [-b ROWS] [-j JOBS] [-x ROWS] [-P] [-s START] [-e END] -t DBRTYPE PV [PV ...]" << std::endl
              << std::endl
              << "Example: " << std::endl
              << argv0 << " -s " << start << " -e " << end << " -t " << type << " " << pv
@@ -616,7 +887,32 @@ void usage(const char *argv0)
    for (auto itr = kPartitions.begin(); itr!=kPartitions.end(); ++itr) {
       std::cout << "                " << itr->str << std::endl;
    }
-   std::cout << " -o OUTDIR    : Specify output directory." << std::endl
+   std::cout << " -f FETCH     : Specify how samples are fetched from RDB (default = FETCH_BINARY)." << std::endl
+             << "                Supported modes are:" << std::endl;
+   for (auto itr = kFetchModes.begin(); itr!=kFetchModes.end(); ++itr) {
+      std::cout << "                " << itr->str << std::endl;
+   }
+   std::cout << " -n CHUNK     : Initial number of rows per FETCH in FETCH_CHUNK (default = 1000)." << std::endl
+             << "                It is adapted to the round trip time at run time." << std::endl
+             << " -k           : Preload channel names and metadata of all PVs at startup." << std::endl
+             << " -K CATALOG   : Same as -k, but the catalog is read from the snapshot file CATALOG." << std::endl
+             << "                The snapshot is written after preloading, if CATALOG does not exist." << std::endl
+             << "                Remove CATALOG to reflect changes of the channel tables." << std::endl
+             << " -b ROWS      : Query samples of small PVs together, up to ROWS estimated rows" << std::endl
+             << "                in a query (default = 0, a query per PV). Implies -k." << std::endl
+             << " -j JOBS      : Number of worker threads, each with its own connection (default = 1)." << std::endl
+             << "                Messages are prefixed with the PV name when JOBS > 1." << std::endl
+             << " -x ROWS      : Split PVs of more than ROWS estimated rows into slices of partitions," << std::endl
+             << "                which are exported in parallel by the workers (default = 0, no split)." << std::endl
+             << "                Implies -k." << std::endl
+             << " -P           : Read, encode and write samples of a PV in separate threads," << std::endl
+             << "                and report how busy each of them is." << std::endl
+             << " -U           : Submit the writes, opens and directory creations of the output files" << std::endl
+             << "                to an io_uring per worker. Blocking system calls are used instead" << std::endl
+             << "                when io_uring is not available, or not built with USE_IO_URING." << std::endl
+             << " -F MB        : Preallocate the output files in steps of MB megabytes, which are" << std::endl
+             << "                given back when a file is closed (default = 0, no preallocation)." << std::endl
+             << " -o OUTDIR    : Specify output directory." << std::endl
              << " -s START     : Start of the query window." << std::endl
              << " -e END       : End of the query winrow." << std::endl
              << "                Acceptable date formats are:" << std::endl
@@ -637,6 +933,14 @@ int main(int argc, char *argv[])
    //
    int          dbrtype  = -1;
    int          boundary = PARTITION_MONTH;
+   int          fetch    = FETCH_BINARY;
+   int          chunk    = 1000;
+   int          preload  = 0;
+   double       grouprows = 0;
+   int          njobs    = 1;
+   double       slicerows = 0;
+   int          pipeline = 0;
+   std::string  catalogfile;
    std::string  outdir("./");
    std::string  start = "";
    std::string  end   = "";
@@ -646,7 +950,7 @@ int main(int argc, char *argv[])
    int ch;
    extern char *optarg;
    extern int   optind;
-   while ((ch=getopt(argc, argv, "ho:p:s:e:t:v")) != EOF) {
+   while ((ch=getopt(argc, argv, "hb:f:F:j:kK:n:o:p:Ps:e:t:Uvx:")) != EOF) {
       //char *endp;
       switch(ch) {
       case 'h':
@@ -681,6 +985,55 @@ int main(int argc, char *argv[])
              usage(argv0);
          }
          break;
+      case 'f':
+         fetch = str2num(optarg, kFetchModes);
+         if (fetch<0) {
+             std::cout << "unsupported fetch mode: " << optarg << std::endl;
+             usage(argv0);
+         }
+         break;
+      case 'b':
+         grouprows = atof(optarg);
+         preload = 1;
+         break;
+      case 'j':
+         njobs = atoi(optarg);
+         if (njobs<=0) {
+             std::cout << "invalid number of jobs: " << optarg << std::endl;
+             usage(argv0);
+         }
+         break;
+      case 'k':
+         preload = 1;
+         break;
+      case 'P':
+         pipeline = 1;
+         break;
+      case 'U':
+         pbfile::setURing(1);
+         break;
+      case 'F':
+         if (atoi(optarg)<0) {
+             std::cout << "invalid preallocation: " << optarg << std::endl;
+             usage(argv0);
+         }
+         pbfile::setPreallocate((size_t)atoi(optarg)*1024*1024);
+         break;
+      case 'x':
+         slicerows = atof(optarg);
+         preload = 1;
+         break;
+      case 'K':
+         preload = 1;
+         catalogfile = optarg;
+         break;
+      case 'n':
+         chunk = atoi(optarg);
+         if (chunk<=0) {
+             std::cout << "invalid chunk size: " << optarg << std::endl;
+             usage(argv0);
+         }
+         break;
       default:
          usage(argv0);
          break;
@@ -710,30 +1063,96 @@ int main(int argc, char *argv[])
       const char *port   = 0;
 
       PGSQLReader *reader = new PGSQLReader(server, dbname, user, passwd, port, verbose);
+      reader->setFetchMode(fetch);
+      reader->setChunkSize(chunk);
 
-      for (int i=0; i<argc; i++) {
-
-         const char *pvname = argv[i];
-         //std::string pvname(*argv);
+      PGSQLCatalog catalog;
+      if (preload) {
+         if (catalogfile.size()>0 && catalog.read(catalogfile)>0) {
+            std::cout << "Catalog: " << catalog.size() << " channels from " << catalogfile << std::endl;
+         } else {
+            reader->readCatalog(catalog);
+            std::cout << "Catalog: " << catalog.size() << " channels from RDB" << std::endl;
+            if (catalogfile.size()>0 && catalog.write(catalogfile)>0) {
+               std::cout << "Catalog: written to " << catalogfile << std::endl;
+            }
+         }
+         reader->setCatalog(&catalog);
+      }
 
-         try {
-            std::cout << "Visit PV " << pvname << std::endl;
+      std::vector<std::vector<std::string> > groups;
+      if (grouprows>0 || slicerows>0) {
+         reader->readRowEstimates();
+      }
+      if (grouprows>0) {
+         groups = planGroups(*reader, catalog, argc, argv, grouprows);
+      } else {
+         for (int i=0; i<argc; i++) {
+            groups.push_back(std::vector<std::string>(1, argv[i]));
+         }
+      }
 
-            if(!reader->find(pvname, dbrtype, start, end)) {
-               // PV not found or no data in the query window
+      // Slices of huge PVs are queued first, so that they do not end up as the tail
+      std::vector<job_t> jobs;
+      std::vector<job_t> others;
+      for (size_t i=0; i<groups.size(); i++) {
+         const PGSQLCatalog::channel_t *ch = catalog.find(groups[i][0]);
+         if (slicerows>0 && groups[i].size()==1 && ch && reader->estimateRows(ch->channel_id) > slicerows) {
+            std::vector<job_t> slices = planSlices(*reader, catalog, groups[i][0], start, end, boundary);
+            if (slices.size()>0) {
+               std::cout << "Split " << groups[i][0] << " into " << slices.size() << " slices" << std::endl;
+               jobs.insert(jobs.end(), slices.begin(), slices.end());
                continue;
             }
+         }
+
+         job_t job;
+         job.pvs = groups[i];
+         job.start = start;
+         job.end = end;
+         job.endofslice.secPastEpoch = ~0u;
+         job.endofslice.nsec = 0;
+         others.push_back(job);
+      }
+      jobs.insert(jobs.end(), others.begin(), others.end());
+
+      if (njobs<=1) {
+         for (size_t i=0; i<jobs.size(); i++) {
+            exportJob(*reader, catalog, jobs[i], dbrtype, outdir, boundary, pipeline, 0);
+         }
+      } else {
+         // Each worker has its own connection, and takes the next job from the queue
+         std::mutex queuemutex;
+         size_t     queuenext = 0;
+         auto worker = [&]() {
+            PGSQLReader wreader(server, dbname, user, passwd, port, verbose);
+            wreader.setFetchMode(fetch);
+            wreader.setChunkSize(chunk);
+            if (preload) {
+               wreader.setCatalog(&catalog);
+            }
 
-            std::cout << " start " << start << " end " << end << std::endl;
-            std::cout << " Type " << reader->getType() << " count " << reader->getCount() << std::endl;
+            for (;;) {
+               size_t i;
+               {
+                  std::lock_guard<std::mutex> lock(queuemutex);
+                  if (queuenext>=jobs.size()) {
+                     break;
+                  }
+                  i = queuenext++;
+               }
+               exportJob(wreader, catalog, jobs[i], dbrtype, outdir, boundary, pipeline, 1);
+            }
+         };
 
-            PBWriter writer(*reader, pvname, outdir, boundary);
-            writer.write();
-         } catch (std::exception& e) {
-            //print exception and continue with the next pv
-            std::cout << "Exception: " << pvname << ": " << e.what() << std::endl;
+         std::cout << "Start " << njobs << " workers" << std::endl;
+         std::vector<std::thread> workers;
+         for (int i=0; i<njobs; i++) {
+            workers.push_back(std::thread(worker));
+         }
+         for (size_t i=0; i<workers.size(); i++) {
+            workers[i].join();
          }
-         std::cout << "Done" << std::endl;
       }
 
       std::cout << "Done" << std::endl;
@@ -3,7 +3,13 @@
 #include <algorithm>
 
 #include <iostream>
+#include <fstream>
 #include <cstring>
+#include <thread>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
@@ -13,6 +19,14 @@
 
 #include "pbsearch.h"
 #include "pbstreams.h"
+#include "pbencode.h"
+#include "pbbatch.h"
+#include "pbescape.h"
+#include "pbpipe.h"
+#include "pbfile.h"
+#include "pbsched.h"
+#include "pbdatafile.h"
+#include "PGSQLReader.h"
 #include "pbeutil.h"
 #include "EPICSEvent.pb.h"
 
@@ -33,6 +47,47 @@ static void testTime()
            (unsigned long)ts2.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
 }
 
+static void testIsoTime()
+{
+    testDiag("Test ISO timestamp parsing and formatting");
+    long long wall;
+    int hasoffset;
+    long offset;
+
+    /* 2015-03-04 18:46:20 UTC */
+    testOk(parseIsoTime("2015-03-04 18:46:20", &wall, &hasoffset, &offset)
+           && wall==1425494780 && !hasoffset, "without offset");
+    testOk(parseIsoTime("2015-03-05T03:46:20.123456+09", &wall, &hasoffset, &offset)
+           && wall-offset==1425494780 && hasoffset, "with fraction and offset");
+    testOk(parseIsoTime("2015-03-04 13:16:20-05:30", &wall, &hasoffset, &offset)
+           && wall-offset==1425494780, "with offset in minutes");
+    testOk(parseIsoTime("2000-02-29 00:00:00Z", &wall, &hasoffset, &offset)
+           && wall==951782400 && hasoffset, "leap day in UTC");
+    testOk(!parseIsoTime("2015-03-04", &wall, &hasoffset, &offset)
+           && !parseIsoTime("20150304T184620", &wall, &hasoffset, &offset)
+           && !parseIsoTime("2015-03-04 18:46:20 junk", &wall, &hasoffset, &offset),
+           "other formats are rejected");
+
+    char buf[20];
+    formatIsoTime(1425494780, buf);
+    testOk(strcmp(buf, "2015-03-04T18:46:20")==0, "format %s", buf);
+    formatIsoTime(-1, buf);
+    testOk(strcmp(buf, "1969-12-31T23:59:59")==0, "format %s", buf);
+
+    // against timegm over the days of a few years
+    int ok = 1;
+    for (time_t t=946684800-86400*400; t<946684800+86400*800; t+=86400+3607) {
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        char str[32];
+        strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S", &tm);
+        formatIsoTime(t, buf);
+        buf[10] = ' ';
+        ok &= parseIsoTime(str, &wall, &hasoffset, &offset) && wall==t && strcmp(buf, str)==0;
+    }
+    testOk(ok, "same as gmtime_r");
+}
+
 static void testEscape()
 {
     static const char input[] = "hello\nworld";
@@ -53,6 +108,61 @@ static void testEscape()
     testOk1(std::string(expect)==std::string(&encbuf.outbuf[0], encbuf.outbuf.size()));
 }
 
+// Each kernel must escape as the byte-at-a-time reference, and unescape back
+static void testEscapeKernels()
+{
+    testDiag("Test escape kernels");
+
+    // special bytes around the vector boundaries, and runs without any
+    std::string input;
+    for (int i=0; i<300; i++) {
+        input.push_back((i%17==0 || i%31==15) ? "\x1b\n\r"[i%3] : char(0x20+i%90));
+    }
+    input.append("\x1b\x1b\n\n\r\r");
+
+    std::string expect;
+    for (size_t i=0; i<input.size(); i++) {
+        switch (input[i]) {
+        case '\x1b': expect += "\x1b\x01"; break;
+        case '\n':   expect += "\x1b\x02"; break;
+        case '\r':   expect += "\x1b\x03"; break;
+        default:     expect += input[i];
+        }
+    }
+
+    const int best = escape_kernel();
+    for (int k=ESCAPE_SCALAR; k<=ESCAPE_AVX2; k++) {
+        if (!escape_select(k)) {
+            testSkip(2, escape_kernel_name(k));
+            continue;
+        }
+
+        // every length, so that the tails are covered
+        int escok = 1, unescok = 1;
+        for (size_t len=0; len<=input.size(); len++) {
+            std::vector<char> out(2*len+1);
+            size_t n = escape(input.data(), len, &out[0]);
+            std::string ref;
+            for (size_t i=0, j=0; j<len; j++) {
+                size_t l = (input[j]=='\x1b' || input[j]=='\n' || input[j]=='\r') ? 2 : 1;
+                ref.append(expect, i, l);
+                i += l;
+            }
+            if (std::string(&out[0], n)!=ref)
+                escok = 0;
+
+            std::vector<char> back(len+1);
+            if (unescape_plan(&out[0], n)!=len
+                    || unescape(&out[0], n, &back[0], len)!=0
+                    || std::string(&back[0], len)!=input.substr(0, len))
+                unescok = 0;
+        }
+        testOk(escok, "escape %s", escape_kernel_name(k));
+        testOk(unescok, "unescape %s", escape_kernel_name(k));
+    }
+    escape_select(best);
+}
+
 static void writeSample()
 {
     EPICS::ScalarInt encoder;
@@ -122,18 +232,514 @@ static void writeSample()
     }
 }
 
-static const char* getLastSampleFile()
+// escapingstream must produce the same line as escapingarraystream
+template<class M>
+static void testSameEscaping(const M& msg, const char* what)
+{
+    escapingarraystream ref;
+    {
+        google::protobuf::io::CodedOutputStream encstrm(&ref);
+        msg.SerializeToCodedStream(&encstrm);
+    }
+    ref.finalize();
+    const std::string expect(&ref.outbuf[0], ref.outbuf.size());
+
+    escapingstream encbuf;
+    encbuf.serialize(msg);
+    testOk(std::string(encbuf.data(), encbuf.size())==expect, "%s, size %u", what, (unsigned)expect.size());
+
+    // without the size known in advance, through several windows
+    encbuf.reset();
+    {
+        google::protobuf::io::CodedOutputStream encstrm(&encbuf);
+        msg.SerializeToCodedStream(&encstrm);
+    }
+    encbuf.finalize();
+    testOk(std::string(encbuf.data(), encbuf.size())==expect, "%s, streamed", what);
+}
+
+static void testEscapingStream()
+{
+    testDiag("Test escapingstream");
+
+    EPICS::ScalarInt scalar;
+    scalar.set_secondsintoyear(1234);
+    scalar.set_nano(5678);
+    scalar.set_val(42);
+    testSameEscaping(scalar, "scalar");
+
+    // the value and nano have all of the escaped bytes
+    scalar.set_nano(0x0a0d1b);
+    scalar.set_val(0x1b0a0d1b);
+    testSameEscaping(scalar, "scalar escaped");
+
+    EPICS::VectorChar waveform;
+    waveform.set_secondsintoyear(10);
+    waveform.set_nano(0x0a);
+    std::string val(10000, 0);
+    for (size_t i=0; i<val.size(); i++)
+        val[i] = "\x1b\n\r\x1b-x"[i%6];
+    waveform.set_val(val);
+    testSameEscaping(waveform, "waveform");
+
+    EPICS::VectorDouble vector;
+    vector.set_secondsintoyear(20);
+    vector.set_nano(30);
+    for (int i=0; i<1000; i++)
+        vector.add_val(i*1.0e-3);
+    testSameEscaping(vector, "vector");
+}
+
+template<int dbr>
+static void testSameEncoding(typename dbrstruct<dbr,0>::pbtype msg,
+                             const typename dbrstruct<dbr,0>::dbrtype& smp,
+                             const char* what)
+{
+    msg.set_secondsintoyear(smp.stamp.secPastEpoch);
+    msg.set_nano(smp.stamp.nsec);
+    if (smp.severity!=0)
+        msg.set_severity(smp.severity);
+    if (smp.status!=0)
+        msg.set_status(smp.status);
+
+    char raw[sampleenc<dbr,0>::maxsize];
+    size_t len = sampleenc<dbr,0>::encode(raw, smp.stamp.secPastEpoch, smp.stamp.nsec,
+                                          &smp, smp.severity, smp.status);
+    testOk(std::string(raw, len)==msg.SerializeAsString(), "sampleenc %s", what);
+}
+
+static void testSampleEncoder()
+{
+    testDiag("Test sample encoders against protobuf");
+
+    {
+        dbr_time_string smp = {};
+        smp.stamp.secPastEpoch = 31535999;
+        smp.stamp.nsec = 999999999;
+        strcpy(smp.value, "val\x1b\n\r");
+        EPICS::ScalarString msg;
+        msg.set_val(smp.value);
+        testSameEncoding<DBR_TIME_STRING>(msg, smp, "string");
+
+        memset(smp.value, 'x', MAX_STRING_SIZE);
+        msg.set_val(std::string(MAX_STRING_SIZE, 'x'));
+        testSameEncoding<DBR_TIME_STRING>(msg, smp, "string of MAX_STRING_SIZE");
+    }
+    {
+        dbr_time_char smp = {};
+        smp.stamp.secPastEpoch = 1;
+        smp.value = '\n';
+        EPICS::ScalarByte msg;
+        msg.set_val(std::string(1, '\n'));
+        testSameEncoding<DBR_TIME_CHAR>(msg, smp, "char");
+
+        smp.value = 0;
+        msg.set_val(std::string());
+        testSameEncoding<DBR_TIME_CHAR>(msg, smp, "char zero");
+    }
+    {
+        dbr_time_short smp = {};
+        smp.stamp.secPastEpoch = 1000;
+        smp.value = -12345;
+        smp.severity = 2;
+        smp.status = 7;
+        EPICS::ScalarShort msg;
+        msg.set_val(smp.value);
+        testSameEncoding<DBR_TIME_SHORT>(msg, smp, "short");
+    }
+    {
+        dbr_time_enum smp = {};
+        smp.stamp.nsec = 0x1b0a0d;
+        smp.value = 65535;
+        EPICS::ScalarEnum msg;
+        msg.set_val(smp.value);
+        testSameEncoding<DBR_TIME_ENUM>(msg, smp, "enum");
+    }
+    {
+        dbr_time_long smp = {};
+        smp.stamp.secPastEpoch = 0x0a0d1b;
+        smp.value = -1;
+        smp.severity = -1;
+        EPICS::ScalarInt msg;
+        msg.set_val(smp.value);
+        testSameEncoding<DBR_TIME_LONG>(msg, smp, "long, negative severity");
+    }
+    {
+        dbr_time_float smp = {};
+        smp.value = -1.5e-7f;
+        smp.severity = 3;
+        EPICS::ScalarFloat msg;
+        msg.set_val(smp.value);
+        testSameEncoding<DBR_TIME_FLOAT>(msg, smp, "float");
+    }
+    {
+        dbr_time_double smp = {};
+        smp.stamp.secPastEpoch = 86400;
+        smp.stamp.nsec = 500000000;
+        smp.value = 3.14159265358979;
+        smp.status = 17;
+        EPICS::ScalarDouble msg;
+        msg.set_val(smp.value);
+        testSameEncoding<DBR_TIME_DOUBLE>(msg, smp, "double");
+    }
+}
+
+// Zeroed storage of a dbr_time_* waveform of n elements
+template<int dbr>
+static std::vector<double> waveform(size_t n)
+{
+    typedef typename dbrstruct<dbr,1>::dbrtype dbrtype;
+    return std::vector<double>((sizeof(dbrtype) + n*sizeof(dbrtype().value) + sizeof(double)-1)/sizeof(double));
+}
+
+// A numeric waveform of n elements, value i-n/2 at element i
+template<int dbr>
+static std::vector<double> ramp(size_t n)
+{
+    std::vector<double> buf(waveform<dbr>(n));
+    typename dbrstruct<dbr,1>::dbrtype* pdbr = (typename dbrstruct<dbr,1>::dbrtype*)&buf[0];
+    for (size_t i=0; i<n; i++)
+        (&pdbr->value)[i] = double(i) - double(n/2);
+    return buf;
+}
+
+static void testWaveformValues()
+{
+    testDiag("Test bulk copies of waveforms");
+    const size_t n = 1000;
+
+    std::vector<double> shorts(ramp<DBR_TIME_SHORT>(n));
+    const dbr_time_short* pshort = (const dbr_time_short*)&shorts[0];
+    EPICS::VectorShort vshort, vshortref;
+    valueop<DBR_TIME_SHORT,1>::set(vshort, pshort, n);
+    for (size_t i=0; i<n; i++)
+        vshortref.add_val((&pshort->value)[i]);
+    testOk1(vshort.val_size()==int(n) && vshort.val(0)==-int(n/2)
+            && vshort.SerializePartialAsString()==vshortref.SerializePartialAsString());
+
+    std::vector<double> doubles(ramp<DBR_TIME_DOUBLE>(n));
+    const dbr_time_double* pdouble = (const dbr_time_double*)&doubles[0];
+    EPICS::VectorDouble vdouble;
+    valueop<DBR_TIME_DOUBLE,1>::set(vdouble, pdouble, n);
+    vdouble.mutable_val()->Clear();
+    valueop<DBR_TIME_DOUBLE,1>::set(vdouble, pdouble, 3);
+    testOk1(vdouble.val_size()==3 && vdouble.val(2)==2.0-double(n/2));
+
+    // binary bytes, not a string
+    std::vector<double> chars(waveform<DBR_TIME_CHAR>(4));
+    dbr_time_char* pchar = (dbr_time_char*)&chars[0];
+    memcpy(&pchar->value, "a\0b\0", 4);
+    EPICS::VectorChar vchar;
+    valueop<DBR_TIME_CHAR,1>::set(vchar, pchar, 4);
+    testOk1(vchar.val()==std::string("a\0b\0", 4));
+
+    // a string of all MAX_STRING_SIZE characters is not terminated
+    std::vector<double> strings(waveform<DBR_TIME_STRING>(2));
+    dbr_time_string* pstring = (dbr_time_string*)&strings[0];
+    memset(pstring->value, 'x', MAX_STRING_SIZE);
+    strcpy((&pstring->value)[1], "second");
+    EPICS::VectorString vstring;
+    valueop<DBR_TIME_STRING,1>::set(vstring, pstring, 2);
+    testOk1(vstring.val_size()==2 && vstring.val(0)==std::string(MAX_STRING_SIZE, 'x')
+            && vstring.val(1)=="second");
+}
+
+static void testFieldValuesBlock()
+{
+    testDiag("Test the fieldvalues block appended to samples");
+
+    std::vector<std::pair<std::string, std::string> > fieldvalues;
+    fieldvalues.push_back(std::make_pair("HOPR", "10"));
+    fieldvalues.push_back(std::make_pair("EGU", "mm\x1b\n"));
+    fieldvalues.push_back(std::make_pair("states", std::string(200, 's')));
+    const std::string block(fieldvaluesblock(fieldvalues));
+
+    dbr_time_double smp = {};
+    smp.stamp.secPastEpoch = 86400;
+    smp.stamp.nsec = 0x0a0d1b;
+    smp.value = 1.0;
+    smp.severity = 1;
+
+    EPICS::ScalarDouble msg;
+    msg.set_secondsintoyear(smp.stamp.secPastEpoch);
+    msg.set_nano(smp.stamp.nsec);
+    msg.set_val(smp.value);
+    msg.set_severity(smp.severity);
+    for (size_t i=0; i<fieldvalues.size(); i++) {
+        EPICS::FieldValue* FV(msg.add_fieldvalues());
+        FV->set_name(fieldvalues[i].first);
+        FV->set_val(fieldvalues[i].second);
+    }
+
+    char raw[sampleenc<DBR_TIME_DOUBLE,0>::maxsize];
+    size_t len = sampleenc<DBR_TIME_DOUBLE,0>::encode(raw, smp.stamp.secPastEpoch, smp.stamp.nsec,
+                                                      &smp, smp.severity, smp.status);
+    testOk1(std::string(raw, len)+block==msg.SerializeAsString());
+
+    escapingstream expected, actual;
+    expected.serialize(msg);
+    actual.put(raw, len, block);
+    testOk(std::string(actual.data(), actual.size())==std::string(expected.data(), expected.size()),
+           "put() with the block");
+
+    // the fields of a reconnection come first
+    EPICS::ScalarDouble reconnected;
+    reconnected.set_secondsintoyear(smp.stamp.secPastEpoch);
+    reconnected.set_nano(smp.stamp.nsec);
+    reconnected.set_val(smp.value);
+    EPICS::FieldValue* FV(reconnected.add_fieldvalues());
+    FV->set_name("cnxlostepsecs");
+    FV->set_val("1425494780");
+    actual.serialize(reconnected, block);
+    for (size_t i=0; i<fieldvalues.size(); i++) {
+        EPICS::FieldValue* FV(reconnected.add_fieldvalues());
+        FV->set_name(fieldvalues[i].first);
+        FV->set_val(fieldvalues[i].second);
+    }
+    expected.serialize(reconnected);
+    testOk(std::string(actual.data(), actual.size())==std::string(expected.data(), expected.size()),
+           "serialize() with the block");
+}
+
+static void testSampleBatch()
+{
+    testDiag("Test columns of samples");
+
+    SampleBatch batch;
+    batch.clear(DBR_TIME_LONG);
+    for (int i=0; i<10; i++) {
+        epicsTimeStamp stamp = {epicsUInt32(1000+10*i), epicsUInt32(i)};
+        batch.pushStamp(stamp, i%3, i%5);
+        batch.longs.push_back(-i);
+    }
+    testOk1(batch.sorted && batch.size()==10);
+    testOk1(batch.split(0, 1045)==5 && batch.split(5, 1050)==5 && batch.split(3, 2000)==10);
+
+    epicsUInt32 secs[10];
+    batch.secondsIntoYear(2, 10, 1000, secs);
+    testOk1(secs[0]==20 && secs[7]==90);
+
+    dbr_time_double smp;
+    batch.get(7, smp);
+    testOk1(smp.stamp.secPastEpoch==1070 && smp.stamp.nsec==7 && smp.severity==1 && smp.status==2 &&
+            reinterpret_cast<dbr_time_long*>(&smp)->value==-7);
+
+    // time going backwards is split at the first sample past the end
+    epicsTimeStamp back = {1005, 0};
+    batch.pushStamp(back, 0, 0);
+    batch.longs.push_back(0);
+    testOk1(!batch.sorted && batch.split(0, 1045)==5 && batch.split(6, 1100)==11);
+}
+
+// The rows of a query in FETCH_CHUNK mode, as a single chunk, without a
+// connection. The cursor is not open, so the query ends with the chunk.
+class chunkreader : public PGSQLReader
+{
+public:
+    explicit chunkreader(int nrows)
+    {
+        fDBRtype = DBR_TIME_LONG;
+        fFetchMode = FETCH_CHUNK;
+        fBatch.resize(nrows);
+        for (int i=0; i<nrows; i++) {
+            fBatch[i].stamp.secPastEpoch = 1000+i;
+            reinterpret_cast<dbr_time_long*>(&fBatch[i])->value = i;
+        }
+        fBatchPos = 1;
+        fCurrent = &fBatch[0];
+    }
+};
+
+static void testReadBatch(int nrows)
+{
+    const size_t max = 1024;
+    chunkreader reader(nrows);
+    SampleBatch batch;
+    std::vector<epicsInt32> values;
+    // as PBWriter::refill()
+    while (reader.get()) {
+        batch.clear(reader.getType());
+        if (reader.readBatch(batch, max)==0)
+            break;
+        values.insert(values.end(), batch.longs.begin(), batch.longs.end());
+    }
+    bool inorder = true;
+    for (size_t i=0; i<values.size(); i++)
+        inorder = inorder && values[i]==epicsInt32(i);
+    testOk(values.size()==size_t(nrows) && inorder, "%d rows read once each, got %d",
+           nrows, int(values.size()));
+    testOk(reader.get()==0, "get() is NULL at the end of %d rows", nrows);
+    // as SampleFetcher::run(), which reads until a batch is not full
+    batch.clear(reader.getType());
+    testOk1(reader.readBatch(batch, max)==0 && batch.empty());
+}
+
+static void testReaderBatches()
+{
+    testDiag("Test the end of the query in batches of the reader");
+    // multiples of the batch size end with a full batch
+    testReadBatch(1024);
+    testReadBatch(2048);
+    testReadBatch(1500);
+}
+
+static void testRing()
+{
+    testDiag("Test handoff through spscring");
+    spscring<std::vector<int> > ring(2);
+    const int n = 1000;
+
+    std::thread producer([&]() {
+        std::vector<int> item;
+        for (int i=1; i<=n; i++) {
+            item.assign(i%7+1, i);
+            ring.push(item);
+        }
+        item.clear();
+        ring.push(item);
+    });
+
+    int count = 0, inorder = 1;
+    std::vector<int> item;
+    for (;;) {
+        ring.pop(item);
+        if (item.empty())
+            break;
+        count++;
+        if (item[0]!=count || item.size()!=(size_t)(count%7+1))
+            inorder = 0;
+    }
+    producer.join();
+
+    testOk(count==n, "items %d", count);
+    testOk1(inorder);
+}
+
+static std::string readFile(const std::string& fname)
+{
+    std::ifstream in(fname.c_str(), std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+static void testSched()
+{
+    testDiag("Test the size-aware scheduler");
+
+    double c[] = {1, 9, 3, 7, 5, 2};
+    std::vector<double> cost(c, c+6);
+    worksched sched(cost, 2);
+
+    // queues are {9, 3, 2} and {7, 5, 1}
+    size_t job;
+    testOk(sched.take(0, job) && job==1, "largest first, got %u", (unsigned)job);
+    std::vector<size_t> taken(1, job);
+    size_t j1, j2, j3;
+    sched.take(1, j1);
+    sched.take(1, j2);
+    sched.take(1, j3);
+    testOk1(j1==3 && j2==4 && j3==0);
+    testOk(sched.take(1, job) && job==5, "steals the smallest, got %u", (unsigned)job);
+    taken.push_back(j1);
+    taken.push_back(j2);
+    taken.push_back(j3);
+    taken.push_back(job);
+    while (sched.take(0, job))
+        taken.push_back(job);
+    std::sort(taken.begin(), taken.end());
+    testOk1(taken.size()==6 && std::unique(taken.begin(), taken.end())==taken.end());
+}
+
+static void testFile()
+{
+    testDiag("Test pbfile in the writer thread");
+    char const *folder = getenv("TMPDIR");
+    if (folder == 0)
+        folder = "/tmp";
+    const std::string fname = std::string(folder) + "/testPBfile.pb";
+    remove(fname.c_str());
+
+    // more than a block, written across a reopen
+    std::string expect;
+    {
+        pbfile out(PBFILE_THREAD);
+        out.open(fname);
+        for (int i=0; i<100000; i++) {
+            char line[16];
+            int len = snprintf(line, sizeof(line), "%d\n", i);
+            out.write(line, len);
+            expect.append(line, len);
+            if (i==50000) {
+                out.close();
+                out.open(fname);
+            }
+        }
+        out.close();
+        testOk1(out.good());
+    }
+
+    testOk(readFile(fname)==expect, "size %u", (unsigned)expect.size());
+
+    // a partial line left by a crash is dropped at reopen
+    {
+        std::ofstream crashed(fname.c_str(), std::ios::binary|std::ios::app);
+        crashed << "partial";
+    }
+    {
+        pbfile out;
+        out.open(fname);
+        out.write("next\n", 5);
+        out.close();
+        expect += "next\n";
+        testOk(out.good() && readFile(fname)==expect, "partial line truncated");
+    }
+
+    // preallocated space does not show in the size
+    pbfile::setPreallocate(1024*1024);
+    {
+        pbfile out(PBFILE_THREAD, 4096);
+        out.open(fname);
+        for (int i=0; i<1000; i++) {
+            out.write("0123456789abcdef\n", 17);
+            expect += "0123456789abcdef\n";
+        }
+        out.close();
+        testOk(out.good() && readFile(fname)==expect, "preallocated");
+    }
+    pbfile::setPreallocate(0);
+    remove(fname.c_str());
+
+    // the directories are created along with the file
+    const std::string dir = std::string(folder) + "/testPBfile";
+    const std::string nested = dir + "/sub/testPBfile.pb";
+    {
+        pbfile out(PBFILE_URING, 4096);
+        testDiag("io_uring %s", out.mode()==PBFILE_URING ? "in use" : "not available");
+        out.open(nested, 1);
+        std::string lines;
+        for (int i=0; i<1000; i++) {
+            out.write("0123456789abcdef\n", 17);
+            lines += "0123456789abcdef\n";
+        }
+        out.close();
+        testOk(out.good() && readFile(nested)==lines, "written with mkdirs");
+    }
+    remove(nested.c_str());
+    rmdir((dir + "/sub").c_str());
+    rmdir(dir.c_str());
+}
+
+static std::string getLastSampleFile()
 {
     char const *folder = getenv("TMPDIR");
     if (folder == 0)
         folder = "/tmp";
     std::stringstream ss;
     ss<<folder<<"/lastSample:2015.pb";
-    return ss.str().c_str();
+    return ss.str();
 }
 
-//data to find the last sample in them
-static void genLastSampleData()
+//data to find the last sample in them, optionally followed by a partially written sample
+static void genLastSampleData(int nsamples, bool partial)
 {
     EPICS::ScalarInt encoder;
     EPICS::PayloadInfo info;
@@ -152,52 +758,255 @@ static void genLastSampleData()
     }
     encbuf.finalize();
 
-    outpb.open(getLastSampleFile(), std::fstream::out | std::fstream::binary);
+    outpb.open(getLastSampleFile().c_str(), std::fstream::out | std::fstream::binary);
     outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
 
     int i;
-    for (i = 0; i < 5; i++) {
+    for (i = 0; i < nsamples; i++) {
         encoder.Clear();
         encoder.set_secondsintoyear(1234+i);
         encoder.set_nano(5000 + i);
-        encoder.set_val(0);
+        // values which need escaping
+        encoder.set_val(i%2 ? 0x0a0d1b : 0);
         {
             google::protobuf::io::CodedOutputStream encstrm(&encbuf);
             encoder.SerializeToCodedStream(&encstrm);
         }
         encbuf.finalize();
-        outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+        if (partial && i == nsamples-1) {
+            // without the newline
+            outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size()/2);
+        } else {
+            outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+        }
     }
 
     outpb.close();
 
 }
 
+static void testCreateDirs()
+{
+    testDiag("Test the creation of directories through the cache");
+    char const *folder = getenv("TMPDIR");
+    if (folder == 0)
+        folder = "/tmp";
+    const std::string dir = std::string(folder) + "/testPBdirs";
+    const char* names[] = {"/a/b/c:2015.pb", "/a/d:2015.pb", "/a/b/c/e:2015.pb"};
+
+    int ok = 1;
+    for (int i=0; i<3; i++) {
+        const std::string fname = dir + names[i];
+        int fd = openCreateDirs(fname, O_WRONLY|O_CREAT, 0644);
+        ok &= fd>=0 && write(fd, "x\n", 2)==2;
+        if (fd>=0)
+            close(fd);
+        ok &= readFile(fname)=="x\n";
+    }
+    testOk(ok, "files created in new and cached directories");
+
+    createDirs(dir + "/f/g/h.pb");
+    struct stat st;
+    testOk(stat((dir + "/f/g").c_str(), &st)==0 && S_ISDIR(st.st_mode), "createDirs");
+
+    for (int i=2; i>=0; i--)
+        remove((dir + names[i]).c_str());
+    const char* dirs[] = {"/a/b/c", "/a/b", "/a", "/f/g", "/f", ""};
+    for (int i=0; i<6; i++)
+        rmdir((dir + dirs[i]).c_str());
+
+    // the directories removed are still in the cache
+    const std::string fname = dir + names[0];
+    int fd = openCreateDirs(fname, O_WRONLY|O_CREAT, 0644);
+    ok = fd>=0 && write(fd, "y\n", 2)==2;
+    if (fd>=0)
+        close(fd);
+    testOk(ok && readFile(fname)=="y\n", "recreated after the cached directories were removed");
+    createDirs(dir + "/f/g/h.pb");
+    testOk(stat((dir + "/f/g").c_str(), &st)==0 && S_ISDIR(st.st_mode), "createDirs after removal");
+
+    remove(fname.c_str());
+    for (int i=0; i<6; i++)
+        rmdir((dir + dirs[i]).c_str());
+}
+
+// big-endian, as in the data files of Channel Archiver
+static void put16(std::string& f, size_t at, epicsUInt16 v)
+{
+    f[at] = v>>8;
+    f[at+1] = v;
+}
+
+static void put32(std::string& f, size_t at, epicsUInt32 v)
+{
+    put16(f, at, v>>16);
+    put16(f, at+2, v);
+}
+
+static void putDataHeader(std::string& f, size_t at, int dbr, int count, int nsamples,
+                          epicsUInt32 ctrlinfo, const char* nextfile, epicsUInt32 nextoffset)
+{
+    put32(f, at+4, nextoffset);
+    put32(f, at+16, nsamples);
+    put32(f, at+20, ctrlinfo);
+    put16(f, at+32, dbr);
+    put16(f, at+34, count);
+    strcpy(&f[at+112], nextfile);
+}
+
+static void testDataFileReader()
+{
+    testDiag("Test reading the data files of Channel Archiver");
+    char const *folder = getenv("TMPDIR");
+    if (folder == 0)
+        folder = "/tmp";
+    const std::string first = std::string(folder) + "/testPBdata1";
+    const std::string second = std::string(folder) + "/testPBdata2";
+    const size_t hs = datafilereader::kHeaderSize;
+
+    // numeric info at 0, a block of two doubles at 64, the next block of
+    // the index in the second file, a short array with enumerated info behind
+    std::string f1(64+hs+2*sizeof(dbr_time_double), '\0');
+    put16(f1, 0, 4+28+5);
+    put16(f1, 2, 1);
+    float hopr = 10;
+    epicsUInt32 bits;
+    memcpy(&bits, &hopr, 4);
+    put32(f1, 4, bits);
+    put32(f1, 28, 3);
+    strcpy(&f1[32], "tick");
+    putDataHeader(f1, 64, DBR_TIME_DOUBLE, 1, 2, 0, "", 0);
+    for (int i=0; i<2; i++) {
+        size_t at = 64+hs+i*sizeof(dbr_time_double);
+        put16(f1, at+2, i+1);
+        put32(f1, at+4, 1000+i);
+        put32(f1, at+8, 500);
+        double val = 1.5*(i+1);
+        uint64_t vbits;
+        memcpy(&vbits, &val, 8);
+        put32(f1, at+16, vbits>>32);
+        put32(f1, at+20, vbits);
+    }
+
+    const size_t ssize = offsetof(dbr_time_short, value) + 2*sizeof(dbr_short_t);
+    std::string f2(hs+ssize, '\0');
+    putDataHeader(f2, 0, DBR_TIME_SHORT, 2, 1, hs+ssize, "", 0);
+    put32(f2, hs+4, 2000);
+    put16(f2, hs+offsetof(dbr_time_short, value), 7);
+    put16(f2, hs+offsetof(dbr_time_short, value)+2, 0xfffe);
+    f2.append("\0\0\0\x02\0\x02" "A\0third", 14);
+    put16(f2, hs+ssize, 14);
+
+    std::ofstream(first.c_str(), std::ios::binary) << f1;
+    std::ofstream(second.c_str(), std::ios::binary) << f2;
+
+    datafilereader reader;
+    const dbr_time_double* samp = reader.find(first, 64);
+    testOk1(samp && samp->stamp.secPastEpoch==1000 && samp->stamp.nsec==500
+            && samp->severity==1 && samp->value==1.5);
+    const datafilereader::ctrlinfo_t& info = reader.getInfo();
+    testOk1(info.type==datafilereader::ctrlinfo_t::Numeric && info.disp_high==10
+            && info.prec==3 && info.units=="tick");
+    unsigned serial = reader.getInfoSerial();
+    samp = reader.next();
+    testOk1(samp && samp->stamp.secPastEpoch==1001 && samp->value==3.0
+            && reader.getInfoSerial()==serial);
+    testOk(reader.next()==0, "end of the block");
+
+    const dbr_time_short* ssamp = (const dbr_time_short*)reader.find(second, 0);
+    testOk1(ssamp && reader.getType()==DBR_TIME_SHORT && reader.getCount()==2
+            && ssamp->stamp.secPastEpoch==2000 && (&ssamp->value)[0]==7 && (&ssamp->value)[1]==-2);
+    testOk1(reader.getInfoSerial()!=serial && info.type==datafilereader::ctrlinfo_t::Enumerated
+            && info.states.size()==2 && info.states[0]=="A" && info.states[1]=="third");
+    testOk1(reader.next()==0);
+
+    // more samples than the file holds
+    put32(f2, 16, 2);
+    std::ofstream(second.c_str(), std::ios::binary) << f2;
+    bool thrown = false;
+    try {
+        reader.find(second, 0);
+    } catch (std::runtime_error&) {
+        thrown = true;
+    }
+    testOk(thrown, "corrupted data header");
+
+    remove(first.c_str());
+    remove(second.c_str());
+}
+
 static void testFindLastSample()
 {
-    genLastSampleData();
+    genLastSampleData(5, false);
 
     EPICS::ScalarInt sample;
-    sample = searcher<DBR_TIME_LONG,0>::getLastSample(getLastSampleFile());
+    sample = searcher<DBR_TIME_LONG,0>::getLastSample(getLastSampleFile().c_str());
     testOk(sample.secondsintoyear() == 1238, "Sample seconds %d",sample.secondsintoyear());
     testOk(sample.nano() == 5004, "Sample nanos %d",sample.nano());
 
     EPICS::ScalarDouble sampleDouble;
     try {
-        sampleDouble = searcher<DBR_TIME_DOUBLE,0>::getLastSample(getLastSampleFile());
+        sampleDouble = searcher<DBR_TIME_DOUBLE,0>::getLastSample(getLastSampleFile().c_str());
         testOk(0,"Should fail the conversion because of mismatching type");
     } catch (std::invalid_argument& e) {
         testOk1(1);
     }
-    remove(getLastSampleFile());
+
+    epicsTimeStamp stamp, year;
+    getStartOfYear(2015, &year);
+    testOk1(getLastSampleTime(getLastSampleFile().c_str(), &stamp)
+            && stamp.secPastEpoch==year.secPastEpoch+1238 && stamp.nsec==5004);
+
+    testDiag("Partially written last sample is ignored");
+    genLastSampleData(5, true);
+    sample = searcher<DBR_TIME_LONG,0>::getLastSample(getLastSampleFile().c_str());
+    testOk(sample.secondsintoyear() == 1237, "Sample seconds %d",sample.secondsintoyear());
+
+    testDiag("File larger than the read block");
+    genLastSampleData(20000, false);
+    sample = searcher<DBR_TIME_LONG,0>::getLastSample(getLastSampleFile().c_str());
+    testOk(sample.secondsintoyear() == 1234+19999, "Sample seconds %d",sample.secondsintoyear());
+    testOk(sample.val() == 0x0a0d1b, "Sample value %x",sample.val());
+
+    testDiag("Header only");
+    genLastSampleData(0, false);
+    sample = searcher<DBR_TIME_LONG,0>::getLastSample(getLastSampleFile().c_str());
+    testOk(sample.secondsintoyear() == 0, "Sample seconds %d",sample.secondsintoyear());
+    testOk1(!getLastSampleTime(getLastSampleFile().c_str(), &stamp));
+
+    testDiag("Broken header");
+    {
+        std::ofstream outpb(getLastSampleFile().c_str(), std::fstream::out | std::fstream::binary);
+        outpb << "garbage\n";
+    }
+    try {
+        sample = searcher<DBR_TIME_LONG,0>::getLastSample(getLastSampleFile().c_str());
+        testOk(0,"Should fail to decode the header");
+    } catch (std::runtime_error& e) {
+        testOk1(1);
+    }
+    remove(getLastSampleFile().c_str());
 }
 
 MAIN(testPB)
 {
-    testPlan(29);
+    testPlan(111);
     testTime();
+    testIsoTime();
     testEscape();
+    testEscapeKernels();
     writeSample();
+    testEscapingStream();
+    testSampleEncoder();
+    testWaveformValues();
+    testFieldValuesBlock();
+    testSampleBatch();
+    testReaderBatches();
+    testRing();
+    testSched();
+    testFile();
+    testCreateDirs();
+    testDataFileReader();
     testFindLastSample();
     return testDone();
 }
@@ -63,6 +63,8 @@ class TempDir(object):
 class TestDate(unittest.TestCase):
     """Run test case in temporery directory
     """
+    options = []
+
     def prepareDir(self):
         import subprocess as SP
         SP.check_call([pbgentestdata, os.getcwd()+'/index'])
@@ -70,9 +72,9 @@ class TestDate(unittest.TestCase):
     def cleanupDir(self):
         pass
 
-    def convertPV(self, name):
+    def convertPV(self, name, extra=[]):
         import subprocess as SP
-        worker = SP.Popen([pbexport, os.getcwd()+'/index'], stdin=SP.PIPE)
+        worker = SP.Popen([pbexport]+self.options+extra+[os.getcwd()+'/index'], stdin=SP.PIPE)
         worker.stdin.write(name+'\n')
         worker.stdin.write('<>exit\n')
         self.assertEqual(worker.wait(), 0)
@@ -122,7 +124,7 @@ class TestDate(unittest.TestCase):
 
     def test_string(self):
         self.convertPV('a:string:pv')
-        self.assertPBFile('a/string/pv:2015.pb',
+        self.assertPBFile('a/string/pv:2015_03.pb',
             head={'year':2015, 'type':0},
             contents=[
                 ('hello', {'sec':1425494780}),
@@ -132,7 +134,7 @@ class TestDate(unittest.TestCase):
 
     def test_counter(self):
         self.convertPV('pv-counter')
-        self.assertPBFile('pv/counter:2015.pb',
+        self.assertPBFile('pv/counter:2015_03.pb',
             head={'year':2015, 'type':5},
             contents=[
                 (0, {'sec':1425494780, 'ns':0, 'fv':[
@@ -153,7 +155,7 @@ class TestDate(unittest.TestCase):
 
     def test_enum(self):
         self.convertPV('enum:pv')
-        self.assertPBFile('enum/pv:2015.pb',
+        self.assertPBFile('enum/pv:2015_03.pb',
             head={'year':2015, 'type':3},
             contents=[
                 (2, {'sec':1425494780, 'fv':[('states','A;B;third')]}),
@@ -163,7 +165,7 @@ class TestDate(unittest.TestCase):
 
     def test_disconn(self):
         self.convertPV('pv:discon1')
-        self.assertPBFile('pv/discon1:2015.pb',
+        self.assertPBFile('pv/discon1:2015_03.pb',
             head={'year':2015, 'type':6},
             contents=[
                 (42, {'sec':1425494780, 'fv':[
@@ -176,7 +178,7 @@ class TestDate(unittest.TestCase):
 
     def test_restart(self):
         self.convertPV('pv:restart1')
-        self.assertPBFile('pv/restart1:2015.pb',
+        self.assertPBFile('pv/restart1:2015_03.pb',
             head={'year':2015, 'type':6},
             contents=[
                 (42, {'sec':1425494780, 'fv':[
@@ -189,7 +191,7 @@ class TestDate(unittest.TestCase):
 
     def test_disable(self):
         self.convertPV('pv:disable1')
-        self.assertPBFile('pv/disable1:2015.pb',
+        self.assertPBFile('pv/disable1:2015_03.pb',
             head={'year':2015, 'type':6},
             contents=[
                 (42, {'sec':1425494780, 'fv':[
@@ -202,7 +204,7 @@ class TestDate(unittest.TestCase):
 
     def test_repeat(self):
         self.convertPV('pv:repeat1')
-        self.assertPBFile('pv/repeat1:2015.pb',
+        self.assertPBFile('pv/repeat1:2015_03.pb',
             head={'year':2015, 'type':6},
             contents=[
                 (42, {'sec':1425494780, 'fv':[
@@ -218,7 +220,7 @@ class TestDate(unittest.TestCase):
         self.convertPV('pv:skip')
         self.convertPV('pv:skip')
         #After two conversion the file still has one set of data
-        self.assertPBFile('pv/skip:2015.pb',
+        self.assertPBFile('pv/skip:2015_03.pb',
             head={'year':2015, 'type':6},
             contents=[
                 (42, {'sec':1425494780, 'fv':[
@@ -231,7 +233,7 @@ class TestDate(unittest.TestCase):
                 ])
         #Convert one more time and check that file is still the same
         self.convertPV('pv:skip')
-        self.assertPBFile('pv/skip:2015.pb',        
+        self.assertPBFile('pv/skip:2015_03.pb',        
             head={'year':2015, 'type':6},
             contents=[
                 (42, {'sec':1425494780, 'fv':[
@@ -243,5 +245,50 @@ class TestDate(unittest.TestCase):
                 (42, {'sec':1425494795, 'ns':4000}),
                 ])
 
+    def test_window(self):
+        self.convertPV('pv-counter', ['-s', '2015-03-04T18:46:23', '-e', '2015-03-04T19:46:26+01:00'])
+        self.assertPBFile('pv/counter:2015_03.pb',
+            head={'year':2015, 'type':5},
+            contents=[
+                (3, {'sec':1425494783, 'ns':30, 'fv':[
+                    ('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                    ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),
+                    ]}),
+                (4, {'sec':1425494784, 'ns':40}),
+                (5, {'sec':1425494785, 'ns':50}),
+                ])
+
+    def test_incremental(self):
+        self.convertPV('pv-counter', ['-e', '2015-03-04T18:46:22'])
+        self.convertPV('pv-counter', ['-i'])
+        #The second run appends the samples after the first one,
+        #with the fields again
+        self.assertPBFile('pv/counter:2015_03.pb',
+            head={'year':2015, 'type':5},
+            contents=[
+                (0, {'sec':1425494780, 'ns':0, 'fv':[
+                    ('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                    ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),
+                    ]}),
+                (1, {'sec':1425494781, 'ns':10}),
+                (2, {'sec':1425494782, 'ns':20, 'fv':[
+                    ('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                    ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),
+                    ]}),
+                (3, {'sec':1425494783, 'ns':30}),
+                (4, {'sec':1425494784, 'ns':40}),
+                (5, {'sec':1425494785, 'ns':50}),
+                (6, {'sec':1425494786, 'ns':60}),
+                (7, {'sec':1425494787, 'ns':70}),
+                (8, {'sec':1425494788, 'ns':80}),
+                (9, {'sec':1425494789, 'ns':90}),
+                (10,{'sec':1425494790, 'ns':100}),
+                ])
+
+class TestDateMapped(TestDate):
+    """Same, with the data files read through mmap()
+    """
+    options = ['-m']
+
 if __name__=='__main__':
     unittest.main()